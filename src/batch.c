@@ -0,0 +1,969 @@
+#include "scan.h"
+#include "carve.h"
+#include "fingerprint.h"
+#include "log.h"
+#include "manifest.h"
+#include "output.h"
+#include "source.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// A task of the batch, one chunk of an image or a whole image
+typedef struct batch_task
+{
+    int image; // The image in the batch
+    int chunk; // The chunk of the image, 0 for a whole image
+} batch_task;
+
+// A chunk of an image. Its region runs to the end of the image so the carve open at its end is finished,
+// but it starts no carve past its end, that is left to the next chunk.
+typedef struct batch_chunk
+{
+    scan_job job;       // The scan of the chunk
+    uint64_t end;       // The offset in the image the chunk starts no carve at or past
+    manifest_rows rows; // Its carves
+    uint64_t from;      // Where its carves start once merged, a scan from there carves the same
+    int *originals;     // For a reused chunk, the chunk holding the original of every duplicate, see fingerprint_chunk
+    bool exact;         // Whether it starts where the chunks before it left off, otherwise it may have to be scanned again
+    bool fingerprinted; // Whether its blocks were hashed, an incremental scan does it before its first scan
+    bool reused;        // Whether its carves were taken from the last incremental scan instead of scanning it
+    bool trimmed;       // Whether some of its carves were dropped when it was merged
+    bool done;          // Whether it was scanned
+} batch_chunk;
+
+// An image of the batch
+typedef struct batch_image
+{
+    cl_args args;            // The command line args with the image as the file
+    bool dedup;              // Whether the carves of the image are deduplicated, after its chunks are merged
+    uint64_t size;           // Its size in bytes
+    int alignment;           // The header alignment of its chunks
+    uint64_t cluster_base;   // The offset of its first cluster
+    batch_chunk *chunks;     // Its chunks, in order
+    int chunk_count;         // Their number, 1 for an image scanned whole
+    bool whole;              // Whether it is scanned in one task, keeping its checkpoint and manifest as a single scan does
+    int merged;              // The chunks merged, in order
+    uint64_t resync;         // Where the merged chunks left off, the next one has to agree with them from there
+    int files;               // The files carved once the image is done
+    bool failed;             // Whether a chunk could not be scanned
+    bool incremental;        // Whether the chunks that did not change since the last scan keep their carves
+    fingerprint_db previous; // The fingerprints and carves of the last incremental scan, no chunks when there is none
+    uint64_t *blocks;        // The fingerprints of this scan, every chunk hashes its own blocks
+    pthread_mutex_t lock;    // Guards the merging
+} batch_image;
+
+// The tasks of a worker. The worker takes the oldest one, the other workers steal the newest ones once they ran out.
+typedef struct task_deque
+{
+    batch_task *tasks;    // A ring of the tasks
+    int head;             // The oldest task
+    int count;            // Their number
+    int capacity;         // The size of the ring
+    pthread_mutex_t lock; // Guards the ring
+} task_deque;
+
+// The workers of a batch and what they share
+typedef struct batch_pool
+{
+    batch_image *images;  // The images
+    int image_count;      // Their number
+    task_deque *deques;   // The tasks of every worker
+    int workers;          // The number of workers
+    int outstanding;      // The tasks queued or running, the workers stop once it is 0
+    pthread_mutex_t lock; // Guards `outstanding`, and is held to sleep
+    pthread_cond_t work;  // Signalled when a task is queued or the last one is done
+} batch_pool;
+
+// The argument of a worker thread
+typedef struct batch_worker
+{
+    batch_pool *pool; // The pool
+    int index;        // Its deque
+} batch_worker;
+
+/**
+ * @brief Adds an image to the list, a regular file only
+ */
+static void add_image(char ***paths, int *count, int *capacity, const char *path)
+{
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        log_msg(LOG_ERROR, "Skipping '%s', it is not a file\n", path);
+        return;
+    }
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? 2 * *capacity : 16;
+        *paths = realloc(*paths, *capacity * sizeof(char *));
+        CHECK_OR_EXIT(*paths);
+    }
+    (*paths)[*count] = strdup(path);
+    CHECK_OR_EXIT((*paths)[*count]);
+    (*count)++;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Lists the images of the batch: the files of a directory in name order, or the lines of a list file
+ *        (blank lines and lines starting with # are skipped)
+ *
+ * @param batch The directory or list file
+ * @param paths Receives the image paths
+ * @return Their number, -1 if the batch could not be read
+ */
+static int list_images(const char *batch, char ***paths)
+{
+    int count = 0, capacity = 0;
+    *paths = NULL;
+    DIR *directory = opendir(batch);
+    if (directory)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != NULL)
+        {
+            if (entry->d_name[0] == '.')
+            {
+                continue;
+            }
+            char path[FILENAME_MAX];
+            snprintf(path, sizeof(path), "%s/%s", batch, entry->d_name);
+            add_image(paths, &count, &capacity, path);
+        }
+        closedir(directory);
+        if (count)
+        {
+            qsort(*paths, count, sizeof(char *), compare_paths);
+        }
+        return count;
+    }
+
+    FILE *list = fopen(batch, "r");
+    if (list == NULL)
+    {
+        log_msg(LOG_ERROR, "Error reading the batch '%s'\n", batch);
+        return -1;
+    }
+    char line[FILENAME_MAX];
+    while (fgets(line, sizeof(line), list))
+    {
+        strip(line);
+        if (line[0] && line[0] != '#')
+        {
+            add_image(paths, &count, &capacity, line);
+        }
+    }
+    fclose(list);
+    return count;
+}
+
+/**
+ * @brief Picks the output directory of an image, `<name>.recovered` in the --output directory, with -2, -3, ...
+ *        when two images of the batch have the same name
+ *
+ * @return false if the directory is longer than FILENAME_MAX
+ */
+static bool image_directory(batch_image *images, int count, const char *output, const char *path, char directory[FILENAME_MAX])
+{
+    const char *name = strrchr(path, '/');
+    const char *backslash = strrchr(path, '\\');
+    name = backslash > name ? backslash : name;
+    name = name ? name + 1 : path;
+    const char *separator = output[0] ? "/" : "";
+    for (int n = 1;; n++)
+    {
+        int length;
+        if (n == 1)
+            length = snprintf(directory, FILENAME_MAX, "%s%s%s.recovered", output, separator, name);
+        else
+            length = snprintf(directory, FILENAME_MAX, "%s%s%s.recovered-%d", output, separator, name, n);
+        if (length < 0 || length >= FILENAME_MAX)
+        {
+            return false;
+        }
+
+        bool taken = false;
+        for (int i = 0; i < count && !taken; i++)
+        {
+            taken = strcmp(images[i].chunks[0].job.directory, directory) == 0;
+        }
+        if (!taken)
+        {
+            return true;
+        }
+    }
+}
+
+/**
+ * @brief Points a chunk at the part of the image from `from` on, it starts no carve at or past its end
+ */
+static void chunk_region(batch_image *image, batch_chunk *chunk, uint64_t from)
+{
+    chunk->job.offset = from;
+    chunk->job.length = image->size - from;
+    chunk->job.header_end = chunk->end - from;
+
+    // The cluster starts of the image, as seen from the start of the region
+    uint64_t a = image->alignment > 1 ? (uint64_t)image->alignment : 1;
+    chunk->job.cluster_base = ((image->cluster_base % a) + a - (from % a)) % a;
+}
+
+/**
+ * @brief Fills in the settings of an image that decide how its chunks are carved
+ */
+static void image_settings(const batch_image *image, fingerprint_db *db)
+{
+    memset(db, 0, sizeof(fingerprint_db));
+    db->object_size = image->size;
+    db->chunk_size = (uint64_t)image->args.chunk_size * 1024 * 1024;
+    db->alignment = image->alignment;
+    db->cluster_base = image->cluster_base;
+    db->hash = image->args.hash;
+    db->layout = image->args.layout;
+    db->dedup = image->dedup;
+    db->skip_corrupt = image->args.skip_corrupt;
+    strcpy(db->known_hashes, image->args.known_hashes);
+}
+
+/**
+ * @brief Removes the files of the carves of an earlier scan, the duplicates and known files have none
+ */
+static void remove_carves(const manifest_rows *rows)
+{
+    for (size_t i = 0; i < rows->count; i++)
+    {
+        if (rows->rows[i].duplicate_of == NULL)
+        {
+            remove(rows->rows[i].name);
+        }
+    }
+}
+
+/**
+ * @brief Sets up the incremental scan of a chunked image: loads the fingerprint database of its last scan, which is
+ *        only kept when its chunks were carved with the same settings, and removes the carves that cannot be reused
+ */
+static void incremental_init(batch_image *image)
+{
+    scan_job *job = &image->chunks[0].job;
+    char path[FILENAME_MAX];
+    job_path(job, JOB_FINGERPRINTS, path);
+    image->incremental = true;
+    image->blocks = calloc((image->size + FINGERPRINT_BLOCK - 1) / FINGERPRINT_BLOCK, sizeof(uint64_t));
+    CHECK_OR_EXIT(image->blocks);
+    if (!fingerprint_load(path, &image->previous))
+    {
+        log_msg(LOG_INFO, "%s: no earlier scan to reuse, every chunk is scanned\n", job->name);
+        return;
+    }
+
+    fingerprint_db current;
+    image_settings(image, &current);
+    bool compatible = fingerprint_compatible(&image->previous, &current);
+    for (int k = compatible ? image->chunk_count : 0; k < image->previous.chunk_count; k++)
+    {
+        remove_carves(&image->previous.chunks[k].rows); // Past the end of the image, or carved another way
+    }
+    if (!compatible)
+    {
+        log_msg(LOG_INFO, "%s: the earlier scan used other settings, every chunk is scanned\n", job->name);
+        fingerprint_free(&image->previous);
+    }
+}
+
+/**
+ * @brief Sets up an image: a seekable image larger than a chunk is split into chunks of --chunk-size MiB, anything
+ *        else is scanned whole
+ *
+ * @return 1 if the image was set up, 0 if it was already scanned, -1 if it could not be opened
+ */
+static int image_init(cl_args *args, batch_image *images, int count, const char *path)
+{
+    batch_image *image = &images[count];
+    memset(image, 0, sizeof(batch_image));
+    image->args = *args;
+    strncpy(image->args.filename, path, FILENAME_MAX - 1);
+    image->args.filename[FILENAME_MAX - 1] = '\0';
+    image->args.batch[0] = '\0';
+    image->dedup = args->dedup;
+
+    source *src = source_open(&image->args, 0, 0);
+    if (src == NULL)
+    {
+        return -1;
+    }
+    image->size = src->size;
+    image->alignment = args->align < 0 ? 1 : args->align;
+    if (image->alignment == 0)
+    {
+        uint64_t cluster, base;
+        bool found = fs_geometry(src, &cluster, &base) && cluster <= 64 * 1024 * 1024;
+        image->alignment = found ? (int)cluster : 1;
+        image->cluster_base = found ? base : 0;
+    }
+    bool seekable = src->seek != NULL;
+    source_close(src);
+
+    // The filesystem analysis, the bad sector retries and streamed images need the image as one scan
+    uint64_t chunk_bytes = (uint64_t)args->chunk_size * 1024 * 1024;
+    image->whole = !seekable || args->unallocated || args->retry_bad || image->size == 0 ||
+                   (image->size <= chunk_bytes && !args->incremental);
+    image->chunk_count = image->whole ? 1 : (int)((image->size + chunk_bytes - 1) / chunk_bytes);
+    image->chunks = calloc(image->chunk_count, sizeof(batch_chunk));
+    CHECK_OR_EXIT(image->chunks);
+
+    char directory[FILENAME_MAX];
+    if (args->batch[0] && !image_directory(images, count, args->output, path, directory))
+    {
+        log_msg(LOG_ERROR, "The output directory of '%s' is longer than %d bytes\n", path, FILENAME_MAX - 1);
+        free(image->chunks);
+        return -1;
+    }
+    if (!args->batch[0])
+    {
+        strcpy(directory, args->output); // The image of an incremental scan, in the --output directory
+    }
+    for (int k = 0; k < image->chunk_count; k++)
+    {
+        scan_job *job = &image->chunks[k].job;
+        const char *name = strrchr(path, '/');
+        snprintf(job->name, sizeof(job->name), "%s", name ? name + 1 : path);
+        strcpy(job->directory, directory);
+    }
+    if (image->whole)
+    {
+        // The job finds the cluster size itself when it is 0
+        image->chunks[0].job.alignment = args->align < 0 ? 1 : args->align;
+        return 1;
+    }
+
+    // The files the batch keeps for a chunked image next to its carves, the chunks do not write them
+    char done_path[FILENAME_MAX], other_path[FILENAME_MAX];
+    if (!job_path(&image->chunks[0].job, JOB_DONE, done_path) ||
+        !job_path(&image->chunks[0].job, JOB_FINGERPRINTS, other_path) ||
+        !job_path(&image->chunks[0].job, args->manifest, other_path))
+    {
+        log_msg(LOG_ERROR, "The directory '%s' is too long for the files of the scan\n", directory);
+        free(image->chunks);
+        return -1;
+    }
+    if (directory[0] && !make_directory(directory))
+    {
+        log_msg(LOG_ERROR, "Error creating the directory '%s'\n", directory);
+        free(image->chunks);
+        return -1;
+    }
+    FILE *done = fopen(done_path, "r");
+    if (done)
+    {
+        fclose(done);
+        if (args->resume)
+        {
+            log_msg(LOG_INFO, "%s was already scanned\n", path);
+            free(image->chunks);
+            return 0;
+        }
+        remove(done_path);
+    }
+
+    // The chunks are scanned without the manifest file and deduplication, both are done once they are merged,
+    // and a carve is named after its offset since the counter of a chunk does not know the ones before it
+    image->args.dedup = false;
+    image->args.offset_names = true;
+    for (int k = 0; k < image->chunk_count; k++)
+    {
+        batch_chunk *chunk = &image->chunks[k];
+        uint64_t start = k * chunk_bytes;
+        chunk->end = start + chunk_bytes < image->size ? start + chunk_bytes : image->size;
+        chunk->exact = k == 0;
+        chunk->job.alignment = image->alignment;
+        chunk->job.rows = &chunk->rows;
+        chunk_region(image, chunk, start);
+    }
+    if (args->incremental)
+    {
+        incremental_init(image);
+    }
+    return 1;
+}
+
+/**
+ * @brief Whether a chunk that started early went through `offset` the way the chunks before it did, i.e. it was not
+ *        in the middle of a carve there. From there on it carved the same as a scan of the whole image.
+ */
+static bool chunk_agrees(const batch_chunk *chunk, uint64_t offset)
+{
+    for (size_t i = 0; i < chunk->rows.count; i++)
+    {
+        const carve_record *row = &chunk->rows.rows[i];
+        if (row->start == offset)
+        {
+            return true; // The header the scan found there
+        }
+
+        // After a trailer the scan goes on right after the first byte of the trailer, it may hold the next header
+        uint64_t resume = row->end;
+        for (int t = 0; t < FILE_TYPES_COUNT && row->reason == END_TRAILER; t++)
+        {
+            resume = strcmp(row->type, file_exts[t]) == 0 ? row->end - trailer_sizes[t] + 1 : resume;
+        }
+        if (row->start < offset && offset < resume)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Whether the file of a carve was written: it is neither a known file nor a corrupt one that was skipped
+ */
+static bool row_written(const batch_image *image, const carve_record *row)
+{
+    return row->duplicate_of == NULL && !(image->args.skip_corrupt && row->status == STATUS_CORRUPT);
+}
+
+/**
+ * @brief Drops the carves of a chunk starting before `offset` and removes their files
+ */
+static void chunk_discard(batch_image *image, batch_chunk *chunk, uint64_t offset)
+{
+    size_t kept = 0;
+    bool drained = false;
+    for (size_t i = 0; i < chunk->rows.count; i++)
+    {
+        carve_record *row = &chunk->rows.rows[i];
+        if (row->start >= offset)
+        {
+            chunk->rows.rows[kept++] = *row;
+            continue;
+        }
+        if (row_written(image, row))
+        {
+            if (!drained)
+            {
+                writer_drain(); // Its pieces must be on disk before the file goes
+                drained = true;
+            }
+            remove(row->name);
+        }
+        manifest_row_free(row);
+    }
+    chunk->rows.count = kept;
+}
+
+/**
+ * @brief Hashes the blocks of a chunk of an incremental scan and takes its carves from the last scan when none of the
+ *        bytes they depend on changed: those from where its carves started to where its scan stopped, and the few
+ *        past it the signatures there look at. These can reach into the next chunks, whose blocks it hashes as well.
+ *        The files of the carves of a chunk that changed are removed, it is scanned again.
+ *
+ * @return true if the carves were reused, the chunk needs no scan
+ */
+static bool chunk_reuse(batch_image *image, int k)
+{
+    batch_chunk *chunk = &image->chunks[k];
+    fingerprint_db *previous = &image->previous;
+    fingerprint_chunk *old = k < previous->chunk_count ? &previous->chunks[k] : NULL;
+    uint64_t start = (uint64_t)k * image->args.chunk_size * 1024 * 1024;
+    size_t first = start / FINGERPRINT_BLOCK, last = (chunk->end + FINGERPRINT_BLOCK - 1) / FINGERPRINT_BLOCK;
+    source *src = source_open(&image->args, 0, 0);
+    bool same = src && fingerprint_blocks(src, first, last, &image->blocks[first]) && old;
+
+    // A chunk that ran to the end of the image depends on where it ends
+    uint64_t until = same ? old->stop + SIGNATURE_MAX - 1 : 0;
+    if (same && (until >= previous->object_size || until >= image->size))
+    {
+        same = image->size == previous->object_size;
+        until = image->size;
+    }
+    size_t end = (until + FINGERPRINT_BLOCK - 1) / FINGERPRINT_BLOCK;
+    for (size_t b = same ? old->from / FINGERPRINT_BLOCK : end; b < end && same; b++)
+    {
+        uint64_t hash = 0;
+        if (b < last)
+            hash = image->blocks[b];
+        else
+            same = fingerprint_blocks(src, b, b + 1, &hash);
+        same = same && b < previous->block_count && hash == previous->blocks[b];
+    }
+    if (src)
+    {
+        source_close(src);
+    }
+
+    // A file removed since is carved again
+    struct stat info;
+    for (size_t i = 0; same && i < old->rows.count; i++)
+    {
+        const carve_record *row = &old->rows.rows[i];
+        same = !row_written(image, row) || stat(row->name, &info) == 0;
+    }
+    if (!same)
+    {
+        if (old)
+        {
+            remove_carves(&old->rows);
+        }
+        return false;
+    }
+
+    chunk->rows = old->rows;
+    chunk->originals = old->originals;
+    memset(&old->rows, 0, sizeof(manifest_rows));
+    old->originals = NULL;
+    chunk->job.offset = old->from;
+    chunk->job.stop = old->stop;
+    chunk->job.status = EXIT_SUCCESS;
+    chunk->reused = true;
+    return true;
+}
+
+/**
+ * @brief Whether the duplicates among the carves a reused chunk keeps from `from` on still have their originals: a
+ *        duplicate has no file of its own, so the carve it is a duplicate of has to be kept as well, i.e. its chunk
+ *        was reused and none of its carves were dropped
+ */
+static bool originals_kept(const batch_image *image, int k, uint64_t from)
+{
+    const batch_chunk *chunk = &image->chunks[k];
+    bool trimmed = false;
+    for (size_t i = 0; i < chunk->rows.count; i++)
+    {
+        trimmed = trimmed || chunk->rows.rows[i].start < from;
+    }
+    for (size_t i = 0; i < chunk->rows.count; i++)
+    {
+        int j = chunk->originals[i];
+        if (j < 0 || chunk->rows.rows[i].start < from)
+        {
+            continue;
+        }
+        bool kept = j < k ? image->chunks[j].reused && !image->chunks[j].trimmed : j == k && !trimmed;
+        if (!kept)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Queues a task at the front of a deque, `front` for a chunk scanned again which the chunks after it wait for
+ */
+static void push_task(batch_pool *pool, int worker, batch_task task, bool front)
+{
+    task_deque *deque = &pool->deques[worker];
+    pthread_mutex_lock(&deque->lock);
+    if (front)
+    {
+        deque->head = (deque->head + deque->capacity - 1) % deque->capacity;
+        deque->tasks[deque->head] = task;
+    }
+    else
+    {
+        deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    }
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * @brief Takes a task: the oldest one of the worker's own deque, else the newest one of another worker's
+ *
+ * @return false if every deque is empty
+ */
+static bool take_task(batch_pool *pool, int worker, batch_task *task)
+{
+    for (int v = 0; v < pool->workers; v++)
+    {
+        task_deque *deque = &pool->deques[(worker + v) % pool->workers];
+        pthread_mutex_lock(&deque->lock);
+        bool found = deque->count > 0;
+        if (found && v == 0)
+        {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->capacity;
+            deque->count--;
+        }
+        else if (found)
+        {
+            *task = deque->tasks[(deque->head + --deque->count) % deque->capacity];
+        }
+        pthread_mutex_unlock(&deque->lock);
+        if (found)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Merges the scanned chunks of an image in order. A chunk that started early is kept if it agrees with the
+ *        chunks before it where they left off, minus its carves before that point, and is scanned again from
+ *        that point if it does not.
+ *
+ * @return true if the last chunk was merged, the image is complete
+ */
+static bool merge_chunks(batch_pool *pool, int worker, batch_image *image, int image_index)
+{
+    while (image->merged < image->chunk_count && image->chunks[image->merged].done)
+    {
+        batch_chunk *chunk = &image->chunks[image->merged];
+        image->failed = image->failed || chunk->job.status != EXIT_SUCCESS;
+        uint64_t from = image->resync;
+
+        // A reused chunk whose carves start past that point, or whose duplicates lost their originals, is scanned again
+        bool stale = chunk->reused && (from < chunk->job.offset || !originals_kept(image, image->merged, from));
+        if (from < chunk->end && (stale || (!chunk->exact && !chunk_agrees(chunk, from))))
+        {
+            log_msg(LOG_VERBOSE, "%s: scanning the chunk at %" PRIu64 " again from %" PRIu64 "\n",
+                    chunk->job.name, chunk->end - chunk->job.header_end, from);
+            chunk_discard(image, chunk, UINT64_MAX);
+            free(chunk->originals);
+            chunk->originals = NULL;
+            chunk->reused = false;
+            chunk->exact = true;
+            chunk->done = false;
+            chunk_region(image, chunk, from);
+
+            pthread_mutex_lock(&pool->lock);
+            pool->outstanding++;
+            pthread_mutex_unlock(&pool->lock);
+            push_task(pool, worker, (batch_task){image_index, image->merged}, true);
+            return false;
+        }
+
+        // A chunk the ones before it ran past is dropped whole, the next one has to agree with them instead
+        size_t count = chunk->rows.count;
+        chunk_discard(image, chunk, from);
+        chunk->trimmed = chunk->rows.count < count;
+        chunk->from = from > chunk->job.offset ? from : chunk->job.offset;
+        free(chunk->originals);
+        chunk->originals = NULL;
+        image->resync = from < chunk->end ? chunk->job.stop : from;
+        if (++image->merged == image->chunk_count)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Saves the fingerprints of an incremental scan and the carves of its chunks, for the next scan of the image
+ */
+static void incremental_save(batch_image *image)
+{
+    fingerprint_db current;
+    image_settings(image, &current);
+    current.blocks = image->blocks;
+    current.block_count = (image->size + FINGERPRINT_BLOCK - 1) / FINGERPRINT_BLOCK;
+    current.chunks = calloc(image->chunk_count, sizeof(fingerprint_chunk));
+    CHECK_OR_EXIT(current.chunks);
+    current.chunk_count = image->chunk_count;
+    int reused = 0;
+    for (int k = 0; k < image->chunk_count; k++)
+    {
+        batch_chunk *chunk = &image->chunks[k];
+        current.chunks[k].from = chunk->from;
+        current.chunks[k].stop = chunk->from < chunk->end ? chunk->job.stop : chunk->from; // Nothing of a dropped chunk
+        current.chunks[k].rows = chunk->rows;
+        reused += chunk->reused;
+    }
+
+    char path[FILENAME_MAX];
+    job_path(&image->chunks[0].job, JOB_FINGERPRINTS, path);
+    if (!fingerprint_save(path, &current))
+    {
+        log_msg(LOG_ERROR, "Error saving the fingerprints '%s'\n", path);
+    }
+    log_msg(LOG_INFO, "%s: %d of %d chunks did not change, their carves were reused\n", image->chunks[0].job.name,
+            reused, image->chunk_count);
+    free(current.chunks);
+}
+
+/**
+ * @brief Completes an image once its chunks are merged: deduplicates the carves in their order in the image,
+ *        writes the manifest and marks the directory done
+ */
+static void finish_image(batch_image *image)
+{
+    scan_job *job = &image->chunks[0].job;
+    char manifest_path[FILENAME_MAX], done_path[FILENAME_MAX];
+    job_path(job, image->args.manifest, manifest_path);
+    job_path(job, JOB_DONE, done_path);
+
+    output_init(image->dedup, false, image->args.hash, NULL, NULL); // Only the deduplication index
+    bool manifest = image->args.manifest[0] && manifest_open(manifest_path, 0);
+    if (image->args.manifest[0] && !manifest)
+    {
+        log_msg(LOG_ERROR, "Error creating the manifest '%s'\n", manifest_path);
+        image->failed = true;
+    }
+    bool drained = false;
+    for (int k = 0; k < image->chunk_count; k++)
+    {
+        manifest_rows *rows = &image->chunks[k].rows;
+        for (size_t i = 0; i < rows->count; i++)
+        {
+            carve_record *row = &rows->rows[i];
+            const char *original = row_written(image, row) ? output_original(row->digest, row->size) : NULL;
+            if (original)
+            {
+                if (!drained)
+                {
+                    writer_drain();
+                    drained = true;
+                }
+                remove(row->name);
+                log_msg(LOG_VERBOSE, "%s is a duplicate of %s\n", row->name, original);
+                row->duplicate_of = strdup(original);
+                CHECK_OR_EXIT(row->duplicate_of);
+            }
+            else if (row_written(image, row))
+            {
+                output_remember(row->name, row->size, row->digest, NULL);
+            }
+            else if (row->duplicate_of && strcmp(row->duplicate_of, KNOWN_MARK) != 0)
+            {
+                // A duplicate reused from the last scan, its original may have turned out a duplicate in turn
+                original = output_original(row->digest, row->size);
+                if (original && strcmp(original, row->duplicate_of) != 0)
+                {
+                    free((char *)row->duplicate_of);
+                    row->duplicate_of = strdup(original);
+                    CHECK_OR_EXIT(row->duplicate_of);
+                }
+            }
+            manifest_record(row);
+        }
+        image->files += (int)rows->count;
+    }
+    manifest_close();
+    output_shutdown();
+
+    if (image->incremental && !image->failed)
+    {
+        incremental_save(image);
+    }
+    for (int k = 0; k < image->chunk_count; k++)
+    {
+        manifest_rows_free(&image->chunks[k].rows);
+    }
+    if (!image->failed)
+    {
+        FILE *done = fopen(done_path, "w");
+        if (done)
+            fclose(done);
+    }
+}
+
+/**
+ * @brief Scans a task, then merges the chunk into its image
+ */
+static void run_task(batch_pool *pool, int worker, batch_task task)
+{
+    batch_image *image = &pool->images[task.image];
+    batch_chunk *chunk = &image->chunks[task.chunk];
+    bool reused = false;
+    if (image->incremental && !chunk->fingerprinted)
+    {
+        chunk->fingerprinted = true;
+        reused = chunk_reuse(image, task.chunk);
+    }
+    if (!reused)
+    {
+        scan_run(&image->args, &chunk->job);
+    }
+    if (image->whole)
+    {
+        image->files = chunk->job.files;
+        image->size = image->size ? image->size : chunk->job.bytes_read; // A streamed image only knows it now
+        image->failed = chunk->job.status != EXIT_SUCCESS;
+        return;
+    }
+
+    pthread_mutex_lock(&image->lock);
+    chunk->done = true;
+    bool complete = merge_chunks(pool, worker, image, task.image);
+    pthread_mutex_unlock(&image->lock);
+    if (complete)
+    {
+        finish_image(image);
+    }
+}
+
+/**
+ * @brief A worker thread, runs tasks until every task of the batch is done
+ */
+static void *batch_thread(void *arg)
+{
+    batch_worker *worker = arg;
+    batch_pool *pool = worker->pool;
+    for (;;)
+    {
+        batch_task task;
+        if (take_task(pool, worker->index, &task))
+        {
+            run_task(pool, worker->index, task);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->outstanding == 0)
+            {
+                pthread_cond_broadcast(&pool->work);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        // Nothing to take, but a running chunk may still be queued again; sleeps at most 10 ms
+        pthread_mutex_lock(&pool->lock);
+        if (pool->outstanding == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 10 * 1000000L;
+        if (until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pool->work, &pool->lock, &until);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static int compare_image_sizes(const void *a, const void *b)
+{
+    const batch_image *x = a, *y = b;
+    return (x->size < y->size) - (x->size > y->size);
+}
+
+/**
+ * @brief Scans every image of --batch, each into its own directory. The images are split into chunks that are
+ *        scanned as tasks on --jobs workers: every worker gets the chunks of some images, and a worker that ran
+ *        out of them steals the last chunks of another worker, so a few small images do not leave the CPUs idle
+ *        while a large one is still being scanned. The carves and manifest of an image are the same as those of a
+ *        scan of it alone, except that the carves of a chunked image are named after their offset.
+ *
+ * @param args The command line args
+ * @return EXIT_SUCCESS if every image was scanned
+ */
+int batch_run(cl_args *args)
+{
+    char **paths;
+    int path_count = 1;
+    if (args->batch[0])
+    {
+        path_count = list_images(args->batch, &paths);
+    }
+    else
+    {
+        // An incremental scan of one image
+        paths = malloc(sizeof(char *));
+        CHECK_OR_EXIT(paths);
+        paths[0] = strdup(args->filename);
+        CHECK_OR_EXIT(paths[0]);
+    }
+    if (path_count < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    batch_image *images = calloc(path_count ? path_count : 1, sizeof(batch_image));
+    CHECK_OR_EXIT(images);
+    int count = 0, tasks = 0;
+    bool ok = true;
+    for (int i = 0; i < path_count; i++)
+    {
+        int added = image_init(args, images, count, paths[i]);
+        if (added > 0)
+        {
+            tasks += images[count++].chunk_count;
+        }
+        ok = ok && added >= 0;
+        free(paths[i]);
+    }
+    free(paths);
+    qsort(images, count, sizeof(batch_image), compare_image_sizes);
+    for (int i = 0; i < count; i++)
+    {
+        pthread_mutex_init(&images[i].lock, NULL);
+    }
+    log_msg(LOG_INFO, "Scanning %d images in %d tasks\n", count, tasks);
+
+    // The largest images are handed out first, the chunks of an image to one worker in order
+    batch_pool pool = {.images = images, .image_count = count, .outstanding = tasks};
+    pool.workers = args->jobs < tasks ? args->jobs : tasks;
+    pool.workers = pool.workers > 0 ? pool.workers : 1;
+    pool.deques = calloc(pool.workers, sizeof(task_deque));
+    CHECK_OR_EXIT(pool.deques);
+    for (int w = 0; w < pool.workers; w++)
+    {
+        pool.deques[w].capacity = tasks > 0 ? tasks : 1; // A chunk scanned again replaces itself, never more tasks at once
+        pool.deques[w].tasks = malloc(pool.deques[w].capacity * sizeof(batch_task));
+        CHECK_OR_EXIT(pool.deques[w].tasks);
+        pthread_mutex_init(&pool.deques[w].lock, NULL);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        for (int k = 0; k < images[i].chunk_count; k++)
+        {
+            push_task(&pool, i % pool.workers, (batch_task){i, k}, false);
+        }
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+
+    pthread_t *threads = malloc(pool.workers * sizeof(pthread_t));
+    batch_worker *workers = malloc(pool.workers * sizeof(batch_worker));
+    CHECK_OR_EXIT(threads);
+    CHECK_OR_EXIT(workers);
+    for (int w = 0; w < pool.workers; w++)
+    {
+        workers[w] = (batch_worker){&pool, w};
+        pthread_create(&threads[w], NULL, batch_thread, &workers[w]);
+    }
+    for (int w = 0; w < pool.workers; w++)
+    {
+        pthread_join(threads[w], NULL);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        log_msg(LOG_INFO, "%-32s %16" PRIu64 " bytes, %d files%s\n", images[i].args.filename, images[i].size, images[i].files,
+                images[i].failed ? ", failed" : "");
+        ok = ok && !images[i].failed;
+        pthread_mutex_destroy(&images[i].lock);
+        for (int k = 0; k < images[i].chunk_count; k++)
+        {
+            free(images[i].chunks[k].originals);
+        }
+        fingerprint_free(&images[i].previous);
+        free(images[i].blocks);
+        free(images[i].chunks);
+    }
+    for (int w = 0; w < pool.workers; w++)
+    {
+        pthread_mutex_destroy(&pool.deques[w].lock);
+        free(pool.deques[w].tasks);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.work);
+    free(pool.deques);
+    free(threads);
+    free(workers);
+    free(images);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,54 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Maximum number of extents a planted file can be split into
+#define BENCH_MAX_EXTENTS 2
+
+// Format of the ground truth file written by gencorpus and read by benchrun.
+// Lines starting with '#' are comments, every other line describes one planted file:
+//      <id>,<type>,<length>,<hash>,<offset>:<length>[;<offset>:<length>]
+#define BENCH_TRUTH_HEADER "# id,type,length,fnv1a64,extents"
+
+// A single contiguous piece of a planted file inside the image
+typedef struct bench_extent
+{
+    uint64_t offset; // Offset of the piece inside the image
+    uint64_t length; // Length of the piece
+} bench_extent;
+
+// A planted file as described by the ground truth
+typedef struct bench_truth
+{
+    int id;                                    // The running number of the planted file
+    char type[8];                              // The file type, same as the extension recover uses
+    uint64_t length;                           // Total length of the file
+    uint64_t hash;                             // FNV-1a 64 hash of the complete file content
+    int extent_count;                          // Number of extents the file was split into
+    bench_extent extents[BENCH_MAX_EXTENTS];   // The extents themselves in file order
+} bench_truth;
+
+#define FNV1A64_INIT 0xcbf29ce484222325ULL
+#define FNV1A64_PRIME 0x100000001b3ULL
+
+/**
+ * @brief Feeds `length` bytes into a running FNV-1a 64 hash
+ *
+ * @param hash The running hash, start with FNV1A64_INIT
+ * @param data The bytes to hash
+ * @param length Number of bytes
+ * @return The updated hash
+ */
+static inline uint64_t fnv1a64(uint64_t hash, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= data[i];
+        hash *= FNV1A64_PRIME;
+    }
+    return hash;
+}
+
+#endif //__BENCH_H__
@@ -0,0 +1,543 @@
+#include "bench.h"
+#include "../getopt/getopt.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define USAGE_STR "Usage: ./benchrun --recover <recover> --image <image> --truth <truth.csv> --outdir <dir> [--buffer <n|auto>] [-- <extra recover args>]"
+
+// Name of the file the recover output is redirected to, ignored while scoring
+#define LOG_NAME "recover.log"
+
+// Name of the manifest recover writes, read for the validation status of the carves and ignored while scoring
+#define MANIFEST_NAME "recover.manifest.csv"
+
+// Options of the benchmark run
+typedef struct run_args
+{
+    char recover[FILENAME_MAX]; // Path of the recover executable
+    char image[FILENAME_MAX];   // Path of the image to scan
+    char truth[FILENAME_MAX];   // Path of the ground truth
+    char outdir[FILENAME_MAX];  // Directory the carved files end up in
+    char buffer[32];            // Buffer size handed to recover
+    int extra_count;            // Number of extra arguments handed to recover
+    char **extra;               // The extra arguments themselves
+} run_args;
+
+// Measurements of one recover run
+typedef struct run_result
+{
+    double seconds;     // Wall clock time
+    uint64_t peak_rss;  // Peak resident set size in bytes
+    int exit_code;      // Exit code of recover
+} run_result;
+
+// A carved output file
+typedef struct carve
+{
+    char *name;     // Its path relative to the output directory, as the manifest has it
+    uint64_t hash;  // FNV-1a 64 hash of its content
+    bool matched;   // Whether it was matched to a planted file
+    bool valid;     // Whether recover's validation found it valid
+} carve;
+
+static void usage()
+{
+    printf("%s\n", USAGE_STR);
+}
+
+static void parse_args(run_args *args, int argc, char *argv[])
+{
+    struct option options[] = {
+        {.name = "recover", .has_arg = required_argument, NULL, .val = 'r'},
+        {.name = "image", .has_arg = required_argument, NULL, .val = 'i'},
+        {.name = "truth", .has_arg = required_argument, NULL, .val = 't'},
+        {.name = "outdir", .has_arg = required_argument, NULL, .val = 'o'},
+        {.name = "buffer", .has_arg = required_argument, NULL, .val = 'b'},
+        {.name = "help", .has_arg = no_argument, NULL, .val = 'h'},
+        {0}};
+
+    memset(args, 0, sizeof(*args));
+    strcpy(args->buffer, "auto");
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "r:i:t:o:b:h", options, NULL)) != -1)
+    {
+        switch (ch)
+        {
+        case 'r':
+            strncpy(args->recover, optarg, FILENAME_MAX - 1);
+            break;
+        case 'i':
+            strncpy(args->image, optarg, FILENAME_MAX - 1);
+            break;
+        case 't':
+            strncpy(args->truth, optarg, FILENAME_MAX - 1);
+            break;
+        case 'o':
+            strncpy(args->outdir, optarg, FILENAME_MAX - 1);
+            break;
+        case 'b':
+            strncpy(args->buffer, optarg, sizeof(args->buffer) - 1);
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    args->extra = argv + optind;
+    args->extra_count = argc - optind;
+
+    if (!args->recover[0] || !args->image[0] || !args->truth[0] || !args->outdir[0])
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Resolves `path` to an absolute path since recover runs inside the output directory
+ */
+static void absolute_path(const char *path, char *holder)
+{
+#ifdef _WIN32
+    if (!_fullpath(holder, path, FILENAME_MAX))
+#else
+    if (!realpath(path, holder))
+#endif
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Whether a path is a directory, e.g. a shard of the --layout counter or hash output
+ */
+static bool is_directory(const char *path)
+{
+    struct stat path_stat;
+    return stat(path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode);
+}
+
+/**
+ * @brief Removes the files of a directory and of its subdirectories, and the subdirectories once empty
+ */
+static void clear_directory(const char *directory)
+{
+    DIR *dir = opendir(directory);
+    if (!dir)
+    {
+        return;
+    }
+
+    char path[FILENAME_MAX * 2];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if (is_directory(path))
+        {
+            clear_directory(path);
+        }
+        remove(path);
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Creates the output directory if needed and removes the leftovers of an earlier run
+ */
+static void prepare_outdir(const char *outdir)
+{
+#ifdef _WIN32
+    mkdir(outdir);
+#else
+    mkdir(outdir, 0755);
+#endif
+    if (!is_directory(outdir))
+    {
+        perror(outdir);
+        exit(EXIT_FAILURE);
+    }
+    clear_directory(outdir);
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Runs recover on the image inside the output directory, measuring the time and the peak RSS
+ */
+static run_result run_recover(const run_args *args, const char *recover, const char *image)
+{
+    run_result result = {0};
+    double start = now_seconds();
+
+#ifdef _WIN32
+    char command[FILENAME_MAX * 4];
+    int n = snprintf(command, sizeof(command), "\"%s\" --file \"%s\" --buffer %s --manifest %s", recover, image,
+                     args->buffer, MANIFEST_NAME);
+    for (int i = 0; i < args->extra_count; i++)
+    {
+        n += snprintf(command + n, sizeof(command) - n, " %s", args->extra[i]);
+    }
+
+    char log_path[FILENAME_MAX * 2];
+    snprintf(log_path, sizeof(log_path), "%s\\%s", args->outdir, LOG_NAME);
+    SECURITY_ATTRIBUTES inherit = {sizeof(inherit), NULL, TRUE};
+    HANDLE log = CreateFile(log_path, GENERIC_WRITE, FILE_SHARE_READ, &inherit, CREATE_ALWAYS, 0, NULL);
+
+    STARTUPINFO startup = {sizeof(startup)};
+    PROCESS_INFORMATION process;
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdOutput = log;
+    startup.hStdError = log;
+    if (!CreateProcess(NULL, command, NULL, NULL, TRUE, 0, NULL, args->outdir, &startup, &process))
+    {
+        printf("Error starting recover: %lu\n", GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    WaitForSingleObject(process.hProcess, INFINITE);
+    result.seconds = now_seconds() - start;
+
+    DWORD exit_code;
+    PROCESS_MEMORY_COUNTERS memory;
+    GetExitCodeProcess(process.hProcess, &exit_code);
+    GetProcessMemoryInfo(process.hProcess, &memory, sizeof(memory));
+    result.exit_code = (int)exit_code;
+    result.peak_rss = memory.PeakWorkingSetSize;
+
+    CloseHandle(process.hThread);
+    CloseHandle(process.hProcess);
+    CloseHandle(log);
+#else
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        char *argv[10 + args->extra_count];
+        int argc = 0;
+        argv[argc++] = (char *)recover;
+        argv[argc++] = "--file";
+        argv[argc++] = (char *)image;
+        argv[argc++] = "--buffer";
+        argv[argc++] = (char *)args->buffer;
+        argv[argc++] = "--manifest";
+        argv[argc++] = MANIFEST_NAME;
+        for (int i = 0; i < args->extra_count; i++)
+        {
+            argv[argc++] = args->extra[i];
+        }
+        argv[argc] = NULL;
+
+        int log;
+        if (chdir(args->outdir) != 0 ||
+            (log = open(LOG_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        {
+            _exit(127);
+        }
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        execv(recover, argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.seconds = now_seconds() - start;
+    result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    result.peak_rss = (uint64_t)usage.ru_maxrss * 1024; // ru_maxrss is in KiB on Linux
+#endif
+    return result;
+}
+
+/**
+ * @brief Parses the ground truth file
+ *
+ * @param count The place where the number of planted files is stored
+ * @return The array of planted files, to be freed by the caller
+ */
+static bench_truth *load_truth(const char *path, int *count)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    int capacity = 256;
+    bench_truth *records = malloc(capacity * sizeof(bench_truth));
+    char line[512];
+    *count = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        if (line[0] == '#' || line[0] == '\n')
+        {
+            continue;
+        }
+        if (*count == capacity)
+        {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(bench_truth));
+        }
+
+        bench_truth *record = &records[*count];
+        memset(record, 0, sizeof(*record));
+        int consumed = 0;
+        if (sscanf(line, "%d,%7[^,],%" SCNu64 ",%" SCNx64 ",%n", &record->id, record->type, &record->length, &record->hash, &consumed) < 4)
+        {
+            continue;
+        }
+
+        // Extents are `offset:length` pairs separated by ';'
+        char *extent = strtok(line + consumed, ";\n");
+        while (extent && record->extent_count < BENCH_MAX_EXTENTS)
+        {
+            bench_extent *e = &record->extents[record->extent_count++];
+            sscanf(extent, "%" SCNu64 ":%" SCNu64, &e->offset, &e->length);
+            extent = strtok(NULL, ";\n");
+        }
+        (*count)++;
+    }
+    fclose(file);
+    return records;
+}
+
+/**
+ * @brief Hashes every file of a directory and of its subdirectories, the shards of --layout counter or hash
+ *
+ * @param outdir The output directory the names are relative to
+ * @param carves The carves found so far, grown as needed
+ * @param capacity The allocated number of carves
+ * @param count The number of carves
+ * @param bytes The total carved bytes
+ */
+static void hash_directory(const char *directory, const char *outdir, carve **carves, int *capacity, int *count,
+                           uint64_t *bytes)
+{
+    DIR *dir = opendir(directory);
+    if (!dir)
+    {
+        return;
+    }
+    static uint8_t block[64 * 1024];
+    char path[FILENAME_MAX * 2];
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name, LOG_NAME) == 0 || strcmp(entry->d_name, MANIFEST_NAME) == 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        if (is_directory(path))
+        {
+            hash_directory(path, outdir, carves, capacity, count, bytes);
+            continue;
+        }
+        FILE *file = fopen(path, "rb");
+        if (!file)
+        {
+            continue;
+        }
+
+        uint64_t hash = FNV1A64_INIT;
+        size_t n;
+        while ((n = fread(block, 1, sizeof(block), file)) > 0)
+        {
+            hash = fnv1a64(hash, block, n);
+            *bytes += n;
+        }
+        fclose(file);
+
+        if (*count == *capacity)
+        {
+            *capacity *= 2;
+            *carves = realloc(*carves, *capacity * sizeof(carve));
+        }
+        (*carves)[(*count)++] = (carve){.name = strdup(path + strlen(outdir) + 1), .hash = hash};
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Hashes every carved file in the output directory, including its shard subdirectories
+ *
+ * @param count The place where the number of carved files is stored
+ * @param bytes The place where the total carved bytes are stored
+ * @return The array of carves, to be freed by the caller
+ */
+static carve *load_carves(const char *outdir, int *count, uint64_t *bytes)
+{
+    int capacity = 256;
+    carve *carves = malloc(capacity * sizeof(carve));
+    *count = 0;
+    *bytes = 0;
+    hash_directory(outdir, outdir, &carves, &capacity, count, bytes);
+    return carves;
+}
+
+static int compare_carve_names(const void *a, const void *b)
+{
+    return strcmp(((const carve *)a)->name, ((const carve *)b)->name);
+}
+
+/**
+ * @brief Marks the carves the manifest of recover lists as valid, i.e. their structure and, for a JPEG, their
+ *        entropy data decoded
+ *
+ * @param carves The carves, sorted by name on return
+ * @return false if recover wrote no manifest
+ */
+static bool load_validity(const char *outdir, carve *carves, int count)
+{
+    char path[FILENAME_MAX * 2];
+    snprintf(path, sizeof(path), "%s/%s", outdir, MANIFEST_NAME);
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        return false;
+    }
+    qsort(carves, count, sizeof(carve), compare_carve_names);
+
+    // name,type,start,end,size,hash,status,... where the names of the carves never need quoting
+    char line[FILENAME_MAX * 2];
+    while (fgets(line, sizeof(line), file))
+    {
+        char *fields[7];
+        char *cursor = line;
+        int n = 0;
+        for (; n < 7 && cursor; n++)
+        {
+            fields[n] = cursor;
+            cursor = strchr(cursor, ',');
+            if (cursor)
+            {
+                *cursor++ = '\0';
+            }
+        }
+        if (n < 7 || strcmp(fields[6], "valid") != 0)
+        {
+            continue;
+        }
+        carve key = {.name = fields[0]};
+        carve *found = bsearch(&key, carves, count, sizeof(carve), compare_carve_names);
+        if (found)
+        {
+            found->valid = true;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    run_args args;
+    parse_args(&args, argc, argv);
+
+    char recover[FILENAME_MAX], image[FILENAME_MAX];
+    absolute_path(args.recover, recover);
+    absolute_path(args.image, image);
+    prepare_outdir(args.outdir);
+
+    struct stat image_stat;
+    stat(image, &image_stat);
+
+    run_result result = run_recover(&args, recover, image);
+
+    int truth_count, carve_count;
+    uint64_t carved_bytes;
+    bench_truth *truth = load_truth(args.truth, &truth_count);
+    carve *carves = load_carves(args.outdir, &carve_count, &carved_bytes);
+    bool validated = load_validity(args.outdir, carves, carve_count);
+
+    // A planted file counts as recovered when an output file has the exact same content,
+    // each output file is matched at most once.
+    static const char *types[] = {"jpeg", "png", "gif"};
+    int planted[3] = {0}, recovered[3] = {0};
+    int fragmented = 0, fragmented_recovered = 0;
+    int matched = 0, jpeg_valid = 0;
+    for (int i = 0; i < truth_count; i++)
+    {
+        int type = 0;
+        while (type < 2 && strcmp(types[type], truth[i].type) != 0)
+        {
+            type++;
+        }
+        planted[type]++;
+        fragmented += truth[i].extent_count > 1;
+
+        for (int j = 0; j < carve_count; j++)
+        {
+            if (!carves[j].matched && carves[j].hash == truth[i].hash)
+            {
+                carves[j].matched = true;
+                recovered[type]++;
+                fragmented_recovered += truth[i].extent_count > 1;
+                jpeg_valid += type == 0 && carves[j].valid;
+                matched++;
+                break;
+            }
+        }
+    }
+
+    double megabytes = image_stat.st_size / (1024.0 * 1024.0);
+    printf("\t\t--- Benchmark ---\n");
+    printf("image        %s (%.1f MiB)\n", args.image, megabytes);
+    printf("exit code    %d\n", result.exit_code);
+    printf("time         %.3f s\n", result.seconds);
+    printf("throughput   %.2f MB/s\n", result.seconds > 0 ? megabytes / result.seconds : 0.0);
+    printf("peak rss     %.1f MiB\n", result.peak_rss / (1024.0 * 1024.0));
+    printf("carves       %d (%.1f MiB)\n", carve_count, carved_bytes / (1024.0 * 1024.0));
+    printf("recall       %.4f (%d/%d)\n", truth_count ? (double)matched / truth_count : 0.0, matched, truth_count);
+    printf("precision    %.4f (%d/%d)\n", carve_count ? (double)matched / carve_count : 0.0, matched, carve_count);
+    for (int i = 0; i < 3; i++)
+    {
+        printf("  %-4s       %d/%d\n", types[i], recovered[i], planted[i]);
+    }
+    printf("  fragmented %d/%d\n", fragmented_recovered, fragmented);
+    if (validated)
+        printf("jpeg valid   %d/%d\n", jpeg_valid, recovered[0]);
+    else
+        printf("jpeg valid   n/a (recover wrote no manifest)\n");
+
+    free(truth);
+    for (int i = 0; i < carve_count; i++)
+    {
+        free(carves[i].name);
+    }
+    free(carves);
+    return result.exit_code == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
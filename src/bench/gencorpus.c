@@ -0,0 +1,509 @@
+#include "bench.h"
+#include "../getopt/getopt.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USAGE_STR "Usage: ./gencorpus --out <image> --truth <truth.csv> --size <MiB> [--seed <n>] [--fill <%>] [--frag <%>] [--zero <%>] [--min-kb <n>] [--max-kb <n>] [--align <n>]"
+
+// Largest gap placed between two planted files
+#define MAX_GAP (64 * 1024)
+
+// Options controlling the shape of the generated image
+typedef struct gen_args
+{
+    char out[FILENAME_MAX];   // Path of the image to generate
+    char truth[FILENAME_MAX]; // Path of the ground truth file
+    uint64_t size;            // Image size in bytes
+    uint64_t seed;            // Seed of the random generator, same seed gives the same image
+    int fill;                 // Percentage of the image covered by planted files
+    int frag;                 // Percentage of planted files split in two fragments
+    int zero;                 // Percentage of gaps that are zero filled instead of noise
+    int min_size;             // Minimum planted file size in bytes
+    int max_size;             // Maximum planted file size in bytes
+    int align;                // Alignment of planted files and fragments, i.e. the sector/cluster size
+} gen_args;
+
+static uint64_t rng_state;
+
+/**
+ * @brief Returns the next number of the splitmix64 sequence
+ */
+static uint64_t rng_next()
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * @brief Returns a random number in the range [low, high]
+ */
+static uint64_t rng_range(uint64_t low, uint64_t high)
+{
+    return low + rng_next() % (high - low + 1);
+}
+
+/**
+ * @brief Fills `length` bytes with random data
+ */
+static void rng_fill(uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        data[i] = (uint8_t)rng_next();
+    }
+}
+
+static uint32_t crc_table[256];
+
+/**
+ * @brief Builds the CRC-32 lookup table used for PNG chunks
+ */
+static void crc_init()
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+/**
+ * @brief Computes the CRC-32 of `length` bytes
+ */
+static uint32_t crc32_of(const uint8_t *data, size_t length)
+{
+    uint32_t c = 0xFFFFFFFFU;
+    for (size_t i = 0; i < length; i++)
+    {
+        c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFU;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+/**
+ * @brief Writes a complete PNG chunk with its length and CRC into `p`
+ *
+ * @return The number of bytes written
+ */
+static size_t put_png_chunk(uint8_t *p, const char *type, const uint8_t *data, uint32_t length)
+{
+    put_be32(p, length);
+    memcpy(p + 4, type, 4);
+    if (length)
+    {
+        memcpy(p + 8, data, length);
+    }
+    put_be32(p + 8 + length, crc32_of(p + 4, length + 4));
+    return length + 12;
+}
+
+// Entropy coded bits written MSB first, with a 0x00 stuffed after every 0xFF byte
+typedef struct bit_writer
+{
+    uint8_t *p;    // The file
+    size_t n;      // The bytes written
+    uint32_t bits; // The bits not written yet, right aligned
+    int count;     // Their number
+} bit_writer;
+
+static void put_bits(bit_writer *w, uint32_t bits, int count)
+{
+    w->bits = w->bits << count | bits;
+    w->count += count;
+    while (w->count >= 8)
+    {
+        uint8_t byte = (uint8_t)(w->bits >> (w->count - 8));
+        w->count -= 8;
+        w->p[w->n++] = byte;
+        if (byte == 0xFF)
+        {
+            w->p[w->n++] = 0x00; // Byte stuffing
+        }
+    }
+}
+
+/**
+ * @brief Builds a baseline grayscale JPEG of roughly `target` bytes that decodes: SOI, JFIF APP0, DQT, SOF0, a DC and
+ *        an AC DHT, SOS, the entropy data and EOI. Every 8x8 block is a random DC step of -1, 0 or +1 followed by an
+ *        end of block, so the image is flat but unique. The width is picked first and rows of blocks are added up to
+ *        the target size, the height is then patched into the frame header. The entropy data never contains
+ *        0xFF 0xD9, just like a real stream.
+ *
+ * @return The real length of the built file
+ */
+static size_t build_jpeg(uint8_t *p, size_t target)
+{
+    static const uint8_t head[] = {
+        0xFF, 0xD8,                                                                         // SOI
+        0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, // APP0
+    };
+    static const uint8_t tables[] = {
+        0xFF, 0xC4, 0x00, 0x15, 0x00, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00, 0x01, // DC: 0 -> 0, 1 -> 10
+        0xFF, 0xC4, 0x00, 0x14, 0x10, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00,       // AC: EOB -> 0
+        0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00                                // SOS
+    };
+    size_t n = sizeof(head);
+    memcpy(p, head, n);
+
+    p[n++] = 0xFF; // DQT, all ones
+    p[n++] = 0xDB;
+    p[n++] = 0x00;
+    p[n++] = 0x43;
+    p[n++] = 0x00;
+    memset(p + n, 1, 64);
+    n += 64;
+
+    // A block takes at most 4 bits, a row of blocks at most `columns` bytes once stuffed
+    int columns = (int)rng_range(8, 64);
+    if ((size_t)columns < target / 3000 + 1)
+    {
+        columns = target / 3000 + 1 < 8191 ? (int)(target / 3000 + 1) : 8191;
+    }
+    size_t sof = n;
+    static const uint8_t frame[] = {0xFF, 0xC0, 0x00, 0x0B, 0x08, 0, 0, 0, 0, 0x01, 0x01, 0x11, 0x00}; // SOF0
+    memcpy(p + n, frame, sizeof(frame));
+    put_be32(p + sof + 5, (uint32_t)columns * 8); // Height 0 for now, then the width
+    n += sizeof(frame);
+    memcpy(p + n, tables, sizeof(tables));
+    n += sizeof(tables);
+
+    bit_writer w = {.p = p, .n = n};
+    int rows = 0, dc = 0;
+    do
+    {
+        for (int column = 0; column < columns; column++)
+        {
+            int step = dc >= 16 ? -1 : dc <= -16 ? 1 : (int)rng_range(0, 2) - 1;
+            dc += step;
+            if (step == 0)
+                put_bits(&w, 0x0, 1); // DC difference of category 0
+            else
+                put_bits(&w, step > 0 ? 0x5 : 0x4, 3); // Category 1 and its sign bit
+            put_bits(&w, 0x0, 1);                      // End of block
+        }
+        rows++;
+    } while (w.n + columns + 4 < target && rows < 8191);
+    if (w.count)
+    {
+        put_bits(&w, (1U << (8 - w.count)) - 1, 8 - w.count); // Padded with ones
+    }
+    p[sof + 5] = (uint8_t)(rows * 8 >> 8);
+    p[sof + 6] = (uint8_t)(rows * 8);
+
+    n = w.n;
+    p[n++] = 0xFF; // EOI
+    p[n++] = 0xD9;
+    return n;
+}
+
+/**
+ * @brief Builds a PNG of roughly `target` bytes with valid IHDR, IDAT and IEND chunks
+ *
+ * @return The real length of the built file
+ */
+static size_t build_png(uint8_t *p, size_t target)
+{
+    static const uint8_t signature[] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
+    uint8_t ihdr[13] = {0};
+    uint8_t idat[8192];
+    size_t n = sizeof(signature);
+
+    memcpy(p, signature, n);
+    put_be32(ihdr, (uint32_t)rng_range(16, 4096));     // Width
+    put_be32(ihdr + 4, (uint32_t)rng_range(16, 4096)); // Height
+    ihdr[8] = 8;                                       // Bit depth
+    ihdr[9] = 2;                                       // Truecolour
+    n += put_png_chunk(p + n, "IHDR", ihdr, sizeof(ihdr));
+
+    while (n + 12 + 12 < target)
+    {
+        size_t length = target - n - 12 - 12;
+        if (length > sizeof(idat))
+        {
+            length = sizeof(idat);
+        }
+        rng_fill(idat, length);
+        n += put_png_chunk(p + n, "IDAT", idat, (uint32_t)length);
+    }
+    n += put_png_chunk(p + n, "IEND", NULL, 0);
+    return n;
+}
+
+/**
+ * @brief Builds a GIF89a of roughly `target` bytes with one image made of data sub-blocks.
+ *        The data never contains 0x00 so the only 0x00 0x3B pair is the real trailer.
+ *
+ * @return The real length of the built file
+ */
+static size_t build_gif(uint8_t *p, size_t target)
+{
+    size_t n = 0;
+    uint16_t width = (uint16_t)rng_range(16, 4096);
+    uint16_t height = (uint16_t)rng_range(16, 4096);
+
+    memcpy(p, "GIF89a", 6);
+    n += 6;
+    put_le16(p + n, width); // Logical screen descriptor
+    put_le16(p + n + 2, height);
+    p[n + 4] = 0x00; // No global colour table
+    p[n + 5] = 0x00;
+    p[n + 6] = 0x00;
+    n += 7;
+
+    p[n++] = 0x2C; // Image descriptor
+    put_le16(p + n, 0);
+    put_le16(p + n + 2, 0);
+    put_le16(p + n + 4, width);
+    put_le16(p + n + 6, height);
+    p[n + 8] = 0x00;
+    n += 9;
+    p[n++] = 0x08; // LZW minimum code size
+
+    while (n + 2 + 2 < target)
+    {
+        size_t length = target - n - 2 - 2;
+        if (length > 255)
+        {
+            length = 255;
+        }
+        p[n++] = (uint8_t)length;
+        for (size_t i = 0; i < length; i++)
+        {
+            uint8_t byte = (uint8_t)rng_next();
+            p[n++] = byte ? byte : 0x01;
+        }
+    }
+    p[n++] = 0x00; // Block terminator
+    p[n++] = 0x3B; // Trailer
+    return n;
+}
+
+/**
+ * @brief Writes `length` bytes of either zeros or noise to the image
+ */
+static void write_gap(FILE *image, uint64_t length, bool zero)
+{
+    uint8_t block[4096];
+    while (length)
+    {
+        size_t chunk = length < sizeof(block) ? (size_t)length : sizeof(block);
+        if (zero)
+        {
+            memset(block, 0, chunk);
+        }
+        else
+        {
+            rng_fill(block, chunk);
+        }
+        fwrite(block, 1, chunk, image);
+        length -= chunk;
+    }
+}
+
+/**
+ * @brief Rounds `value` up to a multiple of `align`
+ */
+static uint64_t align_up(uint64_t value, int align)
+{
+    return (value + align - 1) / align * align;
+}
+
+static void usage()
+{
+    printf("%s\n", USAGE_STR);
+}
+
+static void parse_args(gen_args *args, int argc, char *argv[])
+{
+    struct option options[] = {
+        {.name = "out", .has_arg = required_argument, NULL, .val = 'o'},
+        {.name = "truth", .has_arg = required_argument, NULL, .val = 't'},
+        {.name = "size", .has_arg = required_argument, NULL, .val = 's'},
+        {.name = "seed", .has_arg = required_argument, NULL, .val = 'S'},
+        {.name = "fill", .has_arg = required_argument, NULL, .val = 'F'},
+        {.name = "frag", .has_arg = required_argument, NULL, .val = 'r'},
+        {.name = "zero", .has_arg = required_argument, NULL, .val = 'z'},
+        {.name = "min-kb", .has_arg = required_argument, NULL, .val = 'm'},
+        {.name = "max-kb", .has_arg = required_argument, NULL, .val = 'M'},
+        {.name = "align", .has_arg = required_argument, NULL, .val = 'a'},
+        {.name = "help", .has_arg = no_argument, NULL, .val = 'h'},
+        {0}};
+
+    memset(args, 0, sizeof(*args));
+    args->size = 16 * 1024 * 1024;
+    args->seed = 1;
+    args->fill = 40;
+    args->frag = 10;
+    args->zero = 50;
+    args->min_size = 4 * 1024;
+    args->max_size = 256 * 1024;
+    args->align = 512;
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "o:t:s:S:F:r:z:m:M:a:h", options, NULL)) != -1)
+    {
+        switch (ch)
+        {
+        case 'o':
+            strncpy(args->out, optarg, FILENAME_MAX - 1);
+            break;
+        case 't':
+            strncpy(args->truth, optarg, FILENAME_MAX - 1);
+            break;
+        case 's':
+            args->size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'S':
+            args->seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'F':
+            args->fill = atoi(optarg);
+            break;
+        case 'r':
+            args->frag = atoi(optarg);
+            break;
+        case 'z':
+            args->zero = atoi(optarg);
+            break;
+        case 'm':
+            args->min_size = atoi(optarg) * 1024;
+            break;
+        case 'M':
+            args->max_size = atoi(optarg) * 1024;
+            break;
+        case 'a':
+            args->align = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!args->out[0] || !args->truth[0] || !args->size || args->align < 1 ||
+        args->min_size < 1024 || args->max_size < args->min_size ||
+        args->fill < 1 || args->fill > 100)
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    gen_args args;
+    parse_args(&args, argc, argv);
+
+    rng_state = args.seed;
+    crc_init();
+
+    FILE *image = fopen(args.out, "wb");
+    FILE *truth = fopen(args.truth, "w");
+    uint8_t *content = malloc(args.max_size + 64); // Room for the largest file plus the fixed headers
+    if (!image || !truth || !content)
+    {
+        perror("gencorpus");
+        return EXIT_FAILURE;
+    }
+
+    static const char *types[] = {"jpeg", "png", "gif"};
+    size_t (*builders[])(uint8_t *, size_t) = {build_jpeg, build_png, build_gif};
+
+    // The average gap needed between files to reach the requested fill ratio
+    uint64_t average_file = (args.min_size + args.max_size) / 2;
+    uint64_t average_gap = average_file * (100 - args.fill) / args.fill;
+    if (average_gap > MAX_GAP)
+    {
+        average_gap = MAX_GAP;
+    }
+
+    fprintf(truth, "# image=%s size=%" PRIu64 " seed=%" PRIu64 "\n", args.out, args.size, args.seed);
+    fprintf(truth, "%s\n", BENCH_TRUTH_HEADER);
+
+    uint64_t position = 0;
+    int planted = 0, fragmented = 0;
+    for (;;)
+    {
+        // Gap before the next file, always ending on an alignment boundary
+        uint64_t gap = align_up(position + rng_range(0, 2 * average_gap), args.align) - position;
+        int type = (int)rng_range(0, 2);
+        size_t length = builders[type](content, (size_t)rng_range(args.min_size, args.max_size));
+        bool split = (int)rng_range(0, 99) < args.frag;
+
+        // Splitting puts a noise hole between two cluster-aligned fragments
+        uint64_t first = split ? align_up(rng_range(1, length - 1), args.align) : length;
+        uint64_t hole = split ? align_up(rng_range(args.align, 16 * 1024), args.align) : 0;
+        if (first >= length)
+        {
+            split = false;
+            first = length;
+            hole = 0;
+        }
+
+        if (position + gap + length + hole > args.size)
+        {
+            break;
+        }
+
+        write_gap(image, gap, (int)rng_range(0, 99) < args.zero);
+        position += gap;
+
+        bench_truth record = {.id = planted, .length = length, .extent_count = split ? 2 : 1};
+        strcpy(record.type, types[type]);
+        record.hash = fnv1a64(FNV1A64_INIT, content, length);
+        record.extents[0] = (bench_extent){position, first};
+
+        fwrite(content, 1, first, image);
+        position += first;
+        if (split)
+        {
+            write_gap(image, hole, false);
+            position += hole;
+            record.extents[1] = (bench_extent){position, length - first};
+            fwrite(content + first, 1, length - first, image);
+            position += length - first;
+            fragmented++;
+        }
+
+        fprintf(truth, "%d,%s,%" PRIu64 ",%016" PRIx64 ",", record.id, record.type, record.length, record.hash);
+        for (int i = 0; i < record.extent_count; i++)
+        {
+            fprintf(truth, "%s%" PRIu64 ":%" PRIu64, i ? ";" : "", record.extents[i].offset, record.extents[i].length);
+        }
+        fprintf(truth, "\n");
+        planted++;
+    }
+
+    // Pads the rest of the image
+    write_gap(image, args.size - position, (int)rng_range(0, 99) < args.zero);
+
+    printf("Generated '%s': %" PRIu64 " bytes, %d files planted (%d fragmented)\n", args.out, args.size, planted, fragmented);
+
+    free(content);
+    fclose(truth);
+    fclose(image);
+    return EXIT_SUCCESS;
+}
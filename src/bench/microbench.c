@@ -0,0 +1,451 @@
+#include "../carve.h"
+#include "../manifest.h"
+#include "../output.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef _WIN32
+#include <direct.h>
+#define chdir _chdir
+#else
+#include <unistd.h>
+#endif
+
+#define MICROBENCH_USAGE "Usage: ./microbench [--only <name substring>] [--time <ms per measurement>]"
+
+// Directory the carves of the carve_buffer benchmarks are written to
+#define SCRATCH_DIR "microbench.tmp"
+
+// Slack after every buffer so the predicates can look ahead past the last byte
+#define LOOKAHEAD 8
+
+// Buffer sizes every benchmark is run against
+static const int sizes[] = {512, 4096, 64 * 1024, 1024 * 1024};
+#define SIZES_COUNT (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+// Data patterns every benchmark is run against
+enum
+{
+    PATTERN_ZERO,    // All zero, e.g. wiped or sparse regions
+    PATTERN_RANDOM,  // Uniform random, e.g. compressed or encrypted data
+    PATTERN_FF,      // All 0xFF, the worst case for the JPEG first-byte tests
+    PATTERN_TEXT,    // Printable ASCII
+    PATTERN_MARKERS, // Random data with a JPEG, PNG or GIF signature every 4 KiB
+    PATTERNS_COUNT
+};
+
+static const char *pattern_names[PATTERNS_COUNT] = {"zero", "random", "ff", "text", "markers"};
+
+// The hardware counters of one measurement
+typedef struct counters
+{
+    double seconds;        // Wall clock time
+    uint64_t cycles;       // CPU cycles, or TSC ticks when perf counters are not available
+    uint64_t branch_misses; // Mispredicted branches, only with perf counters
+} counters;
+
+static int perf_group = -1;  // perf event group leader counting cycles
+static int perf_misses = -1; // perf event counting branch misses
+static bool has_tsc = false; // Whether the TSC is used as a cycle counter fallback
+static FILE *results;        // Where the results are printed, stdout itself is taken by the carving logs
+
+#ifdef __linux__
+static int perf_open(uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/**
+ * @brief Opens the perf counters if the kernel allows it, else falls back to the TSC
+ */
+static void counters_init()
+{
+#ifdef __linux__
+    perf_group = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (perf_group >= 0)
+    {
+        perf_misses = perf_open(PERF_COUNT_HW_BRANCH_MISSES, perf_group);
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    has_tsc = perf_group < 0;
+#endif
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void counters_start(counters *c)
+{
+#ifdef __linux__
+    if (perf_group >= 0)
+    {
+        ioctl(perf_group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf_group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    c->cycles = has_tsc ? __rdtsc() : 0;
+#endif
+    c->seconds = now_seconds();
+}
+
+static void counters_stop(counters *c)
+{
+    c->seconds = now_seconds() - c->seconds;
+#if defined(__x86_64__) || defined(__i386__)
+    if (has_tsc)
+    {
+        c->cycles = __rdtsc() - c->cycles;
+    }
+#endif
+#ifdef __linux__
+    if (perf_group >= 0)
+    {
+        uint64_t values[3] = {0}; // nr, cycles, branch misses
+        ioctl(perf_group, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        if (read(perf_group, values, sizeof(values)) > 0)
+        {
+            c->cycles = values[1];
+            c->branch_misses = values[0] > 1 ? values[2] : 0;
+        }
+    }
+#endif
+}
+
+static uint64_t rng_state = 1;
+
+static uint8_t rng_byte()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint8_t)rng_state;
+}
+
+/**
+ * @brief Fills `size` bytes of the buffer with the given pattern
+ */
+static void fill_pattern(byte_t *data, int size, int pattern)
+{
+    static const byte_t signatures[3][8] = {
+        {0xFF, 0xD8, 0xFF, 0xE0},
+        {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A},
+        {0x47, 0x49, 0x46, 0x38, 0x39, 0x61}};
+
+    for (int i = 0; i < size; i++)
+    {
+        switch (pattern)
+        {
+        case PATTERN_ZERO:
+            data[i] = 0x00;
+            break;
+        case PATTERN_FF:
+            data[i] = 0xFF;
+            break;
+        case PATTERN_TEXT:
+            data[i] = ' ' + rng_byte() % 95;
+            break;
+        default:
+            data[i] = rng_byte();
+        }
+    }
+    if (pattern == PATTERN_MARKERS)
+    {
+        for (int i = 0, j = 0; i + 8 <= size; i += 4096, j++)
+        {
+            memcpy(data + i, signatures[j % 3], 8);
+        }
+    }
+    memset(data + size, 0, LOOKAHEAD);
+}
+
+/**
+ * @brief Removes the carves the carve_buffer benchmarks wrote and resets the carving state
+ */
+static void reset_carving()
+{
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+        {
+            remove(entry->d_name);
+        }
+    }
+    if (dir)
+    {
+        closedir(dir);
+    }
+    memset(file_progresses, 0, sizeof(file_progresses));
+    memset(new_filename, 0, sizeof(new_filename));
+    file_count = 0;
+}
+
+static void report(const char *name, int pattern, int size, const counters *c, uint64_t bytes)
+{
+    fprintf(results, "%-18s %-8s %8d %10.3f", name, pattern_names[pattern], size, c->seconds * 1e9 / bytes);
+    if (perf_group >= 0 || has_tsc)
+    {
+        fprintf(results, " %12.3f", (double)c->cycles / bytes);
+    }
+    else
+    {
+        fprintf(results, " %12s", "n/a");
+    }
+    if (perf_misses >= 0)
+    {
+        fprintf(results, " %14.5f\n", (double)c->branch_misses / bytes);
+    }
+    else
+    {
+        fprintf(results, " %14s\n", "n/a");
+    }
+    fflush(results);
+}
+
+/**
+ * @brief Times a single predicate over every position of the buffer
+ */
+static void bench_predicate(const char *name, bool (*predicate)(byte_t *, int), int pattern, int size, double budget)
+{
+    counters c;
+    uint64_t bytes = 0;
+    volatile int sink = 0; // Keeps the calls from being optimized out
+
+    counters_start(&c);
+    double deadline = now_seconds() + budget;
+    do
+    {
+        int hits = 0;
+        for (int i = 0; i < size; i++)
+        {
+            hits += predicate(buffer, i);
+        }
+        sink += hits;
+        bytes += size;
+    } while (now_seconds() < deadline);
+    counters_stop(&c);
+    report(name, pattern, size, &c, bytes);
+}
+
+/**
+ * @brief Times the carving of a buffer, i.e. the span search of the scan loop
+ */
+static void bench_carve_buffer(int pattern, int size, double budget)
+{
+    counters c;
+    uint64_t bytes = 0;
+
+    reset_carving();
+    counters_start(&c);
+    double deadline = now_seconds() + budget;
+    do
+    {
+        carve_buffer(size);
+        bytes += size;
+    } while (now_seconds() < deadline);
+    counters_stop(&c);
+    report("carve_buffer", pattern, size, &c, bytes);
+    reset_carving();
+}
+
+/**
+ * @brief Times appending `size` bytes to a file one at a time
+ */
+static void bench_append(int pattern, int size, double budget)
+{
+    counters c;
+    uint64_t bytes = 0;
+    char filename[] = "append.bin";
+
+    create_file(filename, "wb");
+    counters_start(&c);
+    double deadline = now_seconds() + budget;
+    do
+    {
+        for (int i = 0; i < size && (i == 0 || now_seconds() < deadline); i++, bytes++)
+        {
+            append_char_to_file(buffer[i], filename, "ab");
+        }
+    } while (now_seconds() < deadline);
+    counters_stop(&c);
+    report("append_char", pattern, size, &c, bytes);
+    remove(filename);
+}
+
+/**
+ * @brief Times the staged writer with a call per byte, the worst case of carve_buffer
+ */
+static void bench_output(int pattern, int size, double budget)
+{
+    counters c;
+    uint64_t bytes = 0;
+    char filename[] = "output.bin";
+    char type[] = "bin";
+
+    counters_start(&c);
+    double deadline = now_seconds() + budget;
+    do
+    {
+        output_open(filename, type, 0);
+        for (int i = 0; i < size; i++)
+        {
+            output_write(&buffer[i], 1);
+        }
+        output_close(END_TRAILER);
+        bytes += size;
+    } while (now_seconds() < deadline);
+    counters_stop(&c);
+    report("output_write", pattern, size, &c, bytes);
+    remove(filename);
+}
+
+/**
+ * @brief Times the CRC-32 the PNG validation runs over the staged carves
+ */
+static void bench_crc32(int pattern, int size, double budget)
+{
+    counters c;
+    uint64_t bytes = 0;
+    volatile uint32_t sink = 0; // Keeps the calls from being optimized out
+
+    counters_start(&c);
+    double deadline = now_seconds() + budget;
+    do
+    {
+        sink = crc32_update(sink, buffer, size);
+        bytes += size;
+    } while (now_seconds() < deadline);
+    counters_stop(&c);
+    report("crc32", pattern, size, &c, bytes);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *only = NULL;
+    double budget = 0.2;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--only") == 0 && i + 1 < argc)
+        {
+            only = argv[++i];
+        }
+        else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+        {
+            budget = atoi(argv[++i]) / 1000.0;
+        }
+        else
+        {
+            printf("%s\n", MICROBENCH_USAGE);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct
+    {
+        const char *name;
+        bool (*predicate)(byte_t *, int);
+    } predicates[] = {
+        {"is_JPEG_header", is_JPEG_header},
+        {"is_JPEG_trailer", is_JPEG_trailer},
+        {"is_PNG_header", is_PNG_header},
+        {"is_PNG_trailer", is_PNG_trailer},
+        {"is_GIF_header", is_GIF_header},
+        {"is_GIF_trailer", is_GIF_trailer},
+    };
+
+    counters_init();
+    buffer = malloc(sizes[SIZES_COUNT - 1] + LOOKAHEAD);
+    CHECK_OR_EXIT(buffer);
+
+#ifdef _WIN32
+    mkdir(SCRATCH_DIR);
+#else
+    mkdir(SCRATCH_DIR, 0755);
+#endif
+    if (chdir(SCRATCH_DIR) != 0)
+    {
+        perror(SCRATCH_DIR);
+        return EXIT_FAILURE;
+    }
+
+    // The carving log lines would drown the results, so they are discarded
+    results = fdopen(dup(fileno(stdout)), "w");
+    freopen(
+#ifdef _WIN32
+        "NUL",
+#else
+        "/dev/null",
+#endif
+        "w", stdout);
+
+    fprintf(results, "counters: %s\n", perf_group >= 0 ? "perf (cycles, branch-misses)" : has_tsc ? "tsc (no branch-misses)" : "none (time only)");
+    fprintf(results, "%-18s %-8s %8s %10s %12s %14s\n", "benchmark", "pattern", "size", "ns/byte", "cycles/byte", "br-miss/byte");
+    fflush(results);
+
+    for (int p = 0; p < PATTERNS_COUNT; p++)
+    {
+        for (int s = 0; s < SIZES_COUNT; s++)
+        {
+            BUFFER_SIZE = sizes[s];
+            fill_pattern(buffer, sizes[s], p);
+
+            for (size_t k = 0; k < sizeof(predicates) / sizeof(predicates[0]); k++)
+            {
+                if (!only || strstr(predicates[k].name, only))
+                {
+                    bench_predicate(predicates[k].name, predicates[k].predicate, p, sizes[s], budget);
+                }
+            }
+            if (!only || strstr("carve_buffer", only))
+            {
+                bench_carve_buffer(p, sizes[s], budget);
+            }
+            if (!only || strstr("append_char", only))
+            {
+                bench_append(p, sizes[s], budget);
+            }
+            if (!only || strstr("output_write", only))
+            {
+                bench_output(p, sizes[s], budget);
+            }
+            if (!only || strstr("crc32", only))
+            {
+                bench_crc32(p, sizes[s], budget);
+            }
+        }
+    }
+
+    if (chdir("..") == 0)
+    {
+        rmdir(SCRATCH_DIR);
+    }
+    free(buffer);
+    return EXIT_SUCCESS;
+}
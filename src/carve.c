@@ -0,0 +1,299 @@
+#include "carve.h"
+#include <inttypes.h>
+#include "log.h"
+#include "manifest.h"
+#include "output.h"
+
+// Keeps track of the file progresses in the order of the enum in carve.h
+THREAD_LOCAL bool file_progresses[FILE_TYPES_COUNT] = {0};
+
+char *file_exts[FILE_TYPES_COUNT] = {
+    "jpeg", "png", "gif"};
+
+// An array that keeps the track of trailer sizes
+int trailer_sizes[FILE_TYPES_COUNT] = {
+    JPEG_TRAILER_SIZE, PNG_TRAILER_SIZE, GIF_TRAILER_SIZE};
+
+// An array of function pointer for checking the header order of different file types.
+bool (*is_header_funcs[FILE_TYPES_COUNT])(byte_t *, int) = {
+    is_JPEG_header, is_PNG_header, is_GIF_header};
+
+// An array of function pointer for checking the trailer order of different file types.
+bool (*is_trailer_funcs[FILE_TYPES_COUNT])(byte_t *, int) = {
+    is_JPEG_trailer, is_PNG_trailer, is_GIF_trailer};
+
+// An array of function pointers for getting the trailer functions
+void (*get_trailer_funcs[FILE_TYPES_COUNT])(byte_t *) = {
+    get_JPEG_trailer, get_PNG_trailer, get_GIF_trailer};
+
+// The file types whose header starts with a byte, one bit per type in the order of the enum in carve.h. Only the
+// bytes found here are handed to the header predicates.
+static const uint8_t header_leads[256] = {
+    [0xFF] = 1 << JPEG, [0x89] = 1 << PNG, [0x47] = 1 << GIF};
+
+// The file types whose trailer starts with a byte, likewise
+static const uint8_t trailer_leads[256] = {
+    [0xFF] = 1 << JPEG, [0x49] = 1 << PNG, [0x00] = 1 << GIF};
+
+THREAD_LOCAL int file_count = 0;                       // Counts the file found.
+THREAD_LOCAL char new_filename[FILENAME_MAX] = {0};    // A place for holding the new filename generated
+THREAD_LOCAL int BUFFER_SIZE;                          // The buffer size chosen by the user in command line args
+THREAD_LOCAL byte_t *buffer;                           // The window carved in an iteration, the carried bytes and the read
+THREAD_LOCAL uint64_t buffer_offset = 0;               // The offset of the buffer in the scanned stream
+THREAD_LOCAL int header_alignment = 1;                 // Headers are only looked for at multiples of it, i.e. cluster starts
+THREAD_LOCAL uint64_t alignment_base = 0;              // The offset of the first cluster in the scanned stream
+THREAD_LOCAL char carve_directory[FILENAME_MAX] = {0}; // The directory the carves are written to, empty for the current one
+THREAD_LOCAL uint64_t header_limit = UINT64_MAX;       // No carve is started at or past it in the scanned stream, the open one runs on
+THREAD_LOCAL bool limit_reached = false;               // Whether the scan stopped at header_limit
+THREAD_LOCAL uint64_t limit_stop = 0;                  // Where it stopped: the first byte of the stream it left to the next chunk
+THREAD_LOCAL int carves_refused = 0;                   // The headers not carved because their path was too long
+
+static THREAD_LOCAL int layout = LAYOUT_FLAT;           // How the carves are spread over subdirectories
+static THREAD_LOCAL bool offset_names = false;          // Whether carves are named after their offset instead of the counter
+static THREAD_LOCAL int last_shard = -1;                // The counter shard created last
+static THREAD_LOCAL uint8_t shards_made[HASH_SHARDS / 8]; // The hash shards created so far
+
+/**
+ * @brief Sets how the carves of the scan are named and laid out
+ *
+ * @param carve_layout One of the LAYOUT_* values
+ * @param name_by_offset Whether carves are named after the offset of their header in the input
+ */
+void carve_layout_init(int carve_layout, bool name_by_offset)
+{
+    layout = carve_layout;
+    offset_names = name_by_offset;
+    last_shard = -1;
+    memset(shards_made, 0, sizeof(shards_made));
+}
+
+/**
+ * @brief Builds the path of a new carve: the carve directory, the shard for the sharded layouts, and the name.
+ *        Shards are created the first time a carve goes into them.
+ *
+ * @param offset The offset of the header in the scanned stream
+ * @param ext The extension of the file type
+ * @param path Receives the path
+ * @return false if the path is longer than FILENAME_MAX
+ */
+static bool carve_path(uint64_t offset, char *ext, char path[FILENAME_MAX])
+{
+    char name[FILENAME_MAX];
+    uint64_t origin = output_origin(offset);
+    if (offset_names)
+        snprintf(name, sizeof(name), "%012" PRIx64 ".%s", origin, ext); // Unique across the regions of a disk as well
+    else
+        generate_filename(file_count, ext, name);
+
+    // A shard is only created once its name is known to fit
+    char directory[FILENAME_MAX];
+    int length = snprintf(directory, sizeof(directory), "%s%s", carve_directory, carve_directory[0] ? "/" : "");
+    bool fits = length >= 0 && length < FILENAME_MAX;
+    if (fits && layout == LAYOUT_COUNTER)
+    {
+        int shard = file_count / SHARD_FILES;
+        int n = snprintf(directory + length, FILENAME_MAX - length, "%04d", shard);
+        fits = n >= 0 && length + n < FILENAME_MAX;
+        if (fits && shard != last_shard && make_directory(directory))
+        {
+            last_shard = shard;
+        }
+    }
+    else if (fits && layout == LAYOUT_HASH)
+    {
+        // Spread by a multiplicative hash of the name, so neighbouring carves land in different shards
+        uint64_t key = offset_names ? origin : (uint64_t)file_count;
+        int shard = (int)((key * 0x9e3779b97f4a7c15ULL) >> 56) % HASH_SHARDS;
+        int n = snprintf(directory + length, FILENAME_MAX - length, "%02x", shard);
+        fits = n >= 0 && length + n < FILENAME_MAX;
+        if (fits && !(shards_made[shard / 8] & (1 << (shard % 8))) && make_directory(directory))
+        {
+            shards_made[shard / 8] |= 1 << (shard % 8);
+        }
+    }
+    if (!fits)
+    {
+        return false;
+    }
+
+    length = snprintf(path, FILENAME_MAX, "%s%s%s", directory, layout == LAYOUT_FLAT ? "" : "/", name);
+    return length >= 0 && length < FILENAME_MAX;
+}
+
+/**
+ * @brief Whether a header may start at `iteration` of the buffer. Files on a filesystem start at a cluster,
+ *        a header anywhere else is inside another file.
+ */
+static bool header_aligned(int iteration)
+{
+    return header_alignment == 1 || (buffer_offset + iteration - alignment_base) % header_alignment == 0;
+}
+
+/**
+ * @brief Finds the next header while no carve is in progress, only the cluster starts are looked at
+ *
+ * @param from The index to start at
+ * @param length The bytes in the buffer
+ * @param type Receives the file type of the header
+ * @return Its index, `length` when there is none
+ */
+static int next_header(int from, int length, int *type)
+{
+    int step = header_alignment;
+    if (step > 1)
+    {
+        int misaligned = (int)((buffer_offset + from - alignment_base) % step);
+        from += misaligned ? step - misaligned : 0;
+    }
+    for (int i = from; i < length; i += step)
+    {
+        uint8_t candidates = header_leads[buffer[i]];
+        for (int t = 0; candidates; t++, candidates >>= 1)
+        {
+            if ((candidates & 1) && is_header_funcs[t](buffer, i))
+            {
+                *type = t;
+                return i;
+            }
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Finds where the carve in progress ends: its trailer, or the header of another file type that cuts it short
+ *
+ * @param from The index to start at
+ * @param length The bytes in the buffer
+ * @param active The file type of the carve
+ * @param type Receives the file type of the trailer or header, `active` for the trailer
+ * @return Its index, `length` when the carve goes on past the buffer
+ */
+static int next_boundary(int from, int length, int active, int *type)
+{
+    uint8_t trailers = 1 << active;
+    uint8_t headers = ((1 << FILE_TYPES_COUNT) - 1) & ~trailers;
+    for (int i = from; i < length; i++)
+    {
+        byte_t b = buffer[i];
+        if (!((trailer_leads[b] & trailers) | (header_leads[b] & headers)))
+        {
+            continue; // The bulk of a carve, no predicate is called
+        }
+        if ((trailer_leads[b] & trailers) && is_trailer_funcs[active](buffer, i))
+        {
+            *type = active;
+            return i;
+        }
+        uint8_t candidates = header_leads[b] & headers;
+        for (int t = 0; candidates && header_aligned(i); t++, candidates >>= 1)
+        {
+            if ((candidates & 1) && is_header_funcs[t](buffer, i))
+            {
+                *type = t;
+                return i;
+            }
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Carves the bytes of the buffer. Instead of stepping every file type through every byte, it searches ahead
+ *        for the next header, then for the trailer of that carve or another header cutting it short, and hands the
+ *        whole span between them to the output in one call.
+ *
+ * @param length The bytes to carve, followed by at least SIGNATURE_MAX - 1 bytes the predicates may look at
+ */
+void carve_buffer(int length)
+{
+    int active = -1; // The file type of the carve in progress
+    for (int t = 0; t < FILE_TYPES_COUNT; t++)
+    {
+        if (file_progresses[t] && active < 0)
+        {
+            active = t;
+        }
+        file_progresses[t] = t == active; // Only one carve is ever open
+    }
+
+    for (int i = 0; i < length;)
+    {
+        int type, at;
+        if (active < 0)
+        {
+            // A chunk of a batch image starts no carve past its end, the next chunk does
+            if (buffer_offset + i >= header_limit)
+            {
+                limit_reached = true;
+                limit_stop = buffer_offset + i;
+                return;
+            }
+            int end = header_limit - buffer_offset < (uint64_t)length ? (int)(header_limit - buffer_offset) : length;
+            at = next_header(i, end, &type);
+            if (at >= end)
+            {
+                i = end;
+                continue;
+            }
+        }
+        else
+        {
+            at = next_boundary(i, length, active, &type);
+
+            // The span up to the boundary, with the trailer if that is where it ended
+            int end = at < length && type == active ? at + trailer_sizes[active] : at;
+            output_write(&buffer[i], end - i);
+            if (at >= length)
+            {
+                break;
+            }
+        }
+
+        if (type == active)
+        {
+            file_progresses[active] = false;
+            active = -1;
+            output_close(END_TRAILER);
+            log_msg(LOG_VERBOSE, "Ended Writing to %s\n", new_filename); // Logs that the file is done being written
+            memset(&new_filename[0], 0x0, FILENAME_MAX);                  // Resetting the new filename to NULL
+            i = at + 1;                                                   // The trailer may hold the next header
+        }
+        else
+        {
+            if (active >= 0)
+            {
+                file_progresses[active] = false; // output_open finishes it, cut short by the header
+            }
+            if (buffer_offset + at >= header_limit)
+            {
+                // The header belongs to the next chunk, only the carve it cuts short belongs to this one
+                output_close(END_HEADER);
+                memset(&new_filename[0], 0x0, FILENAME_MAX);
+                limit_reached = true;
+                limit_stop = buffer_offset + at;
+                return;
+            }
+            log_msg(LOG_DEBUG, "\nFound '%s' Header!\n", file_exts[type]); // Prints that a certain type of file has been found.
+            if (!carve_path(buffer_offset + at, file_exts[type], new_filename)) // Generates a filename for it.
+            {
+                // Refused rather than written to a cut path, the carve in progress still ends at this header
+                log_msg(LOG_ERROR, "The path of the %s at offset %" PRIu64 " is longer than %d bytes, it is not carved\n",
+                        file_exts[type], output_origin(buffer_offset + at), FILENAME_MAX - 1);
+                output_close(END_HEADER);
+                memset(&new_filename[0], 0x0, FILENAME_MAX);
+                carves_refused++;
+                active = -1;
+                i = at + 1;
+                continue;
+            }
+            output_open(new_filename, file_exts[type], buffer_offset + at);  // Starts the carve that is written to it.
+            log_msg(LOG_DEBUG, "Starting to write to %s\n", new_filename);    // Prints a few log messages
+
+            file_count++; // Increments the file_counter
+            file_progresses[type] = true;
+            active = type;
+            i = at; // The header is the first byte of the span
+        }
+    }
+}
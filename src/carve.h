@@ -0,0 +1,55 @@
+#ifndef __CARVE_H__
+#define __CARVE_H__
+
+#include "utils.h"
+
+#define FILE_TYPES_COUNT 3
+
+// The longest header or trailer, the predicates look up to SIGNATURE_MAX - 1 bytes past the byte they test
+#define SIGNATURE_MAX 8
+
+// Bytes after the end of the scan buffer, zeroed behind the last bytes of the input for the predicates to look at
+#define BUFFER_PADDING 16
+
+// Room in front of the reads of the scan buffer for the bytes carried over from the previous read, a page so the
+// reads stay aligned for direct I/O
+#define WINDOW_HEAD 4096
+
+// The carves per subdirectory of LAYOUT_COUNTER
+#define SHARD_FILES 1000
+
+// The subdirectories of LAYOUT_HASH
+#define HASH_SHARDS 256
+
+// Defines the order in which file are being tested
+enum
+{
+    JPEG,
+    PNG,
+    GIF
+};
+
+extern THREAD_LOCAL bool file_progresses[FILE_TYPES_COUNT];
+extern char *file_exts[FILE_TYPES_COUNT];
+extern int trailer_sizes[FILE_TYPES_COUNT];
+extern bool (*is_header_funcs[FILE_TYPES_COUNT])(byte_t *, int);
+extern bool (*is_trailer_funcs[FILE_TYPES_COUNT])(byte_t *, int);
+extern void (*get_trailer_funcs[FILE_TYPES_COUNT])(byte_t *);
+
+extern THREAD_LOCAL int file_count;                     // Counts the file found.
+extern THREAD_LOCAL char new_filename[FILENAME_MAX];    // A place for holding the new filename generated
+extern THREAD_LOCAL int BUFFER_SIZE;                    // The buffer size chosen by the user in command line args
+extern THREAD_LOCAL byte_t *buffer;                     // The window carved in an iteration, the carried bytes and the read
+extern THREAD_LOCAL uint64_t buffer_offset;             // The offset of the buffer in the scanned stream
+extern THREAD_LOCAL int header_alignment;               // Headers are only looked for at multiples of it, i.e. cluster starts
+extern THREAD_LOCAL uint64_t alignment_base;            // The offset of the first cluster in the scanned stream
+extern THREAD_LOCAL char carve_directory[FILENAME_MAX]; // The directory the carves are written to, empty for the current one
+extern THREAD_LOCAL uint64_t header_limit;              // No carve is started at or past it in the scanned stream, the open one runs on
+extern THREAD_LOCAL bool limit_reached;                 // Whether the scan stopped at header_limit
+extern THREAD_LOCAL uint64_t limit_stop;                // Where it stopped: the first byte of the stream it left to the next chunk
+extern THREAD_LOCAL int carves_refused;                 // The headers not carved because their path was too long
+
+void carve_layout_init(int carve_layout, bool name_by_offset);
+void carve_buffer(int length);
+
+#endif //__CARVE_H__
@@ -0,0 +1,130 @@
+#include "checkpoint.h"
+#include <inttypes.h>
+
+/**
+ * @brief Writes the checkpoint as `key=value` lines. The file is first written next to `path`, flushed to the disk
+ *        and then renamed over it so a crash while saving, even a power loss, never leaves a half written checkpoint
+ *        behind. The rename is flushed as well.
+ *
+ * @param path The checkpoint file
+ * @param cp The checkpoint to save
+ * @return true if the checkpoint was saved
+ */
+bool checkpoint_save(const char *path, const checkpoint *cp)
+{
+    char temp_path[FILENAME_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *file = fopen(temp_path, "w");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    fprintf(file, "version=%d\n", CHECKPOINT_VERSION);
+    fprintf(file, "mode=%d\n", cp->mode);
+    fprintf(file, "source=%s\n", cp->source);
+    fprintf(file, "buffer_size=%d\n", cp->buffer_size);
+    fprintf(file, "object_size=%" PRIu64 "\n", cp->object_size);
+    fprintf(file, "alignment=%d\n", cp->alignment);
+    fprintf(file, "offset=%" PRIu64 "\n", cp->offset);
+    fprintf(file, "file_count=%d\n", cp->file_count);
+    for (int i = 0; i < FILE_TYPES_COUNT; i++)
+    {
+        fprintf(file, "progress_%s=%d\n", file_exts[i], cp->progresses[i]);
+    }
+    fprintf(file, "filename=%s\n", cp->filename);
+    fprintf(file, "filename_size=%" PRIu64 "\n", cp->filename_size);
+    fprintf(file, "manifest_size=%" PRIu64 "\n", cp->manifest_size);
+
+    bool written = sync_file(file);
+    written = fclose(file) == 0 && written;
+    if (!written)
+    {
+        remove(temp_path);
+        return false;
+    }
+
+#ifdef _WIN32
+    remove(path); // rename does not replace an existing file on Windows
+#endif
+    if (rename(temp_path, path) != 0)
+    {
+        return false;
+    }
+    char directory[FILENAME_MAX];
+    strncpy(directory, path, FILENAME_MAX - 1);
+    directory[FILENAME_MAX - 1] = '\0';
+    char *name = strrchr(directory, '/');
+    if (name)
+        *name = '\0';
+    return sync_directory(name == directory ? "/" : name ? directory : ".");
+}
+
+/**
+ * @brief Reads a checkpoint written by checkpoint_save
+ *
+ * @param path The checkpoint file
+ * @param cp The place where the checkpoint is stored
+ * @return true if a complete checkpoint of the current version was read
+ */
+bool checkpoint_load(const char *path, checkpoint *cp)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    memset(cp, 0, sizeof(*cp));
+    char line[FILENAME_MAX + 32];
+    int version = 0;
+    int progress;
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *value = strchr(line, '=');
+        if (value == NULL)
+        {
+            continue;
+        }
+        *value++ = '\0';
+
+        if (strcmp(line, "version") == 0)
+            version = atoi(value);
+        else if (strcmp(line, "mode") == 0)
+            cp->mode = atoi(value);
+        else if (strcmp(line, "source") == 0)
+            strncpy(cp->source, value, FILENAME_MAX - 1);
+        else if (strcmp(line, "buffer_size") == 0)
+            cp->buffer_size = atoi(value);
+        else if (strcmp(line, "object_size") == 0)
+            cp->object_size = strtoull(value, NULL, 10);
+        else if (strcmp(line, "alignment") == 0)
+            cp->alignment = atoi(value);
+        else if (strcmp(line, "offset") == 0)
+            cp->offset = strtoull(value, NULL, 10);
+        else if (strcmp(line, "file_count") == 0)
+            cp->file_count = atoi(value);
+        else if (strcmp(line, "filename") == 0)
+            strncpy(cp->filename, value, FILENAME_MAX - 1);
+        else if (strcmp(line, "filename_size") == 0)
+            cp->filename_size = strtoull(value, NULL, 10);
+        else if (strcmp(line, "manifest_size") == 0)
+            cp->manifest_size = strtoull(value, NULL, 10);
+        else if (strncmp(line, "progress_", 9) == 0)
+        {
+            progress = atoi(value);
+            for (int i = 0; i < FILE_TYPES_COUNT; i++)
+            {
+                if (strcmp(line + 9, file_exts[i]) == 0)
+                {
+                    cp->progresses[i] = progress != 0;
+                }
+            }
+        }
+    }
+    fclose(file);
+
+    return version == CHECKPOINT_VERSION && cp->mode != 0 && cp->buffer_size >= 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "carve.h"
+
+// Version of the checkpoint file format
+#define CHECKPOINT_VERSION 4
+
+// A snapshot of the scan that is enough to continue it with identical output
+typedef struct checkpoint
+{
+    int mode;                          // MODE_FILE or MODE_DRIVE
+    char source[FILENAME_MAX];         // The filename or drive name being scanned
+    int buffer_size;                   // The buffer size, BUFFER_AUTO when it was tuned
+    uint64_t object_size;              // The size of the source, to catch a different source under the same name
+    int alignment;                     // The header alignment, the carves depend on it so it must not change
+    uint64_t offset;                   // The number of bytes scanned so far
+    int file_count;                    // The output counter
+    bool progresses[FILE_TYPES_COUNT]; // The open carve states in the order of the file type enum
+    char filename[FILENAME_MAX];       // The carve being written, empty if none
+    uint64_t filename_size;            // The size of that carve at the time of the checkpoint
+    uint64_t manifest_size;            // The size of the manifest, rows past it are written again
+} checkpoint;
+
+bool checkpoint_save(const char *path, const checkpoint *cp);
+bool checkpoint_load(const char *path, checkpoint *cp);
+
+#endif //__CHECKPOINT_H__
@@ -0,0 +1,704 @@
+#include "source.h"
+#include "log.h"
+#include <pthread.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// The compressed bytes read at once when streaming
+#define COMPRESSED_CHUNK (256 * 1024)
+
+// Blocks decompressed per batch for every thread, one batch is decompressed while the previous one is scanned
+#define BLOCKS_PER_THREAD 4
+
+// The largest zstd frame decompressed as a block, larger frames are only supported when streaming
+#define MAX_FRAME_SIZE (256 * 1024 * 1024)
+
+// An independently decompressible piece of the input, i.e. a BGZF member or a zstd frame
+typedef struct block
+{
+    byte_t *in;      // The compressed block
+    size_t in_len;   // Its length
+    size_t in_cap;   // The allocated size of `in`
+    byte_t *out;     // The decompressed block
+    size_t out_len;  // Its length
+    size_t out_cap;  // The allocated size of `out`
+    bool ok;         // Whether the block decompressed cleanly
+} block;
+
+// A group of blocks decompressed in parallel
+typedef struct batch
+{
+    block *blocks; // BLOCKS_PER_THREAD * threads blocks
+    int count;     // The number of blocks filled
+    int next;      // The next block a worker picks up
+    int done;      // The number of blocks decompressed
+} batch;
+
+typedef struct compressed_state compressed_state;
+
+// The format specific parts of the blocked decompression
+typedef struct block_format
+{
+    bool (*next)(compressed_state *state, block *b); // Reads the next compressed block from the file
+    void (*decode)(block *b);                        // Decompresses a block, runs on the workers
+} block_format;
+
+// State of the compressed backend
+struct compressed_state
+{
+    FILE *file;   // The compressed file
+    int format;   // FORMAT_GZIP or FORMAT_ZSTD
+    bool failed;  // Set once the input turned out to be corrupt
+
+    // Streaming mode
+    byte_t *in;            // Compressed data read from the file
+    size_t in_cap;         // The allocated size of `in`
+    size_t in_len;         // The bytes in `in`
+    size_t in_pos;         // The bytes of `in` already consumed
+    bool ended;            // Whether the decompressor reached the end of the input
+    bool in_member;        // Whether the decompressor is inside a gzip member or zstd frame
+    bool bgzf_empty;       // Whether the last BGZF block holds no data, a complete file ends with such an EOF block
+#ifdef HAVE_ZLIB
+    z_stream z;            // gzip stream
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;    // zstd stream
+#endif
+
+    // Blocked mode
+    const block_format *blocked; // NULL when streaming
+    pthread_t *threads;          // The decompression workers
+    int thread_count;            // Their number
+    pthread_mutex_t lock;        // Guards the batches and `stop`
+    pthread_cond_t work;         // Signalled when a batch is submitted
+    pthread_cond_t finished;     // Signalled when a batch is fully decompressed
+    batch batches[2];            // One batch is served to the scan while the other is decompressed
+    int serving;                 // The batch being served, -1 before the first one
+    int pending;                 // The batch being decompressed, -1 at the end of the input
+    int served_block;            // The block of the served batch being copied out
+    size_t served_offset;        // The offset in that block
+    bool stop;                   // Tells the workers to exit
+};
+
+/**
+ * @brief Makes sure the buffer holds at least `size` bytes
+ */
+static void reserve(byte_t **data, size_t *capacity, size_t size)
+{
+    if (*capacity < size)
+    {
+        *data = realloc(*data, size);
+        CHECK_OR_EXIT(*data);
+        *capacity = size;
+    }
+}
+
+/**
+ * @brief Fills the streaming input buffer once it is fully consumed
+ *
+ * @return false at the end of the file
+ */
+static bool refill(compressed_state *state)
+{
+    if (state->in_pos < state->in_len)
+    {
+        return true;
+    }
+    state->in_len = fread(state->in, 1, COMPRESSED_CHUNK, state->file);
+    state->in_pos = 0;
+    return state->in_len > 0;
+}
+
+#ifdef HAVE_ZLIB
+/**
+ * @brief Reads the next BGZF member. The BC extra subfield holds the member size, members without it cannot be split.
+ *        A file cut inside a member, or right after one without the empty EOF block behind it, is truncated.
+ */
+static bool bgzf_next(compressed_state *state, block *b)
+{
+    byte_t header[12];
+    size_t got = fread(header, 1, sizeof(header), state->file);
+    if (got == 0 && !state->bgzf_empty)
+    {
+        log_msg(LOG_ERROR, "Error decompressing: the BGZF end-of-file block is missing, the file is cut short\n");
+        state->failed = true;
+        return false;
+    }
+    if (got != sizeof(header))
+    {
+        if (got)
+        {
+            log_msg(LOG_ERROR, "Error decompressing: truncated BGZF block\n");
+            state->failed = true;
+        }
+        return false;
+    }
+    if (header[0] != 0x1F || header[1] != 0x8B || !(header[3] & 0x04))
+    {
+        log_msg(LOG_ERROR, "Error decompressing: gzip member without BGZF block size\n");
+        state->failed = true;
+        return false;
+    }
+
+    size_t xlen = header[10] | header[11] << 8;
+    byte_t extra[65536];
+    if (fread(extra, 1, xlen, state->file) != xlen)
+    {
+        log_msg(LOG_ERROR, "Error decompressing: truncated BGZF block\n");
+        state->failed = true;
+        return false;
+    }
+
+    // Looks for the BC subfield holding the total block size - 1
+    size_t block_size = 0;
+    for (size_t i = 0; i + 4 <= xlen; i += 4 + (extra[i + 2] | extra[i + 3] << 8))
+    {
+        if (extra[i] == 'B' && extra[i + 1] == 'C' && (extra[i + 2] | extra[i + 3] << 8) == 2 && i + 6 <= xlen)
+        {
+            block_size = (size_t)(extra[i + 4] | extra[i + 5] << 8) + 1;
+        }
+    }
+    if (block_size < sizeof(header) + xlen + 8)
+    {
+        log_msg(LOG_ERROR, "Error decompressing: gzip member without BGZF block size\n");
+        state->failed = true;
+        return false;
+    }
+
+    reserve(&b->in, &b->in_cap, block_size);
+    memcpy(b->in, header, sizeof(header));
+    memcpy(b->in + sizeof(header), extra, xlen);
+    size_t rest = block_size - sizeof(header) - xlen;
+    if (fread(b->in + sizeof(header) + xlen, 1, rest, state->file) != rest)
+    {
+        log_msg(LOG_ERROR, "Error decompressing: truncated BGZF block\n");
+        state->failed = true;
+        return false;
+    }
+    b->in_len = block_size;
+    const byte_t *isize = b->in + block_size - 4;
+    state->bgzf_empty = (isize[0] | isize[1] | isize[2] | isize[3]) == 0;
+    return true;
+}
+
+/**
+ * @brief Inflates a whole gzip member, its size is the ISIZE field of the member's footer
+ */
+static void bgzf_decode(block *b)
+{
+    const byte_t *footer = b->in + b->in_len - 4;
+    size_t size = (size_t)footer[0] | (size_t)footer[1] << 8 | (size_t)footer[2] << 16 | (size_t)footer[3] << 24;
+    reserve(&b->out, &b->out_cap, size ? size : 1);
+
+    z_stream z = {0};
+    b->ok = false;
+    b->out_len = 0;
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+    {
+        return;
+    }
+    z.next_in = b->in;
+    z.avail_in = (uInt)b->in_len;
+    z.next_out = b->out;
+    z.avail_out = (uInt)size;
+    int status = inflate(&z, Z_FINISH);
+    b->out_len = size - z.avail_out;
+    b->ok = status == Z_STREAM_END && b->out_len == size;
+    inflateEnd(&z);
+}
+
+static const block_format bgzf_format = {bgzf_next, bgzf_decode};
+
+/**
+ * @brief Checks if the gzip header at the start of the file carries a BGZF block size
+ */
+static bool is_bgzf(FILE *file)
+{
+    byte_t header[18];
+    size_t n = fread(header, 1, sizeof(header), file);
+    seek_file(file, 0);
+    return n == sizeof(header) && (header[3] & 0x04) &&
+           header[12] == 'B' && header[13] == 'C' && header[14] == 2 && header[15] == 0;
+}
+
+/**
+ * @brief Inflates the gzip stream, members following each other are decompressed one after the other
+ */
+static size_t gzip_stream_read(compressed_state *state, byte_t *data, size_t length)
+{
+    state->z.next_out = data;
+    state->z.avail_out = (uInt)length;
+    while (state->z.avail_out > 0 && !state->ended)
+    {
+        // At the end of the file a member still open is flushed, if that makes no progress it was cut short
+        bool more = refill(state);
+        if (!more && !state->in_member)
+        {
+            state->ended = true;
+            break;
+        }
+        state->z.next_in = state->in + state->in_pos;
+        state->z.avail_in = (uInt)(state->in_len - state->in_pos);
+        uInt before = state->z.avail_out;
+        int status = inflate(&state->z, Z_NO_FLUSH);
+        state->in_pos = state->in_len - state->z.avail_in;
+
+        if (status == Z_STREAM_END)
+        {
+            inflateReset(&state->z); // Another member may follow
+            state->in_member = false;
+        }
+        else if (status != Z_OK && status != Z_BUF_ERROR)
+        {
+            log_msg(LOG_ERROR, "Error decompressing: %s\n", state->z.msg ? state->z.msg : "corrupt gzip data");
+            state->failed = state->ended = true;
+        }
+        else
+        {
+            state->in_member = true;
+            if (!more && state->z.avail_out == before)
+            {
+                log_msg(LOG_ERROR, "Error decompressing: truncated gzip member\n");
+                state->failed = state->ended = true;
+            }
+        }
+    }
+    return length - state->z.avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/**
+ * @brief Reads the next zstd frame, more of the input is buffered until the frame is complete
+ */
+static bool zstd_next(compressed_state *state, block *b)
+{
+    for (;;)
+    {
+        size_t available = state->in_len - state->in_pos;
+        size_t frame = ZSTD_findFrameCompressedSize(state->in + state->in_pos, available);
+        if (!ZSTD_isError(frame))
+        {
+            reserve(&b->in, &b->in_cap, frame);
+            memcpy(b->in, state->in + state->in_pos, frame);
+            b->in_len = frame;
+            state->in_pos += frame;
+            return true;
+        }
+        if (available >= MAX_FRAME_SIZE)
+        {
+            log_msg(LOG_ERROR, "Error decompressing: zstd frame larger than %d MiB\n", MAX_FRAME_SIZE >> 20);
+            state->failed = true;
+            return false;
+        }
+
+        // Moves the incomplete frame to the front and reads more behind it
+        memmove(state->in, state->in + state->in_pos, available);
+        state->in_pos = 0;
+        state->in_len = available;
+        reserve(&state->in, &state->in_cap, available + COMPRESSED_CHUNK);
+        size_t n = fread(state->in + available, 1, COMPRESSED_CHUNK, state->file);
+        if (n == 0)
+        {
+            if (available)
+            {
+                log_msg(LOG_ERROR, "Error decompressing: truncated zstd frame\n");
+                state->failed = true;
+            }
+            return false;
+        }
+        state->in_len += n;
+    }
+}
+
+/**
+ * @brief Decompresses a whole zstd frame, frames without a content size grow the output as needed
+ */
+static void zstd_decode(block *b)
+{
+    unsigned long long size = ZSTD_getFrameContentSize(b->in, b->in_len);
+    b->ok = false;
+    b->out_len = 0;
+    if (size == ZSTD_CONTENTSIZE_ERROR)
+    {
+        return;
+    }
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        reserve(&b->out, &b->out_cap, size ? (size_t)size : 1);
+        size_t n = ZSTD_decompress(b->out, (size_t)size, b->in, b->in_len);
+        b->ok = !ZSTD_isError(n) && n == size;
+        b->out_len = b->ok ? n : 0;
+        return;
+    }
+
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_inBuffer in = {b->in, b->in_len, 0};
+    size_t status = 1;
+    reserve(&b->out, &b->out_cap, ZSTD_DStreamOutSize());
+    while (status != 0)
+    {
+        if (b->out_len == b->out_cap)
+        {
+            reserve(&b->out, &b->out_cap, b->out_cap * 2);
+        }
+        ZSTD_outBuffer out = {b->out, b->out_cap, b->out_len};
+        status = ZSTD_decompressStream(stream, &out, &in);
+        b->out_len = out.pos;
+        if (ZSTD_isError(status) || (in.pos == in.size && out.pos < out.size && status != 0))
+        {
+            break;
+        }
+    }
+    b->ok = status == 0;
+    ZSTD_freeDStream(stream);
+}
+
+static const block_format zstd_format = {zstd_next, zstd_decode};
+
+/**
+ * @brief Checks if the first zstd frame ends within the first chunk, i.e. the file is made of many small frames
+ *        (pzstd, the seekable format) rather than one big frame
+ */
+static bool is_multi_frame(compressed_state *state)
+{
+    state->in_len = fread(state->in, 1, COMPRESSED_CHUNK, state->file);
+    state->in_pos = 0;
+    size_t frame = ZSTD_findFrameCompressedSize(state->in, state->in_len);
+    return !ZSTD_isError(frame) && frame < state->in_len;
+}
+
+/**
+ * @brief Decompresses the zstd stream, frames following each other are decompressed one after the other
+ */
+static size_t zstd_stream_read(compressed_state *state, byte_t *data, size_t length)
+{
+    ZSTD_outBuffer out = {data, length, 0};
+    while (out.pos < out.size && !state->ended)
+    {
+        // At the end of the file a frame still open is flushed, if that makes no progress it was cut short
+        bool more = refill(state);
+        if (!more && !state->in_member)
+        {
+            state->ended = true;
+            break;
+        }
+        ZSTD_inBuffer in = {state->in, state->in_len, state->in_pos};
+        size_t before = out.pos;
+        size_t status = ZSTD_decompressStream(state->zstd, &out, &in);
+        state->in_pos = in.pos;
+        if (ZSTD_isError(status))
+        {
+            log_msg(LOG_ERROR, "Error decompressing: %s\n", ZSTD_getErrorName(status));
+            state->failed = state->ended = true;
+        }
+        else
+        {
+            state->in_member = status != 0; // 0 once a frame is decoded and flushed
+            if (!more && state->in_member && out.pos == before)
+            {
+                log_msg(LOG_ERROR, "Error decompressing: truncated zstd frame\n");
+                state->failed = state->ended = true;
+            }
+        }
+    }
+    return out.pos;
+}
+#endif
+
+/**
+ * @brief Decompresses the blocks of the submitted batches until told to stop
+ */
+static void *worker(void *arg)
+{
+    compressed_state *state = arg;
+    pthread_mutex_lock(&state->lock);
+    for (;;)
+    {
+        batch *b = state->pending >= 0 ? &state->batches[state->pending] : NULL;
+        if (state->stop)
+        {
+            break;
+        }
+        if (b == NULL || b->next >= b->count)
+        {
+            pthread_cond_wait(&state->work, &state->lock);
+            continue;
+        }
+
+        block *job = &b->blocks[b->next++];
+        pthread_mutex_unlock(&state->lock);
+        state->blocked->decode(job);
+        pthread_mutex_lock(&state->lock);
+
+        if (++b->done == b->count)
+        {
+            pthread_cond_broadcast(&state->finished);
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+/**
+ * @brief Reads the next compressed blocks into the batch and hands it to the workers
+ *
+ * @return false when there was nothing left to read
+ */
+static bool submit(compressed_state *state, int index)
+{
+    batch *b = &state->batches[index];
+    int capacity = state->thread_count * BLOCKS_PER_THREAD;
+
+    b->count = 0;
+    while (b->count < capacity && !state->failed && state->blocked->next(state, &b->blocks[b->count]))
+    {
+        b->count++;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    b->next = b->done = 0;
+    state->pending = b->count ? index : -1;
+    pthread_cond_broadcast(&state->work);
+    pthread_mutex_unlock(&state->lock);
+    return b->count > 0;
+}
+
+/**
+ * @brief Serves the decompressed batches in order, starting the next batch as soon as one is taken over
+ */
+static size_t blocked_read(compressed_state *state, byte_t *data, size_t length)
+{
+    size_t copied = 0;
+    while (copied < length)
+    {
+        batch *current = state->serving >= 0 ? &state->batches[state->serving] : NULL;
+        if (current && state->served_block < current->count)
+        {
+            block *b = &current->blocks[state->served_block];
+            size_t n = b->out_len - state->served_offset;
+            if (n > length - copied)
+            {
+                n = length - copied;
+            }
+            memcpy(data + copied, b->out + state->served_offset, n);
+            copied += n;
+            state->served_offset += n;
+            if (state->served_offset == b->out_len)
+            {
+                state->served_block++;
+                state->served_offset = 0;
+            }
+            continue;
+        }
+
+        // The served batch is used up, takes over the decompressed one
+        if (state->pending < 0)
+        {
+            break;
+        }
+        int ready = state->pending;
+        batch *next = &state->batches[ready];
+        pthread_mutex_lock(&state->lock);
+        while (next->done < next->count)
+        {
+            pthread_cond_wait(&state->finished, &state->lock);
+        }
+        pthread_mutex_unlock(&state->lock);
+
+        for (int i = 0; i < next->count; i++)
+        {
+            if (!next->blocks[i].ok)
+            {
+                log_msg(LOG_ERROR, "Error decompressing: corrupt block\n");
+                next->count = i; // Serves what came before the corrupt block
+                state->failed = true;
+                break;
+            }
+        }
+
+        state->serving = ready;
+        state->served_block = 0;
+        state->served_offset = 0;
+        if (state->failed)
+        {
+            state->pending = -1;
+        }
+        else
+        {
+            submit(state, 1 - ready);
+        }
+    }
+    return copied;
+}
+
+static size_t compressed_read(source *src, byte_t *data, size_t length)
+{
+    compressed_state *state = src->state;
+    size_t n = 0;
+    if (state->blocked)
+    {
+        n = blocked_read(state, data, length);
+    }
+#ifdef HAVE_ZLIB
+    else if (state->format == FORMAT_GZIP)
+    {
+        n = gzip_stream_read(state, data, length);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    else if (state->format == FORMAT_ZSTD)
+    {
+        n = zstd_stream_read(state, data, length);
+    }
+#endif
+    src->failed = state->failed;
+    return n;
+}
+
+static void compressed_close(source *src)
+{
+    compressed_state *state = src->state;
+    if (state->blocked)
+    {
+        pthread_mutex_lock(&state->lock);
+        state->stop = true;
+        pthread_cond_broadcast(&state->work);
+        pthread_mutex_unlock(&state->lock);
+        for (int i = 0; i < state->thread_count; i++)
+        {
+            pthread_join(state->threads[i], NULL);
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            for (int j = 0; j < state->thread_count * BLOCKS_PER_THREAD; j++)
+            {
+                free(state->batches[i].blocks[j].in);
+                free(state->batches[i].blocks[j].out);
+            }
+            free(state->batches[i].blocks);
+        }
+        free(state->threads);
+        pthread_mutex_destroy(&state->lock);
+        pthread_cond_destroy(&state->work);
+        pthread_cond_destroy(&state->finished);
+    }
+#ifdef HAVE_ZLIB
+    if (state->format == FORMAT_GZIP && !state->blocked)
+    {
+        inflateEnd(&state->z);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (state->zstd)
+    {
+        ZSTD_freeDStream(state->zstd);
+    }
+#endif
+    fclose(state->file);
+    free(state->in);
+    free(state);
+}
+
+/**
+ * @brief Starts the worker pool and the first batch of a blocked input
+ */
+static void start_blocked(compressed_state *state, const block_format *format, int threads)
+{
+    state->blocked = format;
+    state->thread_count = threads;
+    state->serving = -1;
+    state->pending = -1;
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->work, NULL);
+    pthread_cond_init(&state->finished, NULL);
+    for (int i = 0; i < 2; i++)
+    {
+        state->batches[i].blocks = calloc(threads * BLOCKS_PER_THREAD, sizeof(block));
+        CHECK_OR_EXIT(state->batches[i].blocks);
+    }
+
+    state->threads = calloc(threads, sizeof(pthread_t));
+    CHECK_OR_EXIT(state->threads);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_create(&state->threads[i], NULL, worker, state);
+    }
+    submit(state, 0);
+}
+
+/**
+ * @brief Opens a gzip or zstd compressed image. Blocked inputs (BGZF, multi-frame zstd) are decompressed
+ *        block by block on `threads` workers ahead of the scan, everything else is streamed.
+ *
+ * @param file The opened file, owned by the source from now on
+ * @param format FORMAT_GZIP or FORMAT_ZSTD
+ * @param threads The number of decompression threads for blocked inputs
+ * @return The source, or NULL if the format is not compiled in
+ */
+source *source_open_compressed(FILE *file, int format, int threads)
+{
+    compressed_state *state = calloc(1, sizeof(compressed_state));
+    CHECK_OR_EXIT(state);
+    state->file = file;
+    state->format = format;
+    reserve(&state->in, &state->in_cap, COMPRESSED_CHUNK);
+
+    switch (format)
+    {
+    case FORMAT_GZIP:
+#ifdef HAVE_ZLIB
+        if (is_bgzf(file))
+        {
+            start_blocked(state, &bgzf_format, threads);
+        }
+        else if (inflateInit2(&state->z, 16 + MAX_WBITS) != Z_OK)
+        {
+            log_msg(LOG_ERROR, "Error initializing the gzip decompressor\n");
+            fclose(file);
+            free(state->in);
+            free(state);
+            return NULL;
+        }
+        break;
+#else
+        log_msg(LOG_ERROR, "gzip support was not compiled in\n");
+        fclose(file);
+        free(state->in);
+        free(state);
+        return NULL;
+#endif
+    case FORMAT_ZSTD:
+#ifdef HAVE_ZSTD
+        if (is_multi_frame(state))
+        {
+            start_blocked(state, &zstd_format, threads);
+        }
+        else
+        {
+            state->zstd = ZSTD_createDStream();
+            ZSTD_initDStream(state->zstd);
+        }
+        break;
+#else
+        log_msg(LOG_ERROR, "zstd support was not compiled in\n");
+        fclose(file);
+        free(state->in);
+        free(state);
+        return NULL;
+#endif
+    }
+
+    source *src = calloc(1, sizeof(source));
+    CHECK_OR_EXIT(src);
+    src->size = 0; // Only known once everything is decompressed
+    src->read = compressed_read;
+    src->seek = NULL;
+    src->close = compressed_close;
+    src->state = state;
+    return src;
+}
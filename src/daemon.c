@@ -0,0 +1,383 @@
+#include "scan.h"
+#include "log.h"
+#include "manifest.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The longest request line and the most arguments in it
+#define REQUEST_MAX (4 * FILENAME_MAX)
+#define REQUEST_ARGS 64
+
+// A client connected to the daemon, its requests are scanned one after the other on its own thread
+typedef struct daemon_client
+{
+    int fd;                      // The connection
+    FILE *in;                    // Its requests
+    FILE *out;                   // Its events
+    pthread_t thread;            // Serves the requests
+    bool finished;               // Whether the client went away and its connection was closed, guarded by clients_lock
+    struct daemon_client *next;  // The client connected before it
+} daemon_client;
+
+// A request being scanned, the context of its progress events
+typedef struct daemon_job
+{
+    int id;    // The job number
+    FILE *out; // The events of its client
+} daemon_job;
+
+// The output directory of a running job, two jobs writing to the same one would overwrite each other's files
+typedef struct daemon_output
+{
+    char *path;                 // The directory, resolved
+    int job;                    // The job writing to it
+    struct daemon_output *next; // The directory claimed before it
+} daemon_output;
+
+static volatile sig_atomic_t stopping = 0;                      // Set by SIGINT or SIGTERM
+static atomic_int next_job = 1;                                 // The number of the next job, unique for the daemon
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER; // getopt keeps its state in globals
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER; // Guards closing the connections
+static daemon_output *outputs = NULL;                           // The directories of the running jobs
+static pthread_mutex_t outputs_lock = PTHREAD_MUTEX_INITIALIZER; // Guards outputs
+
+static void stop(int signal)
+{
+    (void)signal;
+    stopping = 1;
+}
+
+/**
+ * @brief Splits a request line into its arguments at whitespace, a quoted argument may hold whitespace
+ *
+ * @return The number of arguments, argv[0] is the program name
+ */
+static int split_request(char *line, char *argv[REQUEST_ARGS])
+{
+    int argc = 0;
+    argv[argc++] = "recover";
+    char *in = line;
+    while (argc < REQUEST_ARGS - 1)
+    {
+        while (*in && iswspace(*in))
+        {
+            in++;
+        }
+        if (!*in)
+        {
+            break;
+        }
+        char *out = in;
+        argv[argc++] = out;
+        bool quoted = false;
+        for (; *in && (quoted || !iswspace(*in)); in++)
+        {
+            if (*in == '"')
+                quoted = !quoted;
+            else
+                *out++ = *in;
+        }
+        if (*in)
+        {
+            in++;
+        }
+        *out = '\0';
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+/**
+ * @brief Sends an error event to a client, the message is JSON escaped
+ */
+static void send_error(daemon_client *client, const char *format, ...)
+{
+    char message[2 * FILENAME_MAX], escaped[8 * FILENAME_MAX];
+    va_list values;
+    va_start(values, format);
+    vsnprintf(message, sizeof(message), format, values);
+    va_end(values);
+    json_string(escaped, sizeof(escaped), message);
+    fprintf(client->out, "{\"event\":\"error\",\"message\":%s}\n", escaped);
+    fflush(client->out);
+}
+
+/**
+ * @brief Claims the output directory of a job, it is created so that the paths naming the same directory resolve
+ *        to the same one. The current directory is the output of a request without --output.
+ *
+ * @param claim Receives the claim, released with release_output
+ * @param owner Receives the job using the directory when it is already claimed
+ * @return true if no running job writes to the directory
+ */
+static bool claim_output(char *directory, int job, daemon_output *claim, int *owner)
+{
+    *owner = 0;
+    claim->path = NULL;
+    if ((directory[0] && !make_directory(directory)) || (claim->path = realpath(directory[0] ? directory : ".", NULL)) == NULL)
+    {
+        return false;
+    }
+    claim->job = job;
+    pthread_mutex_lock(&outputs_lock);
+    for (daemon_output *other = outputs; other && !*owner; other = other->next)
+    {
+        *owner = strcmp(other->path, claim->path) == 0 ? other->job : 0;
+    }
+    if (!*owner)
+    {
+        claim->next = outputs;
+        outputs = claim;
+    }
+    pthread_mutex_unlock(&outputs_lock);
+    if (*owner)
+    {
+        free(claim->path);
+        claim->path = NULL;
+    }
+    return !*owner;
+}
+
+/**
+ * @brief Releases the output directory of a finished job
+ */
+static void release_output(daemon_output *claim)
+{
+    pthread_mutex_lock(&outputs_lock);
+    for (daemon_output **link = &outputs; *link; link = &(*link)->next)
+    {
+        if (*link == claim)
+        {
+            *link = claim->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&outputs_lock);
+    free(claim->path);
+}
+
+/**
+ * @brief Sends the progress of a job to its client
+ */
+static void report_progress(scan_job *job, uint64_t bytes_read, uint64_t total, int files)
+{
+    daemon_job *request = job->context;
+    fprintf(request->out, "{\"event\":\"progress\",\"job\":%d,\"bytes\":%" PRIu64 ",\"total\":%" PRIu64 ",\"files\":%d}\n",
+            request->id, bytes_read, total, files);
+    fflush(request->out);
+}
+
+/**
+ * @brief Scans one request of a client. The request holds the options of a scan as on the command line, e.g.
+ *        `--file usb.dmp --offset 1048576 --length 65536 --output job1 --manifest manifest.jsonl`. The writers,
+ *        validators, known hash set, read limits and log level are those of the daemon. A request whose output
+ *        directory is written by a running job is refused, the carves, checkpoint and manifest of the two would mix.
+ */
+static void serve_request(daemon_client *client, char *line)
+{
+    char *argv[REQUEST_ARGS];
+    int argc = split_request(line, argv);
+    if (argc == 1)
+    {
+        return; // An empty line
+    }
+
+    cl_args args;
+    pthread_mutex_lock(&parse_lock);
+    opterr = 0; // The client is told, not the stderr of the daemon
+    bool parsed = parse_cl_args(&args, argc, argv);
+    opterr = 1;
+    pthread_mutex_unlock(&parse_lock);
+    if (!parsed)
+    {
+        if (args.rejected)
+            send_error(client, "Incorrect argument '%s'", args.rejected);
+        else
+            send_error(client, "Incorrect arguments, a request needs --file or --drive and options that go together");
+        return;
+    }
+    if (args.daemon[0] || args.batch[0] || args.partitions || args.incremental || args.extract)
+    {
+        send_error(client, "--daemon, --batch, --partitions, --incremental and extract are not supported in a request");
+        return;
+    }
+
+    int id = atomic_fetch_add(&next_job, 1);
+    daemon_output output;
+    int owner;
+    if (!claim_output(args.output, id, &output, &owner))
+    {
+        if (owner)
+            send_error(client, "The output directory '%s' is in use by job %d", args.output[0] ? args.output : ".", owner);
+        else
+            send_error(client, "Error creating the directory '%s'", args.output);
+        return;
+    }
+
+    daemon_job request = {id, client->out};
+    scan_job job = {.alignment = args.align < 0 ? 1 : args.align, .offset = args.offset, .length = args.length,
+                    .progress = report_progress, .context = &request};
+    snprintf(job.name, sizeof(job.name), "Job %d", id);
+    strcpy(job.directory, args.output);
+    fprintf(client->out, "{\"event\":\"accepted\",\"job\":%d}\n", id);
+    fflush(client->out);
+    log_msg(LOG_INFO, "Job %d: scanning '%s'\n", id, args.mode == MODE_DRIVE ? args.drivename : args.filename);
+
+    manifest_events(client->out, id); // Every carve is sent as it is finished
+    int status = scan_run(&args, &job);
+    manifest_events(NULL, 0);
+    release_output(&output);
+
+    fprintf(client->out, "{\"event\":\"done\",\"job\":%d,\"status\":\"%s\",\"bytes\":%" PRIu64 ",\"files\":%d}\n",
+            id, status == EXIT_SUCCESS ? "ok" : "failed", job.bytes_read, job.files);
+    fflush(client->out);
+    log_msg(LOG_INFO, "Job %d: %" PRIu64 " bytes scanned, %d files%s\n", id, job.bytes_read, job.files,
+            status == EXIT_SUCCESS ? "" : ", failed");
+}
+
+/**
+ * @brief Serves the requests of a client until it disconnects
+ */
+static void *client_thread(void *arg)
+{
+    daemon_client *client = arg;
+    char line[REQUEST_MAX];
+    while (fgets(line, sizeof(line), client->in))
+    {
+        serve_request(client, line);
+    }
+
+    // Closed right away, the client waits for the end of the events
+    pthread_mutex_lock(&clients_lock);
+    fclose(client->in);
+    fclose(client->out);
+    client->finished = true;
+    pthread_mutex_unlock(&clients_lock);
+    return NULL;
+}
+
+/**
+ * @brief Joins the threads of the clients that went away, all of them with `all`
+ */
+static void reap_clients(daemon_client **clients, bool all)
+{
+    for (daemon_client **link = clients; *link;)
+    {
+        daemon_client *client = *link;
+        pthread_mutex_lock(&clients_lock);
+        bool finished = client->finished;
+        pthread_mutex_unlock(&clients_lock);
+        if (!all && !finished)
+        {
+            link = &client->next;
+            continue;
+        }
+        pthread_join(client->thread, NULL);
+        *link = client->next;
+        free(client);
+    }
+}
+
+/**
+ * @brief Serves scan requests on a Unix socket until SIGINT or SIGTERM. Every client sends one request per line,
+ *        written like a command line, and gets JSON lines back: `accepted` with the job number, `progress` about
+ *        once a second, `carve` for every carve with the fields of the manifest, and `done`, or `error` for a request
+ *        that could not be parsed. The requests of a client are scanned in order, those of different clients at once.
+ *        The writer and validation threads, the known hash set and the read limits are set up once for all of them.
+ *
+ * @param args The command line args, `daemon` is the socket
+ * @return EXIT_SUCCESS once stopped
+ */
+int daemon_run(cl_args *args)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(args->daemon) >= sizeof(address.sun_path))
+    {
+        log_msg(LOG_ERROR, "The socket path '%s' is too long\n", args->daemon);
+        return EXIT_FAILURE;
+    }
+    strcpy(address.sun_path, args->daemon);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(args->daemon); // The socket of a daemon that was not stopped cleanly
+    if (server < 0 || bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, 16) != 0)
+    {
+        log_msg(LOG_ERROR, "Error listening on '%s'\n", args->daemon);
+        if (server >= 0)
+            close(server);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN); // A client that went away fails the write instead of killing the daemon
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    log_msg(LOG_INFO, "Serving scan requests on '%s'\n", args->daemon);
+    daemon_client *clients = NULL;
+    while (!stopping)
+    {
+        // Wakes up now and then to see whether it was stopped, the signal may go to another thread
+        struct pollfd waiting = {.fd = server, .events = POLLIN};
+        if (poll(&waiting, 1, 250) <= 0)
+        {
+            continue;
+        }
+        int fd = accept(server, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        daemon_client *client = calloc(1, sizeof(daemon_client));
+        CHECK_OR_EXIT(client);
+        client->fd = fd;
+        client->in = fdopen(fd, "r");
+        client->out = fdopen(dup(fd), "w");
+        if (client->in == NULL || client->out == NULL || pthread_create(&client->thread, NULL, client_thread, client) != 0)
+        {
+            log_msg(LOG_ERROR, "Error serving a client\n");
+            if (client->in)
+                fclose(client->in);
+            else
+                close(fd);
+            if (client->out)
+                fclose(client->out);
+            free(client);
+            continue;
+        }
+        client->next = clients;
+        clients = client;
+        reap_clients(&clients, false);
+    }
+
+    // No more requests are read, the scans running are finished
+    close(server);
+    unlink(args->daemon);
+    pthread_mutex_lock(&clients_lock);
+    for (daemon_client *client = clients; client; client = client->next)
+    {
+        if (!client->finished)
+        {
+            shutdown(client->fd, SHUT_RD);
+        }
+    }
+    pthread_mutex_unlock(&clients_lock);
+    reap_clients(&clients, true);
+    log_msg(LOG_INFO, "Stopped serving scan requests\n");
+    return EXIT_SUCCESS;
+}
+#else
+int daemon_run(cl_args *args)
+{
+    (void)args;
+    log_msg(LOG_ERROR, "Daemon mode needs Unix sockets, it is not supported on Windows\n");
+    return EXIT_FAILURE;
+}
+#endif
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE // For O_DIRECT
+#include "source.h"
+#include "log.h"
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+// The bounce buffer of the reads that are not block aligned, e.g. filesystem metadata or a buffer size that is no multiple of the block
+#define DIRECT_CHUNK (1024 * 1024)
+
+// State of the direct I/O backend
+typedef struct direct_state
+{
+    int fd;               // The file or block device, opened with O_DIRECT
+    size_t block;         // Its logical block size, every offset, length and address of a read is a multiple of it
+    byte_t *bounce;       // An aligned buffer of DIRECT_CHUNK bytes for the unaligned reads
+    const char *filename; // The path, for reopening without O_DIRECT
+} direct_state;
+
+/**
+ * @brief Returns the logical block size O_DIRECT reads must be aligned to
+ */
+static size_t logical_block_size(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        return 4096;
+    }
+#ifdef BLKSSZGET
+    int size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &size) == 0 && size >= 512)
+    {
+        return (size_t)size;
+    }
+#endif
+    // A regular file follows the device under its filesystem, the preferred I/O size is a safe multiple of that
+    return st.st_blksize >= 512 ? (size_t)st.st_blksize : 4096;
+}
+
+/**
+ * @brief Gives up on O_DIRECT for the rest of the scan when the kernel refused the aligned reads
+ */
+static bool fall_back(direct_state *state)
+{
+    int fd = open(state->filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    log_msg(LOG_ERROR, "Direct reads are not supported for '%s', reading through the page cache\n", state->filename);
+    close(state->fd);
+    state->fd = fd;
+    state->block = 1;
+    return true;
+}
+
+static size_t direct_read(source *src, byte_t *data, size_t length)
+{
+    direct_state *state = src->state;
+    uint64_t offset = src->position;
+    size_t copied = 0;
+
+    while (copied < length)
+    {
+        ssize_t n;
+        size_t wanted = length - copied;
+        if (offset % state->block == 0 && (uintptr_t)(data + copied) % state->block == 0 && wanted >= state->block)
+        {
+            // Straight into the caller's buffer, no copy at all
+            wanted -= wanted % state->block;
+            n = pread(state->fd, data + copied, wanted, (off_t)offset);
+        }
+        else
+        {
+            // Through the bounce buffer, reading the aligned blocks around the wanted bytes
+            uint64_t start = offset - offset % state->block;
+            size_t skip = (size_t)(offset - start);
+            size_t span = skip + wanted < DIRECT_CHUNK ? skip + wanted : DIRECT_CHUNK;
+            span = (span + state->block - 1) / state->block * state->block;
+            n = pread(state->fd, state->bounce, span, (off_t)start);
+            if (n > 0)
+            {
+                n = (size_t)n > skip ? n - (ssize_t)skip : 0;
+                n = (size_t)n < wanted ? n : (ssize_t)wanted;
+                memcpy(data + copied, state->bounce + skip, n);
+            }
+        }
+
+        if (n < 0 && errno == EINVAL && state->block > 1 && fall_back(state))
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break; // The end of the input, or a bad sector the rescue backend reads around
+        }
+        copied += n;
+        offset += n;
+    }
+    return copied;
+}
+
+static bool direct_seek(source *src, uint64_t offset)
+{
+    (void)src; // Every read is positioned, source_seek keeps the offset
+    (void)offset;
+    return true;
+}
+
+static void direct_close(source *src)
+{
+    direct_state *state = src->state;
+    close(state->fd);
+    buffer_free(state->bounce, DIRECT_CHUNK);
+    free(state);
+}
+
+/**
+ * @brief Opens an image file or block device for reads that bypass the page cache, so a scan of a huge device
+ *        does not evict everything else cached on the machine. Reads are done straight into the caller's buffer
+ *        when it, the offset and the length are aligned to the logical block size, otherwise through a bounce buffer.
+ *
+ * @param filename The image or device
+ * @return The source, or NULL if it cannot be opened with O_DIRECT
+ */
+source *source_open_direct(const char *filename)
+{
+#ifdef O_DIRECT
+    int fd = open(filename, O_RDONLY | O_DIRECT);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    direct_state *state = calloc(1, sizeof(direct_state));
+    source *src = calloc(1, sizeof(source));
+    CHECK_OR_EXIT(state);
+    CHECK_OR_EXIT(src);
+    state->fd = fd;
+    state->block = logical_block_size(fd);
+    state->bounce = buffer_alloc(DIRECT_CHUNK);
+    state->filename = filename;
+
+    struct stat st = {0};
+    uint64_t size = 0;
+    if (fstat(fd, &st) == 0)
+    {
+        size = (uint64_t)st.st_size;
+    }
+#ifdef BLKGETSIZE64
+    if (S_ISBLK(st.st_mode))
+    {
+        ioctl(fd, BLKGETSIZE64, &size);
+    }
+#endif
+
+    src->size = size;
+    src->read = direct_read;
+    src->seek = direct_seek;
+    src->close = direct_close;
+    src->state = state;
+    log_msg(LOG_INFO, "Reading '%s' with direct I/O in %zu byte blocks\n", filename, state->block);
+    return src;
+#else
+    (void)filename;
+    return NULL;
+#endif
+}
+#endif
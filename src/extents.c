@@ -0,0 +1,150 @@
+#include "source.h"
+
+// State of the extents backend, a source made of pieces of another source
+typedef struct extents_state
+{
+    source *inner;    // The source the extents are read from
+    extent *extents;  // The extents in order
+    uint64_t *starts; // The logical offset of each extent
+    size_t count;     // Their number
+    size_t current;   // The extent being read
+} extents_state;
+
+/**
+ * @brief Appends a run of bytes to the list, merging it into the last extent when they touch
+ */
+void extent_add(extent_list *list, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    if (list->count && list->items[list->count - 1].offset + list->items[list->count - 1].length == offset)
+    {
+        list->items[list->count - 1].length += length;
+        return;
+    }
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->items = realloc(list->items, list->capacity * sizeof(extent));
+        CHECK_OR_EXIT(list->items);
+    }
+    list->items[list->count++] = (extent){offset, length};
+}
+
+static size_t extents_read(source *src, byte_t *data, size_t length)
+{
+    extents_state *state = src->state;
+    size_t copied = 0;
+
+    while (copied < length && state->current < state->count)
+    {
+        extent *current = &state->extents[state->current];
+        uint64_t position = src->position + copied - state->starts[state->current]; // The offset in the current extent
+        uint64_t left = current->length - position;
+
+        // The bytes between two extents are skipped, a carve in progress carries on in the next extent
+        if (state->inner->position != current->offset + position && !source_seek(state->inner, current->offset + position))
+        {
+            break;
+        }
+        size_t wanted = length - copied < left ? length - copied : (size_t)left;
+        size_t n = source_read(state->inner, data + copied, wanted);
+        copied += n;
+        if (n < wanted)
+        {
+            break;
+        }
+        if (position + n == current->length)
+        {
+            state->current++;
+        }
+    }
+    src->failed = state->inner->failed;
+    return copied;
+}
+
+/**
+ * @brief Binary search for the extent holding a logical offset below the size
+ */
+static size_t find_extent(extents_state *state, uint64_t offset)
+{
+    size_t low = 0, high = state->count - 1;
+    while (low < high)
+    {
+        size_t middle = (low + high + 1) / 2;
+        if (state->starts[middle] <= offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+static bool extents_seek(source *src, uint64_t offset)
+{
+    extents_state *state = src->state;
+    if (offset >= src->size)
+    {
+        state->current = state->count;
+        return offset == src->size;
+    }
+    state->current = find_extent(state, offset);
+    return source_seek(state->inner, state->extents[state->current].offset + offset - state->starts[state->current]);
+}
+
+static uint64_t extents_origin(source *src, uint64_t offset)
+{
+    extents_state *state = src->state;
+    if (state->count == 0)
+    {
+        return source_origin(state->inner, offset);
+    }
+    size_t i = find_extent(state, offset < src->size ? offset : src->size - 1);
+    return source_origin(state->inner, state->extents[i].offset + offset - state->starts[i]);
+}
+
+static void extents_close(source *src)
+{
+    extents_state *state = src->state;
+    source_close(state->inner);
+    free(state->extents);
+    free(state->starts);
+    free(state);
+}
+
+/**
+ * @brief Reads only the given extents of a source, one after the other as one stream
+ *
+ * @param inner The source, owned by the extents source from now on
+ * @param extents The extents in ascending order, their items are owned by the source from now on
+ */
+source *source_open_extents(source *inner, extent_list *extents)
+{
+    extents_state *state = calloc(1, sizeof(extents_state));
+    source *src = calloc(1, sizeof(source));
+    CHECK_OR_EXIT(state);
+    CHECK_OR_EXIT(src);
+    state->inner = inner;
+    state->extents = extents->items;
+    state->count = extents->count;
+    state->starts = malloc((extents->count + 1) * sizeof(uint64_t));
+    CHECK_OR_EXIT(state->starts);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < extents->count; i++)
+    {
+        state->starts[i] = total;
+        total += extents->items[i].length;
+    }
+
+    src->size = total;
+    src->read = extents_read;
+    src->seek = extents_seek;
+    src->origin = extents_origin;
+    src->close = extents_close;
+    src->state = state;
+    extents_seek(src, 0);
+    return src;
+}
@@ -0,0 +1,195 @@
+#include "scan.h"
+#include "carve.h"
+#include "log.h"
+#include "manifest.h"
+#include "source.h"
+#include <inttypes.h>
+
+static int compare_offsets(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Reads the offsets of --offsets, one per line in decimal or 0x hex (blank lines and lines starting with #
+ *        are skipped). They are sorted and their repeats dropped, so the input is read front to back.
+ *
+ * @param offsets Receives the offsets
+ * @return Their number, -1 if the list could not be read
+ */
+static int read_offsets(const char *path, uint64_t **offsets)
+{
+    FILE *list = fopen(path, "r");
+    if (list == NULL)
+    {
+        log_msg(LOG_ERROR, "Error reading the offsets '%s'\n", path);
+        return -1;
+    }
+    int count = 0, capacity = 0;
+    *offsets = NULL;
+    char line[256];
+    while (fgets(line, sizeof(line), list))
+    {
+        strip(line);
+        if (!line[0] || line[0] == '#')
+        {
+            continue;
+        }
+        char *end;
+        uint64_t offset = strtoull(line, &end, 0);
+        if (end == line)
+        {
+            log_msg(LOG_ERROR, "Skipping '%s', it is not an offset\n", line);
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 64;
+            *offsets = realloc(*offsets, capacity * sizeof(uint64_t));
+            CHECK_OR_EXIT(*offsets);
+        }
+        (*offsets)[count++] = offset;
+    }
+    fclose(list);
+
+    if (count)
+    {
+        qsort(*offsets, count, sizeof(uint64_t), compare_offsets);
+    }
+    int unique = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (unique == 0 || (*offsets)[i] != (*offsets)[unique - 1])
+        {
+            (*offsets)[unique++] = (*offsets)[i];
+        }
+    }
+    return unique;
+}
+
+/**
+ * @brief The type of the header at an offset of the input, -1 if there is none
+ */
+static int header_type(source *src, uint64_t offset)
+{
+    byte_t bytes[SIGNATURE_MAX + BUFFER_PADDING] = {0};
+    if (offset >= src->size || !source_seek(src, offset))
+    {
+        return -1;
+    }
+    source_read(src, bytes, SIGNATURE_MAX);
+    for (int type = 0; type < FILE_TYPES_COUNT; type++)
+    {
+        if (is_header_funcs[type](bytes, 0))
+        {
+            return type;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Carves the file whose header is at an offset. The scan starts right there and starts no other carve, so it
+ *        ends as soon as that one does: on its trailer, on the header of the next file, or at --length bytes.
+ *
+ * @param type The type expected there, -1 for any
+ * @param rows Receives its row
+ * @return true if it was carved
+ */
+static bool extract_at(cl_args *args, source *src, uint64_t offset, int type, manifest_rows *rows)
+{
+    int found = header_type(src, offset);
+    if (found < 0 || (type >= 0 && found != type))
+    {
+        log_msg(LOG_ERROR, "There is no %s header at offset %" PRIu64 "\n", type >= 0 ? file_exts[type] : "jpeg, png or gif",
+                offset);
+        return false;
+    }
+
+    scan_job job = {.alignment = 1, .offset = offset, .length = args->length, .header_end = 1, .rows = rows};
+    snprintf(job.name, sizeof(job.name), "Offset %" PRIu64, offset);
+    strcpy(job.directory, args->output);
+    size_t count = rows->count;
+    scan_run(args, &job);
+    return job.status == EXIT_SUCCESS && rows->count > count;
+}
+
+/**
+ * @brief Extracts the files at the offsets of --offset or --offsets without scanning the rest of the input, each one
+ *        named after its offset in the --output directory. The time it takes depends on the files, not on the size
+ *        of the input.
+ *
+ * @param args The command line args
+ * @return EXIT_SUCCESS if a file was carved at every offset
+ */
+int extract_run(cl_args *args)
+{
+    int type = -1;
+    for (int t = 0; t < FILE_TYPES_COUNT && args->extract_type[0]; t++)
+    {
+        type = strcmp(args->extract_type, file_exts[t]) == 0 ? t : type;
+    }
+    if (args->extract_type[0] && type < 0)
+    {
+        log_msg(LOG_ERROR, "Unknown file type '%s', it is one of jpeg, png or gif\n", args->extract_type);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t *offsets = &args->offset;
+    int count = args->offsets[0] ? read_offsets(args->offsets, &offsets) : 1;
+    if (count < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    source *src = source_open(args, 0, 0);
+    if (src == NULL || src->seek == NULL)
+    {
+        log_msg(LOG_ERROR, "Extracting needs a seekable input\n");
+        if (src)
+            source_close(src);
+        if (offsets != &args->offset)
+            free(offsets);
+        return EXIT_FAILURE;
+    }
+    if (args->output[0] && !make_directory(args->output))
+    {
+        log_msg(LOG_ERROR, "Error creating the directory '%s'\n", args->output);
+        source_close(src);
+        if (offsets != &args->offset)
+            free(offsets);
+        return EXIT_FAILURE;
+    }
+
+    // Each file is named after its offset, a counter would start over for every one
+    args->offset_names = true;
+    manifest_rows rows = {0};
+    int carved = 0;
+    for (int i = 0; i < count; i++)
+    {
+        carved += extract_at(args, src, offsets[i], type, &rows);
+    }
+    source_close(src);
+    if (offsets != &args->offset)
+        free(offsets);
+
+    scan_job job = {0};
+    strcpy(job.directory, args->output);
+    char manifest_path[FILENAME_MAX];
+    bool manifest = args->manifest[0] && job_path(&job, args->manifest, manifest_path) && manifest_open(manifest_path, 0);
+    if (args->manifest[0] && !manifest)
+    {
+        log_msg(LOG_ERROR, "Error creating the manifest '%s'\n", manifest_path);
+    }
+    for (size_t i = 0; i < rows.count; i++)
+    {
+        log_msg(LOG_INFO, "%s: %" PRIu64 " bytes from offset %" PRIu64 "\n", rows.rows[i].name, rows.rows[i].size,
+                rows.rows[i].start);
+        manifest_record(&rows.rows[i]);
+    }
+    manifest_close();
+    manifest_rows_free(&rows);
+
+    log_msg(LOG_INFO, "Extracted %d of %d files\n", carved, count);
+    return carved == count && (manifest || !args->manifest[0]) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,548 @@
+#include "source.h"
+#include "log.h"
+#include <inttypes.h>
+
+// The bytes of an allocation table or bitmap processed at once
+#define MAP_CHUNK ((uint64_t)1024 * 1024)
+
+// Where the allocation units of a volume are and which of them are free
+typedef struct volume_map
+{
+    uint64_t origin;   // The byte offset of unit 0
+    uint64_t unit;     // The bytes in a unit, i.e. a cluster or a block
+    uint64_t end;      // The end of the volume, no extent goes past it
+    extent_list *free; // The unallocated extents found so far
+} volume_map;
+
+static uint16_t le16(const byte_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t le32(const byte_t *p)
+{
+    return (uint32_t)le16(p) | (uint32_t)le16(p + 2) << 16;
+}
+
+static uint64_t le64(const byte_t *p)
+{
+    return (uint64_t)le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+/**
+ * @brief Reads `length` bytes at `offset` of the volume. Whole sectors are read, as drives only allow.
+ */
+static bool read_at(source *volume, uint64_t offset, void *data, size_t length)
+{
+    uint64_t start = offset / SECTOR_SIZE * SECTOR_SIZE;
+    size_t span = (size_t)((offset + length + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE - start);
+    byte_t *sectors = malloc(span);
+    CHECK_OR_EXIT(sectors);
+
+    bool ok = source_seek(volume, start) && source_read(volume, sectors, span) >= offset - start + length;
+    if (ok)
+    {
+        memcpy(data, sectors + (offset - start), length);
+    }
+    free(sectors);
+    return ok;
+}
+
+/**
+ * @brief Adds `count` free units starting at unit `first` to the map
+ */
+static void mark_free(volume_map *map, uint64_t first, uint64_t count)
+{
+    uint64_t offset = map->origin + first * map->unit;
+    uint64_t length = count * map->unit;
+    if (map->end && offset + length > map->end)
+    {
+        length = offset < map->end ? map->end - offset : 0;
+    }
+    extent_add(map->free, offset, length);
+}
+
+/**
+ * @brief Adds the runs of clear bits of an allocation bitmap to the map, a set bit is an allocated unit
+ *
+ * @param bits The bitmap, least significant bit first
+ * @param first The unit of the first bit
+ * @param count The number of bits
+ */
+static void map_bitmap(volume_map *map, const byte_t *bits, uint64_t first, uint64_t count)
+{
+    uint64_t run = 0; // The length of the current run of free units
+    for (uint64_t i = 0; i < count;)
+    {
+        byte_t byte = bits[i / 8];
+        if (i % 8 == 0 && count - i >= 8 && (byte == 0x00 || byte == 0xFF))
+        {
+            if (byte == 0x00)
+            {
+                run += 8;
+            }
+            else if (run)
+            {
+                mark_free(map, first + i - run, run);
+                run = 0;
+            }
+            i += 8;
+            continue;
+        }
+        if (byte >> (i % 8) & 1)
+        {
+            if (run)
+            {
+                mark_free(map, first + i - run, run);
+                run = 0;
+            }
+        }
+        else
+        {
+            run++;
+        }
+        i++;
+    }
+    if (run)
+    {
+        mark_free(map, first + count - run, run);
+    }
+}
+
+/**
+ * @brief Maps a FAT12/16/32 volume from its boot sector, a cluster is free when its FAT entry is 0
+ */
+static bool map_fat(source *volume, const byte_t *boot, volume_map *map)
+{
+    uint32_t bytes_per_sector = le16(boot + 11);
+    uint32_t sectors_per_cluster = boot[13];
+    uint32_t reserved = le16(boot + 14);
+    uint32_t fats = boot[16];
+    uint32_t root_entries = le16(boot + 17);
+    uint32_t total = le16(boot + 19) ? le16(boot + 19) : le32(boot + 32);
+    uint32_t fat_size = le16(boot + 22) ? le16(boot + 22) : le32(boot + 36);
+
+    if (bytes_per_sector < 512 || bytes_per_sector > 4096 || (bytes_per_sector & (bytes_per_sector - 1)) ||
+        sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+        reserved == 0 || fats == 0 || total == 0 || fat_size == 0)
+    {
+        return false;
+    }
+    uint32_t root_sectors = (root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+    uint64_t data_start = reserved + (uint64_t)fats * fat_size + root_sectors;
+    if (data_start >= total)
+    {
+        return false;
+    }
+    uint64_t clusters = (total - data_start) / sectors_per_cluster;
+    int bits = clusters < 4085 ? 12 : clusters < 65525 ? 16 : 32;
+
+    map->unit = (uint64_t)sectors_per_cluster * bytes_per_sector;
+    map->origin = data_start * bytes_per_sector - 2 * map->unit; // Cluster 2 is the first of the data area
+    map->end = (uint64_t)total * bytes_per_sector;
+    uint64_t fat = (uint64_t)reserved * bytes_per_sector;
+    if (map->free == NULL)
+    {
+        return true; // Only the geometry is wanted
+    }
+
+    // FAT12 entries straddle bytes, the whole table is small enough to read at once
+    uint64_t chunk_entries = bits == 12 ? clusters + 2 : MAP_CHUNK / (bits / 8);
+    byte_t *table = malloc(bits == 12 ? (size_t)((clusters + 2) * 3 / 2 + 2) : MAP_CHUNK);
+    CHECK_OR_EXIT(table);
+
+    uint64_t run = 0;
+    for (uint64_t base = 0; base < clusters + 2; base += chunk_entries)
+    {
+        uint64_t entries = clusters + 2 - base < chunk_entries ? clusters + 2 - base : chunk_entries;
+        size_t length = bits == 12 ? (size_t)((entries * 3 + 1) / 2) : (size_t)(entries * (bits / 8));
+        if (!read_at(volume, fat + base * (bits / 8), table, length))
+        {
+            free(table);
+            return false;
+        }
+        for (uint64_t i = 0; i < entries; i++)
+        {
+            uint64_t cluster = base + i;
+            uint32_t entry = bits == 12 ? (le16(table + i * 3 / 2) >> (i & 1 ? 4 : 0)) & 0xFFF
+                             : bits == 16 ? le16(table + i * 2)
+                                          : le32(table + i * 4) & 0x0FFFFFFF;
+            if (cluster >= 2 && entry == 0)
+            {
+                run++;
+            }
+            else if (run)
+            {
+                mark_free(map, cluster - run, run);
+                run = 0;
+            }
+        }
+    }
+    if (run)
+    {
+        mark_free(map, clusters + 2 - run, run);
+    }
+    free(table);
+    log_msg(LOG_INFO, "Found a FAT%d volume with %" PRIu64 " clusters of %" PRIu64 " bytes\n", bits, clusters, map->unit);
+    return true;
+}
+
+/**
+ * @brief Returns the FAT entry of an exFAT cluster, i.e. the next cluster of its chain
+ */
+static uint32_t exfat_next(source *volume, uint64_t fat, uint32_t cluster)
+{
+    byte_t entry[4];
+    return read_at(volume, fat + (uint64_t)cluster * 4, entry, 4) ? le32(entry) : 0xFFFFFFFF;
+}
+
+/**
+ * @brief Maps an exFAT volume from the allocation bitmap file listed in its root directory
+ */
+static bool map_exfat(source *volume, const byte_t *boot, volume_map *map)
+{
+    uint32_t sector_shift = boot[108], cluster_shift = boot[109];
+    if (sector_shift < 9 || sector_shift > 12 || sector_shift + cluster_shift > 25)
+    {
+        return false;
+    }
+    uint64_t fat = (uint64_t)le32(boot + 80) << sector_shift;
+    uint64_t heap = (uint64_t)le32(boot + 88) << sector_shift;
+    uint32_t clusters = le32(boot + 92);
+    uint32_t root = le32(boot + 96);
+
+    map->unit = 1ULL << (sector_shift + cluster_shift);
+    map->origin = heap - 2 * map->unit;
+    map->end = le64(boot + 72) << sector_shift;
+    if (map->free == NULL)
+    {
+        return true; // Only the geometry is wanted
+    }
+
+    // Looks for the allocation bitmap entry (type 0x81) in the root directory
+    byte_t *cluster = malloc(map->unit);
+    CHECK_OR_EXIT(cluster);
+    uint32_t bitmap_cluster = 0;
+    uint64_t bitmap_size = 0;
+    bool end = false;
+    for (uint32_t c = root, steps = 0; !end && !bitmap_cluster && c >= 2 && c < clusters + 2 && steps < clusters; c = exfat_next(volume, fat, c), steps++)
+    {
+        if (!read_at(volume, map->origin + c * map->unit, cluster, map->unit))
+        {
+            break;
+        }
+        for (uint64_t i = 0; i < map->unit; i += 32)
+        {
+            if (cluster[i] == 0x00)
+            {
+                end = true;
+                break;
+            }
+            if (cluster[i] == 0x81 && !(cluster[i + 1] & 1)) // The first bitmap, TexFAT keeps a second one
+            {
+                bitmap_cluster = le32(cluster + i + 20);
+                bitmap_size = le64(cluster + i + 24);
+                break;
+            }
+        }
+    }
+    free(cluster);
+    if (!bitmap_cluster || bitmap_size < (clusters + 7) / 8)
+    {
+        return false;
+    }
+
+    // Maps the bitmap one cluster of it at a time along its chain
+    byte_t *bits = malloc(map->unit);
+    CHECK_OR_EXIT(bits);
+    uint64_t mapped = 0; // The clusters covered so far
+    for (uint32_t c = bitmap_cluster; mapped < clusters && c >= 2 && c < clusters + 2; c = exfat_next(volume, fat, c))
+    {
+        if (!read_at(volume, map->origin + c * map->unit, bits, map->unit))
+        {
+            free(bits);
+            return false;
+        }
+        uint64_t count = clusters - mapped < map->unit * 8 ? clusters - mapped : map->unit * 8;
+        map_bitmap(map, bits, mapped + 2, count);
+        mapped += count;
+    }
+    free(bits);
+    log_msg(LOG_INFO, "Found an exFAT volume with %" PRIu32 " clusters of %" PRIu64 " bytes\n", clusters, map->unit);
+    return mapped == clusters;
+}
+
+/**
+ * @brief Maps an NTFS volume from the $Bitmap file, MFT record 6
+ */
+static bool map_ntfs(source *volume, const byte_t *boot, volume_map *map)
+{
+    uint32_t bytes_per_sector = le16(boot + 11);
+    uint32_t sectors_per_cluster = boot[13] > 0x80 ? 1U << (256 - boot[13]) : boot[13];
+    int8_t record_clusters = (int8_t)boot[64];
+    if (bytes_per_sector < 512 || bytes_per_sector > 4096 || sectors_per_cluster == 0)
+    {
+        return false;
+    }
+    map->unit = (uint64_t)bytes_per_sector * sectors_per_cluster;
+    map->origin = 0;
+    map->end = le64(boot + 40) * bytes_per_sector;
+    uint64_t clusters = le64(boot + 40) / sectors_per_cluster;
+    uint64_t mft = le64(boot + 48) * map->unit;
+    uint32_t record_size = record_clusters > 0 ? record_clusters * (uint32_t)map->unit : 1U << -record_clusters;
+    if (record_size < 512 || record_size > 65536)
+    {
+        return false;
+    }
+    if (map->free == NULL)
+    {
+        return true; // Only the geometry is wanted
+    }
+
+    // The first records of the MFT are always contiguous
+    byte_t *record = malloc(record_size);
+    CHECK_OR_EXIT(record);
+    if (!read_at(volume, mft + 6ULL * record_size, record, record_size) || memcmp(record, "FILE", 4) != 0)
+    {
+        free(record);
+        return false;
+    }
+
+    // Undoes the update sequence, the last two bytes of every 512 byte stride are kept in the array
+    uint16_t usa = le16(record + 4), usa_count = le16(record + 6);
+    for (uint32_t i = 1; i < usa_count && i * 512 <= record_size && usa + i * 2 + 2 <= record_size; i++)
+    {
+        memcpy(record + i * 512 - 2, record + usa + i * 2, 2);
+    }
+
+    // Finds the unnamed $DATA attribute and its runs
+    extent_list runs = {0};
+    byte_t *resident = NULL;
+    uint64_t data_size = 0;
+    for (uint32_t a = le16(record + 20); a + 16 <= record_size;)
+    {
+        uint32_t type = le32(record + a), length = le32(record + a + 4);
+        if (type == 0xFFFFFFFF || length == 0 || a + length > record_size)
+        {
+            break;
+        }
+        if (type == 0x80 && record[a + 9] == 0)
+        {
+            if (record[a + 8] == 0)
+            {
+                data_size = le32(record + a + 16);
+                resident = record + a + le16(record + a + 20);
+            }
+            else
+            {
+                data_size = le64(record + a + 48);
+                int64_t lcn = 0;
+                for (uint32_t r = a + le16(record + a + 32); r < a + length && record[r];)
+                {
+                    int length_size = record[r] & 0xF, offset_size = record[r] >> 4;
+                    if (length_size > 8 || offset_size > 8 || r + 1 + length_size + offset_size > a + length)
+                    {
+                        break;
+                    }
+                    uint64_t run_length = 0;
+                    int64_t run_offset = 0;
+                    for (int i = length_size - 1; i >= 0; i--)
+                    {
+                        run_length = run_length << 8 | record[r + 1 + i];
+                    }
+                    for (int i = offset_size - 1; i >= 0; i--)
+                    {
+                        run_offset = (int64_t)((uint64_t)run_offset << 8 | record[r + 1 + length_size + i]);
+                    }
+                    if (offset_size && record[r + length_size + offset_size] & 0x80) // Sign extension
+                    {
+                        run_offset -= (int64_t)1 << (offset_size * 8);
+                    }
+                    lcn += run_offset;
+                    extent_add(&runs, (uint64_t)lcn * map->unit, run_length * map->unit);
+                    r += 1 + length_size + offset_size;
+                }
+            }
+            break;
+        }
+        a += length;
+    }
+
+    uint64_t needed = (clusters + 7) / 8;
+    bool ok = data_size >= needed && (resident || runs.count);
+    if (ok && resident)
+    {
+        map_bitmap(map, resident, 0, clusters);
+    }
+    else if (ok)
+    {
+        // Maps the bitmap one chunk at a time along its runs
+        byte_t *bits = malloc(MAP_CHUNK);
+        CHECK_OR_EXIT(bits);
+        uint64_t mapped = 0; // The clusters covered so far
+        for (size_t i = 0; ok && i < runs.count && mapped < clusters; i++)
+        {
+            for (uint64_t done = 0; ok && done < runs.items[i].length && mapped < clusters;)
+            {
+                uint64_t left = runs.items[i].length - done;
+                size_t length = left < MAP_CHUNK ? (size_t)left : MAP_CHUNK;
+                ok = read_at(volume, runs.items[i].offset + done, bits, length);
+                uint64_t count = clusters - mapped < length * 8ULL ? clusters - mapped : length * 8ULL;
+                if (ok)
+                {
+                    map_bitmap(map, bits, mapped, count);
+                }
+                mapped += count;
+                done += length;
+            }
+        }
+        ok = ok && mapped == clusters;
+        free(bits);
+    }
+    free(runs.items);
+    free(record);
+    if (ok)
+    {
+        log_msg(LOG_INFO, "Found an NTFS volume with %" PRIu64 " clusters of %" PRIu64 " bytes\n", clusters, map->unit);
+    }
+    return ok;
+}
+
+/**
+ * @brief Maps an ext2/3/4 volume from the block bitmap of every block group
+ */
+static bool map_ext(source *volume, volume_map *map)
+{
+    byte_t super[1024];
+    if (!read_at(volume, 1024, super, sizeof(super)) || le16(super + 56) != 0xEF53 || le32(super + 24) > 6)
+    {
+        return false;
+    }
+    bool is_64bit = le32(super + 96) & 0x80;
+    uint64_t blocks = le32(super + 4) | (is_64bit ? (uint64_t)le32(super + 336) << 32 : 0);
+    uint32_t first_block = le32(super + 20);
+    uint32_t per_group = le32(super + 32);
+    uint32_t descriptor_size = is_64bit && le16(super + 254) >= 64 ? le16(super + 254) : 32;
+    if (per_group == 0 || blocks <= first_block)
+    {
+        return false;
+    }
+    map->unit = 1024ULL << le32(super + 24);
+    map->origin = 0;
+    map->end = blocks * map->unit;
+    if (map->free == NULL)
+    {
+        return true; // Only the geometry is wanted
+    }
+
+    uint64_t groups = (blocks - first_block + per_group - 1) / per_group;
+    size_t table_size = (size_t)(groups * descriptor_size);
+    byte_t *table = malloc(table_size);
+    byte_t *bits = malloc(map->unit);
+    CHECK_OR_EXIT(table);
+    CHECK_OR_EXIT(bits);
+    bool ok = read_at(volume, (first_block + 1) * map->unit, table, table_size);
+
+    for (uint64_t g = 0; ok && g < groups; g++)
+    {
+        const byte_t *descriptor = table + g * descriptor_size;
+        uint64_t first = first_block + g * per_group;
+        uint64_t count = blocks - first < per_group ? blocks - first : per_group;
+        if (le16(descriptor + 18) & 0x2) // BLOCK_UNINIT, nothing was ever allocated in the group besides its metadata
+        {
+            mark_free(map, first, count);
+            continue;
+        }
+        uint64_t bitmap = le32(descriptor) | (descriptor_size >= 64 ? (uint64_t)le32(descriptor + 32) << 32 : 0);
+        ok = bitmap < blocks && read_at(volume, bitmap * map->unit, bits, (size_t)map->unit);
+        if (ok)
+        {
+            map_bitmap(map, bits, first, count);
+        }
+    }
+    free(bits);
+    free(table);
+    if (ok)
+    {
+        log_msg(LOG_INFO, "Found an ext volume with %" PRIu64 " blocks of %" PRIu64 " bytes\n", blocks, map->unit);
+    }
+    return ok;
+}
+
+/**
+ * @brief Recognizes the filesystem on a volume and maps it, only its geometry when `map->free` is NULL
+ */
+static bool map_volume(source *volume, volume_map *map)
+{
+    byte_t boot[SECTOR_SIZE];
+    if (!read_at(volume, 0, boot, sizeof(boot)))
+    {
+        return false;
+    }
+
+    bool mapped = false;
+    if (memcmp(boot + 3, "EXFAT   ", 8) == 0)
+        mapped = map_exfat(volume, boot, map);
+    else if (memcmp(boot + 3, "NTFS    ", 8) == 0)
+        mapped = map_ntfs(volume, boot, map);
+    else if (boot[510] == 0x55 && boot[511] == 0xAA && (boot[0] == 0xEB || boot[0] == 0xE9))
+        mapped = map_fat(volume, boot, map);
+    if (!mapped)
+    {
+        if (map->free)
+        {
+            map->free->count = 0;
+        }
+        mapped = map_ext(volume, map);
+    }
+    return mapped;
+}
+
+/**
+ * @brief Reads the cluster layout of the filesystem on a volume, the source is left at offset 0
+ *
+ * @param volume The source of the volume
+ * @param cluster The place where the cluster size is stored
+ * @param base The place where the offset of the clusters within the volume is stored, less than a cluster
+ * @return false if the volume holds no supported filesystem
+ */
+bool fs_geometry(source *volume, uint64_t *cluster, uint64_t *base)
+{
+    volume_map map = {0};
+    bool found = map_volume(volume, &map) && map.unit;
+    if (found)
+    {
+        *cluster = map.unit;
+        *base = (map.origin + 2 * map.unit) % map.unit; // The origin of FAT and exFAT is 2 clusters before their data area
+    }
+    source_seek(volume, 0);
+    return found;
+}
+
+/**
+ * @brief Reads the allocation metadata of the filesystem on a volume and limits the scan to its unallocated extents.
+ *        Deleted files are in the unallocated space, the allocated files are intact and need no carving.
+ *        A carve in progress at the end of an extent carries on in the next one, so a deleted file fragmented
+ *        around allocated clusters is still carved whole.
+ *
+ * @param volume The source of the volume, owned by the returned source from now on
+ * @return A source of the unallocated extents, or `volume` itself if it holds no supported filesystem
+ */
+source *source_open_unallocated(source *volume)
+{
+    extent_list free_extents = {0};
+    volume_map map = {.free = &free_extents};
+
+    if (!map_volume(volume, &map))
+    {
+        log_msg(LOG_INFO, "No supported filesystem found, scanning the whole input\n");
+        free(free_extents.items);
+        source_seek(volume, 0);
+        return volume;
+    }
+
+    source *src = source_open_extents(volume, &free_extents);
+    log_msg(LOG_INFO, "Scanning %zu unallocated extents, %" PRIu64 " of %" PRIu64 " bytes\n", free_extents.count, src->size,
+            map.end ? map.end : volume->size);
+    return src;
+}
@@ -0,0 +1,299 @@
+#include "fingerprint.h"
+#include "hash.h"
+#include <inttypes.h>
+#include <limits.h>
+
+// The longest line of the database, a row with two file names
+#define LINE_MAX_LENGTH (2 * FILENAME_MAX + 512)
+
+/**
+ * @brief Hashes the blocks `first` to `last` (excluded) of a source with xxHash3, the last block of the source may
+ *        be shorter
+ *
+ * @param hashes Receives the hashes, hashes[0] is the one of block `first`
+ * @return false if a block could not be read whole
+ */
+bool fingerprint_blocks(source *src, size_t first, size_t last, uint64_t *hashes)
+{
+    if (first >= last)
+    {
+        return true;
+    }
+    uint64_t offset = (uint64_t)first * FINGERPRINT_BLOCK;
+    if (!source_seek(src, offset))
+    {
+        return false;
+    }
+    byte_t *buffer = buffer_alloc(FINGERPRINT_BLOCK);
+    CHECK_OR_EXIT(buffer);
+    bool read = true;
+    for (size_t b = first; b < last && read; b++, offset += FINGERPRINT_BLOCK)
+    {
+        size_t expected = src->size - offset < FINGERPRINT_BLOCK ? (size_t)(src->size - offset) : FINGERPRINT_BLOCK;
+        size_t got = source_read(src, buffer, expected);
+        read = got == expected;
+        hashes[b - first] = XXH3_64bits(buffer, got);
+    }
+    buffer_free(buffer, FINGERPRINT_BLOCK);
+    return read;
+}
+
+/**
+ * @brief Whether the carves kept in a database can be reused by a scan with the settings of another, i.e. the chunks
+ *        are the same and the carves were found, named and dropped the same way. The size of the image may differ.
+ */
+bool fingerprint_compatible(const fingerprint_db *previous, const fingerprint_db *current)
+{
+    return previous->chunk_count > 0 && previous->chunk_size == current->chunk_size &&
+           previous->alignment == current->alignment && previous->cluster_base == current->cluster_base &&
+           previous->hash == current->hash && previous->layout == current->layout && previous->dedup == current->dedup &&
+           previous->skip_corrupt == current->skip_corrupt && strcmp(previous->known_hashes, current->known_hashes) == 0;
+}
+
+/**
+ * @brief Writes the database as `key=value` lines: the settings, a `block` line per fingerprint, then a `chunk`
+ *        line per chunk followed by a tab separated `row` line per carve. Like the checkpoint, it is written next to
+ *        `path` and renamed over it.
+ *
+ * @return true if the database was saved
+ */
+bool fingerprint_save(const char *path, const fingerprint_db *db)
+{
+    char temp_path[FILENAME_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *file = fopen(temp_path, "w");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    fprintf(file, "version=%d\n", FINGERPRINT_VERSION);
+    fprintf(file, "object_size=%" PRIu64 "\n", db->object_size);
+    fprintf(file, "chunk_size=%" PRIu64 "\n", db->chunk_size);
+    fprintf(file, "alignment=%d\n", db->alignment);
+    fprintf(file, "cluster_base=%" PRIu64 "\n", db->cluster_base);
+    fprintf(file, "hash=%d\n", db->hash);
+    fprintf(file, "layout=%d\n", db->layout);
+    fprintf(file, "dedup=%d\n", db->dedup);
+    fprintf(file, "skip_corrupt=%d\n", db->skip_corrupt);
+    fprintf(file, "known_hashes=%s\n", db->known_hashes);
+    fprintf(file, "blocks=%zu\n", db->block_count);
+    for (size_t b = 0; b < db->block_count; b++)
+    {
+        fprintf(file, "block=%016" PRIx64 "\n", db->blocks[b]);
+    }
+    for (int k = 0; k < db->chunk_count; k++)
+    {
+        const fingerprint_chunk *chunk = &db->chunks[k];
+        fprintf(file, "chunk=%" PRIu64 ",%" PRIu64 "\n", chunk->from, chunk->stop);
+        for (size_t i = 0; i < chunk->rows.count; i++)
+        {
+            const carve_record *row = &chunk->rows.rows[i];
+            fprintf(file, "row=%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s\t%d\t%d\t%s\t%" PRId64 "\n", row->name,
+                    row->type, row->start, row->end, row->size, row->digest, row->status, row->reason,
+                    row->duplicate_of ? row->duplicate_of : "", row->error_offset);
+        }
+    }
+
+    bool written = fflush(file) == 0;
+    written = fclose(file) == 0 && written;
+    if (!written)
+    {
+        remove(temp_path);
+        return false;
+    }
+
+#ifdef _WIN32
+    remove(path); // rename does not replace an existing file on Windows
+#endif
+    return rename(temp_path, path) == 0;
+}
+
+/**
+ * @brief Reads a row line back, its fields are cut in place
+ */
+static bool parse_row(char *line, carve_record *row)
+{
+    char *fields[10];
+    char *cursor = line;
+    for (int i = 0; i < 10; i++)
+    {
+        if (cursor == NULL)
+        {
+            return false;
+        }
+        fields[i] = cursor;
+        cursor = strchr(cursor, '\t');
+        if (cursor)
+        {
+            *cursor++ = '\0';
+        }
+    }
+    *row = (carve_record){.name = fields[0], .type = fields[1], .start = strtoull(fields[2], NULL, 10),
+                          .end = strtoull(fields[3], NULL, 10), .size = strtoull(fields[4], NULL, 10),
+                          .digest = fields[5], .status = atoi(fields[6]), .reason = atoi(fields[7]),
+                          .duplicate_of = fields[8][0] ? fields[8] : NULL, .error_offset = strtoll(fields[9], NULL, 10)};
+    return true;
+}
+
+// A carve of the database and the chunk holding it, to find the originals of the duplicates by name
+typedef struct named_row
+{
+    const char *name; // The file of the carve
+    int chunk;        // Its chunk
+} named_row;
+
+static int compare_named_rows(const void *a, const void *b)
+{
+    return strcmp(((const named_row *)a)->name, ((const named_row *)b)->name);
+}
+
+/**
+ * @brief Finds the chunk holding the original of every duplicate, INT_MAX when it is not in the database
+ */
+static void find_originals(fingerprint_db *db)
+{
+    size_t total = 0;
+    for (int k = 0; k < db->chunk_count; k++)
+    {
+        total += db->chunks[k].rows.count;
+    }
+    named_row *names = malloc((total ? total : 1) * sizeof(named_row));
+    CHECK_OR_EXIT(names);
+    size_t count = 0;
+    for (int k = 0; k < db->chunk_count; k++)
+    {
+        for (size_t i = 0; i < db->chunks[k].rows.count; i++)
+        {
+            names[count++] = (named_row){db->chunks[k].rows.rows[i].name, k};
+        }
+    }
+    qsort(names, count, sizeof(named_row), compare_named_rows);
+
+    for (int k = 0; k < db->chunk_count; k++)
+    {
+        fingerprint_chunk *chunk = &db->chunks[k];
+        chunk->originals = malloc((chunk->rows.count ? chunk->rows.count : 1) * sizeof(int));
+        CHECK_OR_EXIT(chunk->originals);
+        for (size_t i = 0; i < chunk->rows.count; i++)
+        {
+            const char *original = chunk->rows.rows[i].duplicate_of;
+            chunk->originals[i] = -1;
+            if (original && strcmp(original, KNOWN_MARK) != 0)
+            {
+                named_row key = {original, 0};
+                named_row *found = bsearch(&key, names, count, sizeof(named_row), compare_named_rows);
+                chunk->originals[i] = found ? found->chunk : INT_MAX;
+            }
+        }
+    }
+    free(names);
+}
+
+/**
+ * @brief Reads a database written by fingerprint_save
+ *
+ * @param path The database file
+ * @param db Receives the database, to be freed with fingerprint_free
+ * @return true if a complete database of the current version was read
+ */
+bool fingerprint_load(const char *path, fingerprint_db *db)
+{
+    memset(db, 0, sizeof(fingerprint_db));
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    char line[LINE_MAX_LENGTH];
+    int version = 0;
+    size_t blocks = 0;
+    bool valid = true;
+    while (valid && fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *value = strchr(line, '=');
+        if (value == NULL)
+        {
+            continue;
+        }
+        *value++ = '\0';
+
+        if (strcmp(line, "version") == 0)
+            version = atoi(value);
+        else if (strcmp(line, "object_size") == 0)
+            db->object_size = strtoull(value, NULL, 10);
+        else if (strcmp(line, "chunk_size") == 0)
+            db->chunk_size = strtoull(value, NULL, 10);
+        else if (strcmp(line, "alignment") == 0)
+            db->alignment = atoi(value);
+        else if (strcmp(line, "cluster_base") == 0)
+            db->cluster_base = strtoull(value, NULL, 10);
+        else if (strcmp(line, "hash") == 0)
+            db->hash = atoi(value);
+        else if (strcmp(line, "layout") == 0)
+            db->layout = atoi(value);
+        else if (strcmp(line, "dedup") == 0)
+            db->dedup = atoi(value) != 0;
+        else if (strcmp(line, "skip_corrupt") == 0)
+            db->skip_corrupt = atoi(value) != 0;
+        else if (strcmp(line, "known_hashes") == 0)
+            strncpy(db->known_hashes, value, FILENAME_MAX - 1);
+        else if (strcmp(line, "blocks") == 0 && db->blocks == NULL)
+        {
+            blocks = strtoull(value, NULL, 10);
+            db->blocks = malloc((blocks ? blocks : 1) * sizeof(uint64_t));
+            CHECK_OR_EXIT(db->blocks);
+        }
+        else if (strcmp(line, "block") == 0)
+        {
+            valid = db->block_count < blocks;
+            if (valid)
+                db->blocks[db->block_count++] = strtoull(value, NULL, 16);
+        }
+        else if (strcmp(line, "chunk") == 0)
+        {
+            db->chunks = realloc(db->chunks, (db->chunk_count + 1) * sizeof(fingerprint_chunk));
+            CHECK_OR_EXIT(db->chunks);
+            fingerprint_chunk *chunk = &db->chunks[db->chunk_count++];
+            memset(chunk, 0, sizeof(fingerprint_chunk));
+            chunk->from = strtoull(value, &value, 10);
+            chunk->stop = *value == ',' ? strtoull(value + 1, NULL, 10) : 0;
+        }
+        else if (strcmp(line, "row") == 0)
+        {
+            carve_record row;
+            valid = db->chunk_count > 0 && parse_row(value, &row);
+            if (valid)
+                manifest_rows_add(&db->chunks[db->chunk_count - 1].rows, &row);
+        }
+    }
+    fclose(file);
+
+    valid = valid && version == FINGERPRINT_VERSION && db->chunk_size > 0 && db->block_count == blocks &&
+            blocks == (db->object_size + FINGERPRINT_BLOCK - 1) / FINGERPRINT_BLOCK;
+    if (!valid)
+    {
+        fingerprint_free(db);
+        return false;
+    }
+    find_originals(db);
+    return true;
+}
+
+/**
+ * @brief Frees the fingerprints and the carves of a database
+ */
+void fingerprint_free(fingerprint_db *db)
+{
+    for (int k = 0; k < db->chunk_count; k++)
+    {
+        manifest_rows_free(&db->chunks[k].rows);
+        free(db->chunks[k].originals);
+    }
+    free(db->chunks);
+    free(db->blocks);
+    memset(db, 0, sizeof(fingerprint_db));
+}
@@ -0,0 +1,49 @@
+#ifndef __FINGERPRINT_H__
+#define __FINGERPRINT_H__
+
+#include "manifest.h"
+#include "source.h"
+
+// Version of the fingerprint database format
+#define FINGERPRINT_VERSION 1
+
+// The bytes of an image behind one fingerprint
+#define FINGERPRINT_BLOCK (1024 * 1024)
+
+// The fingerprint database of an incremental scan, written to the directory of the image
+#define JOB_FINGERPRINTS "recover.chunks"
+
+// A chunk of an image as it was merged
+typedef struct fingerprint_chunk
+{
+    uint64_t from;      // Where its carves start, a scan from there carves the same
+    uint64_t stop;      // Where its scan stopped, past the carve open at its end
+    manifest_rows rows; // Its carves, including the duplicates and known files
+    int *originals;     // For every row, the chunk holding the carve it is a duplicate of, -1 for none
+} fingerprint_chunk;
+
+// The fingerprints of an image and the carves of its chunks, kept from one incremental scan to the next
+typedef struct fingerprint_db
+{
+    uint64_t object_size;            // The size of the image
+    uint64_t chunk_size;             // The bytes of a chunk
+    int alignment;                   // The header alignment of the chunks
+    uint64_t cluster_base;           // The offset of the first cluster
+    int hash;                        // The content hash algorithm of the carves
+    int layout;                      // The layout of the carves
+    bool dedup;                      // Whether the carves were deduplicated
+    bool skip_corrupt;               // Whether the corrupt carves were dropped
+    char known_hashes[FILENAME_MAX]; // The known hash set, empty for none
+    uint64_t *blocks;                // The hash of every FINGERPRINT_BLOCK of the image
+    size_t block_count;              // Their number
+    fingerprint_chunk *chunks;       // The chunks, in order
+    int chunk_count;                 // Their number
+} fingerprint_db;
+
+bool fingerprint_blocks(source *src, size_t first, size_t last, uint64_t *hashes);
+bool fingerprint_compatible(const fingerprint_db *previous, const fingerprint_db *current);
+bool fingerprint_save(const char *path, const fingerprint_db *db);
+bool fingerprint_load(const char *path, fingerprint_db *db);
+void fingerprint_free(fingerprint_db *db);
+
+#endif //__FINGERPRINT_H__
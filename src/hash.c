@@ -0,0 +1,278 @@
+#define XXH_IMPLEMENTATION
+#include "hash.h"
+#include <pthread.h>
+
+// SHA-256 round constants
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * @brief Runs the SHA-256 compression function on one 64 byte block
+ */
+static void sha256_block(sha256_state *sha, const byte_t *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = sha->h[0], b = sha->h[1], c = sha->h[2], d = sha->h[3];
+    uint32_t e = sha->h[4], f = sha->h[5], g = sha->h[6], h = sha->h[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    sha->h[0] += a;
+    sha->h[1] += b;
+    sha->h[2] += c;
+    sha->h[3] += d;
+    sha->h[4] += e;
+    sha->h[5] += f;
+    sha->h[6] += g;
+    sha->h[7] += h;
+}
+
+/**
+ * @brief Starts a new hash
+ *
+ * @param state The hash state
+ * @param algorithm HASH_XXH3 or HASH_SHA256
+ */
+void hash_init(hash_state *state, int algorithm)
+{
+    static const uint32_t sha256_h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    state->algorithm = algorithm;
+    if (algorithm == HASH_SHA256)
+    {
+        memcpy(state->sha.h, sha256_h, sizeof(sha256_h));
+        state->sha.used = 0;
+        state->sha.length = 0;
+    }
+    else
+    {
+        XXH3_64bits_reset(&state->xxh3);
+    }
+}
+
+/**
+ * @brief Feeds `length` bytes into the hash
+ */
+void hash_update(hash_state *state, const byte_t *data, size_t length)
+{
+    if (state->algorithm != HASH_SHA256)
+    {
+        XXH3_64bits_update(&state->xxh3, data, length);
+        return;
+    }
+
+    sha256_state *sha = &state->sha;
+    sha->length += length;
+    if (sha->used)
+    {
+        size_t n = 64 - sha->used < length ? 64 - sha->used : length;
+        memcpy(sha->block + sha->used, data, n);
+        sha->used += n;
+        data += n;
+        length -= n;
+        if (sha->used < 64)
+        {
+            return;
+        }
+        sha256_block(sha, sha->block);
+        sha->used = 0;
+    }
+    for (; length >= 64; data += 64, length -= 64)
+    {
+        sha256_block(sha, data);
+    }
+    memcpy(sha->block, data, length);
+    sha->used = length;
+}
+
+/**
+ * @brief Finishes the hash and writes its digest as a lowercase hex string
+ */
+void hash_final(hash_state *state, char digest[DIGEST_MAX])
+{
+    if (state->algorithm != HASH_SHA256)
+    {
+        snprintf(digest, DIGEST_MAX, "%016llx", (unsigned long long)XXH3_64bits_digest(&state->xxh3));
+        return;
+    }
+
+    sha256_state *sha = &state->sha;
+    uint64_t bits = sha->length * 8;
+    byte_t padding[72] = {0x80};
+    size_t pad = (sha->used < 56 ? 56 : 120) - sha->used;
+    for (int i = 0; i < 8; i++)
+    {
+        padding[pad + i] = (byte_t)(bits >> (56 - 8 * i));
+    }
+    hash_update(state, padding, pad + 8);
+
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(digest + i * 8, DIGEST_MAX - i * 8, "%08x", sha->h[i]);
+    }
+}
+
+// Slice-by-16 tables of the reflected CRC-32 of PNG, zlib and gzip: crc_tables[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t crc_tables[16][256];
+
+// The CRC-32 of the CPU, picked once by crc32_pick
+static uint32_t (*crc32_impl)(uint32_t crc, const byte_t *data, size_t length);
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Portable CRC-32, 16 bytes per step with one table lookup per byte and no dependency between the lookups
+ */
+static uint32_t crc32_slice16(uint32_t crc, const byte_t *data, size_t length)
+{
+    for (; length >= 16; data += 16, length -= 16)
+    {
+        uint32_t a = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        crc = crc_tables[15][a & 0xFF] ^ crc_tables[14][(a >> 8) & 0xFF] ^ crc_tables[13][(a >> 16) & 0xFF] ^ crc_tables[12][a >> 24] ^
+              crc_tables[11][data[4]] ^ crc_tables[10][data[5]] ^ crc_tables[9][data[6]] ^ crc_tables[8][data[7]] ^
+              crc_tables[7][data[8]] ^ crc_tables[6][data[9]] ^ crc_tables[5][data[10]] ^ crc_tables[4][data[11]] ^
+              crc_tables[3][data[12]] ^ crc_tables[2][data[13]] ^ crc_tables[1][data[14]] ^ crc_tables[0][data[15]];
+    }
+    while (length--)
+    {
+        crc = crc_tables[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+/**
+ * @brief CRC-32 folded with carry-less multiplies, 64 bytes per step (Intel, "Fast CRC Computation for Generic
+ *        Polynomials Using PCLMULQDQ Instruction"). The constants are the reflected x^n mod P of the paper.
+ *        Leading and trailing bytes that do not make a whole 16 byte block go through slice-by-16.
+ */
+__attribute__((target("pclmul,sse4.1"))) static uint32_t crc32_clmul(uint32_t crc, const byte_t *data, size_t length)
+{
+    if (length < 64)
+    {
+        return crc32_slice16(crc, data, length);
+    }
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    size_t tail = length % 16;
+    length -= tail;
+
+    // Four lanes of 16 bytes, each folded 64 bytes forward at a time
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)data), _mm_cvtsi32_si128((int)crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 48));
+    data += 64;
+    length -= 64;
+    for (; length >= 64; data += 64, length -= 64)
+    {
+        __m128i y1 = _mm_clmulepi64_si128(x1, k1k2, 0x00), y2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i y3 = _mm_clmulepi64_si128(x3, k1k2, 0x00), y4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), y1), _mm_loadu_si128((const __m128i *)data));
+        x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), y2), _mm_loadu_si128((const __m128i *)(data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), y3), _mm_loadu_si128((const __m128i *)(data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), y4), _mm_loadu_si128((const __m128i *)(data + 48)));
+    }
+
+    // The lanes folded into one, then the remaining 16 byte blocks
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x2);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x3);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x4);
+    for (; length >= 16; data += 16, length -= 16)
+    {
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)),
+                           _mm_loadu_si128((const __m128i *)data));
+    }
+
+    // 128 bits folded to 64, then Barrett reduced to the 32 bit CRC
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5k0, 0x00), _mm_srli_si128(x1, 4));
+    __m128i y = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+    y = _mm_clmulepi64_si128(_mm_and_si128(y, low32), poly, 0x00);
+    crc = (uint32_t)_mm_extract_epi32(_mm_xor_si128(x1, y), 1);
+
+    return crc32_slice16(crc, data, tail);
+}
+#endif
+
+/**
+ * @brief Builds the tables and picks the fastest CRC-32 the CPU runs
+ */
+static void crc32_pick()
+{
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        uint32_t c = b;
+        for (int k = 0; k < 8; k++)
+        {
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_tables[0][b] = c;
+    }
+    for (int k = 1; k < 16; k++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            crc_tables[k][b] = crc_tables[0][crc_tables[k - 1][b] & 0xFF] ^ (crc_tables[k - 1][b] >> 8);
+        }
+    }
+
+    crc32_impl = crc32_slice16;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    {
+        crc32_impl = crc32_clmul;
+    }
+#endif
+}
+
+/**
+ * @brief Continues a CRC-32, start with 0. Uses carry-less multiplies when the CPU has them, slice-by-16 otherwise.
+ *
+ * @param crc The CRC of the bytes before
+ * @param data The next bytes
+ * @param length Their number
+ * @return The CRC of all the bytes so far
+ */
+uint32_t crc32_update(uint32_t crc, const byte_t *data, size_t length)
+{
+    pthread_once(&crc32_once, crc32_pick);
+    return ~crc32_impl(~crc, data, length);
+}
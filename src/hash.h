@@ -0,0 +1,33 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include "utils.h"
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash/xxhash.h"
+
+// The longest digest as a hex string including the NULL character, i.e. SHA-256
+#define DIGEST_MAX 65
+
+// State of a streaming SHA-256
+typedef struct sha256_state
+{
+    uint32_t h[8];    // The running hash
+    byte_t block[64]; // The partial block
+    size_t used;      // The bytes in `block`
+    uint64_t length;  // The total bytes hashed
+} sha256_state;
+
+// A streaming hash of one of the HASH_* algorithms
+typedef struct hash_state
+{
+    int algorithm;      // HASH_XXH3 or HASH_SHA256
+    XXH3_state_t xxh3;  // State when hashing with xxHash3
+    sha256_state sha;   // State when hashing with SHA-256
+} hash_state;
+
+void hash_init(hash_state *state, int algorithm);
+void hash_update(hash_state *state, const byte_t *data, size_t length);
+void hash_final(hash_state *state, char digest[DIGEST_MAX]);
+uint32_t crc32_update(uint32_t crc, const byte_t *data, size_t length);
+
+#endif //__HASH_H__
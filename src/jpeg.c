@@ -0,0 +1,611 @@
+#include "validate.h"
+
+// The bits of a Huffman code looked up in one step, longer codes are searched by length
+#define HUFFMAN_FAST_BITS 9
+
+// A Huffman table of a DHT segment, built for decoding
+typedef struct huffman
+{
+    bool defined;                                // Whether a DHT segment defined it
+    byte_t fast_length[1 << HUFFMAN_FAST_BITS];  // The length of the code starting with these bits, 0 if longer
+    byte_t fast_symbol[1 << HUFFMAN_FAST_BITS];  // Its symbol
+    int32_t max_code[18];                        // The largest code of each length, -1 for none
+    int32_t value_offset[17];                    // Symbol index minus code for each length
+    byte_t symbols[256];                         // The symbols in code order
+} huffman;
+
+// A component of the frame
+typedef struct jpeg_component
+{
+    int id;     // Its identifier, referenced by the scans
+    int h, v;   // Its sampling factors
+    int dc, ac; // The Huffman tables of the current scan
+} jpeg_component;
+
+// Entropy coded data read MSB first, with the byte stuffing removed
+typedef struct bit_reader
+{
+    const byte_t *data; // The carve
+    size_t length;      // Its size
+    size_t pos;         // The next byte to read
+    uint64_t bits;      // The buffered bits, left aligned
+    int count;          // The number of buffered bits
+    int padding;        // The last of them that are zeros padded past a marker or the end of the carve
+    bool stopped;       // Whether a marker or the end of the carve was reached
+} bit_reader;
+
+// State of the JPEG walk
+typedef struct jpeg_state
+{
+    const byte_t *data;              // The carve
+    size_t length;                   // Its size
+    size_t pos;                      // The next byte of the marker structure
+    huffman dc[4], ac[4];            // The Huffman tables
+    jpeg_component components[4];    // The components of the frame
+    int component_count;             // Their number, 0 before the frame header
+    int width, height;               // The size of the image
+    int h_max, v_max;                // The largest sampling factors
+    bool huffman_sequential;         // Whether the scans are decoded, otherwise (progressive, arithmetic) only walked
+    int restart_interval;            // MCUs between restart markers, 0 for none
+    int scans;                       // The scans read
+    size_t error;                    // The offset of the first error
+} jpeg_state;
+
+static int read_be16(const byte_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+/**
+ * @brief Builds a decoding table from the code counts and symbols of a DHT segment
+ *
+ * @return false if the counts describe more codes than fit
+ */
+static bool huffman_build(huffman *table, const byte_t counts[16], const byte_t *symbols, int total)
+{
+    memset(table, 0, sizeof(*table));
+    memcpy(table->symbols, symbols, total);
+    int32_t code = 0;
+    int k = 0;
+    for (int length = 1; length <= 16; length++)
+    {
+        table->value_offset[length] = k - code;
+        for (int i = 0; i < counts[length - 1]; i++, k++, code++)
+        {
+            if (code >= 1 << length)
+            {
+                return false; // More codes than there are bit patterns of this length
+            }
+            if (length <= HUFFMAN_FAST_BITS)
+            {
+                // Every lookup value starting with the code
+                int shift = HUFFMAN_FAST_BITS - length;
+                for (int fill = 0; fill < 1 << shift; fill++)
+                {
+                    table->fast_length[(code << shift) | fill] = (byte_t)length;
+                    table->fast_symbol[(code << shift) | fill] = symbols[k];
+                }
+            }
+        }
+        table->max_code[length] = counts[length - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+    table->max_code[17] = INT32_MAX; // Stops the search
+    table->defined = true;
+    return true;
+}
+
+/**
+ * @brief Buffers bytes until there are more than 56 bits, padding with zeros once a marker or the end is reached
+ */
+static void reader_fill(bit_reader *reader)
+{
+    while (reader->count <= 56)
+    {
+        byte_t b = 0;
+        if (!reader->stopped && reader->pos < reader->length)
+        {
+            b = reader->data[reader->pos];
+            if (b == 0xFF)
+            {
+                if (reader->pos + 1 < reader->length && reader->data[reader->pos + 1] == 0x00)
+                    reader->pos += 2; // A stuffed 0xFF
+                else
+                    reader->stopped = true; // A marker, or the carve ends on 0xFF
+            }
+            else
+            {
+                reader->pos++;
+            }
+        }
+        else
+        {
+            reader->stopped = true;
+        }
+        if (reader->stopped)
+        {
+            b = 0;
+            reader->padding += 8;
+        }
+        reader->bits |= (uint64_t)b << (56 - reader->count);
+        reader->count += 8;
+    }
+}
+
+/**
+ * @brief Drops `n` bits
+ *
+ * @return false if that went past the data into the padding
+ */
+static bool reader_skip(bit_reader *reader, int n)
+{
+    reader->bits <<= n;
+    reader->count -= n;
+    return reader->count >= reader->padding;
+}
+
+/**
+ * @brief Decodes one Huffman symbol
+ *
+ * @return The symbol, -1 for an invalid code or the data ending inside it
+ */
+static int decode_symbol(bit_reader *reader, const huffman *table)
+{
+    if (reader->count < 16)
+    {
+        reader_fill(reader);
+    }
+    unsigned peek = (unsigned)(reader->bits >> (64 - HUFFMAN_FAST_BITS));
+    int length = table->fast_length[peek];
+    if (length)
+    {
+        int symbol = table->fast_symbol[peek];
+        return reader_skip(reader, length) ? symbol : -1;
+    }
+
+    for (length = HUFFMAN_FAST_BITS + 1; length <= 16; length++)
+    {
+        int32_t code = (int32_t)(reader->bits >> (64 - length));
+        if (code <= table->max_code[length])
+        {
+            int symbol = table->symbols[table->value_offset[length] + code];
+            return reader_skip(reader, length) ? symbol : -1;
+        }
+    }
+    return -1; // No code of any length matches
+}
+
+/**
+ * @brief Decodes the Huffman codes of one 8x8 block without reconstructing its coefficients
+ *
+ * @return false on an invalid code, coefficient run or the data ending
+ */
+static bool decode_block(bit_reader *reader, const huffman *dc, const huffman *ac)
+{
+    int s = decode_symbol(reader, dc);
+    if (s < 0 || s > 15)
+    {
+        return false;
+    }
+    if (s)
+    {
+        if (reader->count < s)
+        {
+            reader_fill(reader);
+        }
+        if (!reader_skip(reader, s))
+        {
+            return false;
+        }
+    }
+
+    for (int k = 1; k < 64;)
+    {
+        int rs = decode_symbol(reader, ac);
+        if (rs < 0)
+        {
+            return false;
+        }
+        int run = rs >> 4, size = rs & 15;
+        if (size == 0)
+        {
+            if (run != 15)
+            {
+                return true; // End of block
+            }
+            k += 16;
+            continue;
+        }
+        k += run;
+        if (k > 63)
+        {
+            return false; // A coefficient past the end of the block
+        }
+        if (reader->count < size)
+        {
+            reader_fill(reader);
+        }
+        if (!reader_skip(reader, size))
+        {
+            return false;
+        }
+        k++;
+    }
+    return true;
+}
+
+/**
+ * @brief The offset in the carve of the next bit to decode, for the error offset
+ */
+static size_t reader_offset(const bit_reader *reader)
+{
+    int unread = reader->count - reader->padding; // Negative once the decode ran into the padding
+    size_t buffered = unread > 0 ? (size_t)unread / 8 : 0;
+    return reader->pos > buffered ? reader->pos - buffered : 0;
+}
+
+/**
+ * @brief Moves past the end of a restart interval or scan: only the padding bits of the last byte may be left,
+ *        and the next bytes have to be a marker
+ *
+ * @return STATUS_VALID if a marker follows, the status of the carve otherwise
+ */
+static int reader_align(bit_reader *reader, jpeg_state *state)
+{
+    reader_fill(reader);
+    if (reader->count - reader->padding >= 8)
+    {
+        state->error = reader_offset(reader);
+        return STATUS_CORRUPT; // Data the scan has no use for
+    }
+    if (reader->pos + 1 >= reader->length)
+    {
+        state->error = reader->length;
+        return STATUS_TRUNCATED;
+    }
+    return STATUS_VALID;
+}
+
+/**
+ * @brief Decodes the entropy coded data of a sequential Huffman scan and checks its restart markers
+ *
+ * @return STATUS_VALID if the scan decoded, STATUS_CORRUPT or STATUS_TRUNCATED with state->error set otherwise
+ */
+static int decode_scan(jpeg_state *state, jpeg_component **scan, int count)
+{
+    // An interleaved scan has MCUs of h x v blocks of every component, a single component scan one block per MCU
+    long mcus;
+    if (count == 1)
+    {
+        long w = ((long)state->width * scan[0]->h + state->h_max - 1) / state->h_max;
+        long h = ((long)state->height * scan[0]->v + state->v_max - 1) / state->v_max;
+        mcus = ((w + 7) / 8) * ((h + 7) / 8);
+    }
+    else
+    {
+        mcus = (((long)state->width + 8 * state->h_max - 1) / (8 * state->h_max)) *
+               (((long)state->height + 8 * state->v_max - 1) / (8 * state->v_max));
+    }
+
+    bit_reader reader = {.data = state->data, .length = state->length, .pos = state->pos};
+    int expected_restart = 0;
+    for (long mcu = 0; mcu < mcus; mcu++)
+    {
+        if (state->restart_interval && mcu && mcu % state->restart_interval == 0)
+        {
+            int status = reader_align(&reader, state);
+            if (status != STATUS_VALID)
+            {
+                return status;
+            }
+            byte_t marker = state->data[reader.pos + 1];
+            if (marker != 0xD0 + expected_restart)
+            {
+                state->error = reader.pos;
+                return marker == 0xD9 ? STATUS_TRUNCATED : STATUS_CORRUPT;
+            }
+            expected_restart = (expected_restart + 1) % 8;
+            reader = (bit_reader){.data = state->data, .length = state->length, .pos = reader.pos + 2};
+        }
+
+        for (int c = 0; c < count; c++)
+        {
+            int blocks = count == 1 ? 1 : scan[c]->h * scan[c]->v;
+            for (int b = 0; b < blocks; b++)
+            {
+                if (!decode_block(&reader, &state->dc[scan[c]->dc], &state->ac[scan[c]->ac]))
+                {
+                    state->error = reader_offset(&reader);
+                    // Running into EOI or the end of the carve within the last code means it was cut short
+                    bool cut = reader.stopped && (reader.pos + 1 >= reader.length || state->data[reader.pos + 1] == 0xD9);
+                    return cut && reader.count - reader.padding < 16 ? STATUS_TRUNCATED : STATUS_CORRUPT;
+                }
+            }
+        }
+    }
+
+    int status = reader_align(&reader, state);
+    state->pos = reader.pos;
+    return status;
+}
+
+/**
+ * @brief Skips the entropy coded data of a scan that is only walked, up to the first marker that is not a restart
+ */
+static void skip_scan(jpeg_state *state)
+{
+    while (state->pos + 1 < state->length)
+    {
+        if (state->data[state->pos] == 0xFF)
+        {
+            byte_t next = state->data[state->pos + 1];
+            if (next != 0x00 && (next < 0xD0 || next > 0xD7) && next != 0xFF)
+            {
+                return;
+            }
+        }
+        state->pos++;
+    }
+    state->pos = state->length;
+}
+
+/**
+ * @brief Reads a DHT segment, which can hold several tables
+ */
+static bool read_dht(jpeg_state *state, const byte_t *segment, int length)
+{
+    while (length > 0)
+    {
+        if (length < 17)
+        {
+            return false;
+        }
+        int table_class = segment[0] >> 4, id = segment[0] & 15, total = 0;
+        for (int i = 1; i <= 16; i++)
+        {
+            total += segment[i];
+        }
+        if (table_class > 1 || id > 3 || total > 256 || 17 + total > length)
+        {
+            return false;
+        }
+        if (!huffman_build(table_class ? &state->ac[id] : &state->dc[id], segment + 1, segment + 17, total))
+        {
+            return false;
+        }
+        segment += 17 + total;
+        length -= 17 + total;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads a DQT segment, checking the sizes of its tables
+ */
+static bool read_dqt(const byte_t *segment, int length)
+{
+    while (length > 0)
+    {
+        int precision = segment[0] >> 4, id = segment[0] & 15;
+        int size = 1 + 64 * (precision ? 2 : 1);
+        if (precision > 1 || id > 3 || size > length)
+        {
+            return false;
+        }
+        segment += size;
+        length -= size;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the frame header
+ */
+static bool read_sof(jpeg_state *state, byte_t marker, const byte_t *segment, int length)
+{
+    if (state->component_count || length < 6)
+    {
+        return false; // One frame per image
+    }
+    int count = segment[5];
+    if (count < 1 || count > 4 || length != 6 + 3 * count || (segment[0] != 8 && segment[0] != 12 && segment[0] != 16))
+    {
+        return false;
+    }
+    state->height = read_be16(segment + 1);
+    state->width = read_be16(segment + 3);
+    if (state->width == 0)
+    {
+        return false;
+    }
+    state->h_max = state->v_max = 1;
+    for (int i = 0; i < count; i++)
+    {
+        jpeg_component *component = &state->components[i];
+        component->id = segment[6 + 3 * i];
+        component->h = segment[7 + 3 * i] >> 4;
+        component->v = segment[7 + 3 * i] & 15;
+        if (component->h < 1 || component->h > 4 || component->v < 1 || component->v > 4 || segment[8 + 3 * i] > 3)
+        {
+            return false;
+        }
+        state->h_max = component->h > state->h_max ? component->h : state->h_max;
+        state->v_max = component->v > state->v_max ? component->v : state->v_max;
+    }
+    state->component_count = count;
+
+    // Baseline and extended sequential Huffman are decoded. Progressive scans refine coefficients over several scans and
+    // arithmetic coding needs its own decoder, those are only walked. So is an image whose height comes later in a DNL.
+    state->huffman_sequential = (marker == 0xC0 || marker == 0xC1) && state->height > 0;
+    return true;
+}
+
+/**
+ * @brief Reads a scan header and the entropy coded data after it
+ *
+ * @return STATUS_VALID if the scan checked out
+ */
+static int read_sos(jpeg_state *state, const byte_t *segment, int length)
+{
+    int count = length ? segment[0] : 0;
+    if (!state->component_count || count < 1 || count > 4 || length != 4 + 2 * count)
+    {
+        return STATUS_CORRUPT;
+    }
+
+    jpeg_component *scan[4];
+    for (int i = 0; i < count; i++)
+    {
+        scan[i] = NULL;
+        for (int c = 0; c < state->component_count; c++)
+        {
+            if (state->components[c].id == segment[1 + 2 * i])
+            {
+                scan[i] = &state->components[c];
+            }
+        }
+        if (scan[i] == NULL)
+        {
+            return STATUS_CORRUPT;
+        }
+        scan[i]->dc = segment[2 + 2 * i] >> 4;
+        scan[i]->ac = segment[2 + 2 * i] & 15;
+        if (scan[i]->dc > 3 || scan[i]->ac > 3)
+        {
+            return STATUS_CORRUPT;
+        }
+    }
+    state->scans++;
+
+    if (!state->huffman_sequential)
+    {
+        skip_scan(state);
+        return STATUS_VALID;
+    }
+
+    const byte_t *selection = segment + 1 + 2 * count;
+    if (selection[0] != 0 || selection[1] != 63 || selection[2] != 0)
+    {
+        return STATUS_CORRUPT; // A sequential scan covers every coefficient at full precision
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (!state->dc[scan[i]->dc].defined || !state->ac[scan[i]->ac].defined)
+        {
+            return STATUS_CORRUPT;
+        }
+    }
+    return decode_scan(state, scan, count);
+}
+
+/**
+ * @brief Test-decodes a JPEG carve: walks its markers and segments and decodes the Huffman codes of every
+ *        sequential scan, without the dequantization and IDCT a viewer would do on top
+ *
+ * @param data The carve
+ * @param length Its size
+ * @param error_offset Receives the offset of the first error, -1 when there is none
+ * @return STATUS_VALID if it decoded up to EOI, STATUS_TRUNCATED if it ended early, STATUS_CORRUPT otherwise
+ */
+int jpeg_validate(const byte_t *data, size_t length, int64_t *error_offset)
+{
+    jpeg_state *state = calloc(1, sizeof(jpeg_state)); // The tables are too large for the stack of a worker
+    CHECK_OR_EXIT(state);
+    state->data = data;
+    state->length = length;
+    state->pos = 2;
+
+    // Unchecked while the walk goes on
+    int status = length >= 2 && data[0] == 0xFF && data[1] == 0xD8 ? STATUS_UNCHECKED : STATUS_CORRUPT;
+    while (status == STATUS_UNCHECKED)
+    {
+        state->error = state->pos;
+        if (state->pos + 2 > length)
+        {
+            status = STATUS_TRUNCATED; // Ended before EOI
+            break;
+        }
+        if (data[state->pos] != 0xFF)
+        {
+            status = STATUS_CORRUPT;
+            break;
+        }
+        byte_t marker = data[state->pos + 1];
+        if (marker == 0xFF)
+        {
+            state->pos++; // Fill byte
+            continue;
+        }
+        state->pos += 2;
+
+        if (marker == 0xD9)
+        {
+            status = state->scans ? STATUS_VALID : STATUS_CORRUPT;
+            break;
+        }
+        if (marker == 0x01)
+        {
+            continue; // TEM, no segment
+        }
+        if ((marker >= 0xD0 && marker <= 0xD8) || marker < 0xC0)
+        {
+            status = STATUS_CORRUPT; // A restart outside a scan, a second SOI or a reserved marker
+            break;
+        }
+
+        if (state->pos + 2 > length)
+        {
+            status = STATUS_TRUNCATED;
+            break;
+        }
+        int segment_length = read_be16(data + state->pos);
+        if (segment_length < 2)
+        {
+            status = STATUS_CORRUPT;
+            break;
+        }
+        if (state->pos + segment_length > length)
+        {
+            status = STATUS_TRUNCATED; // e.g. cut at the EOI of the thumbnail in an APP1 segment
+            break;
+        }
+        const byte_t *segment = data + state->pos + 2;
+        int n = segment_length - 2;
+        state->pos += segment_length;
+
+        bool ok = true;
+        switch (marker)
+        {
+        case 0xC4:
+            ok = read_dht(state, segment, n);
+            break;
+        case 0xDB:
+            ok = read_dqt(segment, n);
+            break;
+        case 0xDD:
+            ok = n == 2;
+            state->restart_interval = ok ? read_be16(segment) : 0;
+            break;
+        case 0xC0: case 0xC1: case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+        case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+            ok = read_sof(state, marker, segment, n);
+            break;
+        case 0xDA:
+        {
+            int scan_status = read_sos(state, segment, n); // A bad scan header is reported at its marker
+            status = scan_status == STATUS_VALID ? status : scan_status;
+            break;
+        }
+        default:
+            break; // APPn, COM, DNL, JPGn and the like carry nothing to check
+        }
+        if (!ok)
+        {
+            status = STATUS_CORRUPT; // Reported at the marker of the segment
+        }
+    }
+
+    *error_offset = status == STATUS_VALID ? -1 : (int64_t)state->error;
+    free(state);
+    return status;
+}
@@ -0,0 +1,207 @@
+#include "knownhash.h"
+#include "log.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const byte_t *mapping = NULL; // The whole mapped file
+static size_t mapping_size = 0;      // Its size
+static const uint64_t *buckets;      // The bucket starts
+static const byte_t *digests;        // The sorted digests
+static uint32_t size_of_digest;      // The size of each digest
+#ifdef _WIN32
+static HANDLE mapping_handle = NULL; // The file mapping object
+#endif
+
+/**
+ * @brief Returns the digest size in bytes of a hash algorithm
+ */
+int digest_size(int algorithm)
+{
+    return algorithm == HASH_SHA256 ? 32 : 8;
+}
+
+// The value plus one of each hex digit, 0 for any other character
+static const signed char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16};
+
+/**
+ * @brief Converts a hex digest to its bytes
+ *
+ * @return false if the digest is not `size` bytes of hex
+ */
+bool digest_to_bytes(const char *digest, byte_t *bytes, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        int high = hex_values[(unsigned char)digest[i * 2]], low = hex_values[(unsigned char)digest[i * 2 + 1]];
+        if (!high || !low)
+        {
+            return false;
+        }
+        bytes[i] = (byte_t)((high - 1) << 4 | (low - 1));
+    }
+    char end = digest[size * 2];
+    return end == '\0' || end == '\n' || end == '\r' || end == ' ';
+}
+
+/**
+ * @brief Memory-maps a known hash set built by mkhashset. Nothing is parsed or loaded up front,
+ *        the pages a lookup touches are read in by the OS on demand.
+ *
+ * @param path The hash set file
+ * @param algorithm The hash algorithm of the carves, which must be the one of the set
+ * @return true if the set was mapped
+ */
+bool known_open(const char *path, int algorithm)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        log_msg(LOG_ERROR, "Error opening the known hash set '%s'\n", path);
+        return false;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(file, &size);
+    mapping_size = (size_t)size.QuadPart;
+    mapping_handle = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    mapping = mapping_handle ? MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        log_msg(LOG_ERROR, "Error opening the known hash set '%s'\n", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    mapping_size = (size_t)st.st_size;
+    mapping = mapping_size ? mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        mapping = NULL;
+    }
+    if (mapping)
+    {
+        madvise((void *)mapping, mapping_size, MADV_RANDOM); // Lookups jump around, read-ahead would be wasted
+    }
+#endif
+    if (mapping == NULL)
+    {
+        log_msg(LOG_ERROR, "Error mapping the known hash set '%s'\n", path);
+        known_close();
+        return false;
+    }
+
+    const known_header *header = (const known_header *)mapping;
+    size_t table = sizeof(known_header) + (KNOWN_BUCKETS + 1) * sizeof(uint64_t);
+    if (mapping_size < table || memcmp(header->magic, KNOWN_MAGIC, 4) != 0 || header->version != KNOWN_VERSION ||
+        header->digest_size != (uint32_t)digest_size(header->algorithm) ||
+        mapping_size < table + header->count * header->digest_size)
+    {
+        log_msg(LOG_ERROR, "'%s' is not a known hash set\n", path);
+        known_close();
+        return false;
+    }
+    if (header->algorithm != (uint32_t)algorithm)
+    {
+        log_msg(LOG_ERROR, "The known hash set '%s' holds %s hashes, run with --hash %s\n", path,
+                header->algorithm == HASH_SHA256 ? "SHA-256" : "xxHash3", header->algorithm == HASH_SHA256 ? "sha256" : "xxh3");
+        known_close();
+        return false;
+    }
+
+    buckets = (const uint64_t *)(mapping + sizeof(known_header));
+    digests = mapping + table;
+    size_of_digest = header->digest_size;
+    return true;
+}
+
+/**
+ * @brief Returns the 8 bytes after the bucket prefix of a digest as a big-endian number, its position within the bucket
+ */
+static uint64_t bucket_position(const byte_t *digest)
+{
+    uint64_t value = 0;
+    for (uint32_t i = 2; i < 10; i++)
+    {
+        value = value << 8 | (i < size_of_digest ? digest[i] : 0);
+    }
+    return value;
+}
+
+/**
+ * @brief Checks if a carve's hex digest is in the known hash set
+ */
+bool known_contains(const char *digest)
+{
+    byte_t key[32];
+    if (mapping == NULL || !digest_to_bytes(digest, key, size_of_digest))
+    {
+        return false;
+    }
+
+    // Hashes are uniformly distributed, so interpolating within the bucket of the first two bytes lands a few
+    // entries from the digest, mostly in the same cache line. The walk from there only touches neighbouring lines
+    // where a binary search takes a cache miss per halving.
+    unsigned bucket = key[0] << 8 | key[1];
+    uint64_t low = buckets[bucket], high = buckets[bucket + 1];
+    if (low == high)
+    {
+        return false;
+    }
+    uint64_t guess = low + (uint64_t)((double)bucket_position(key) / 18446744073709551616.0 * (double)(high - low));
+    if (guess >= high)
+    {
+        guess = high - 1; // The division can round up to 1
+    }
+    const byte_t *entry = digests + guess * size_of_digest;
+    int order = memcmp(entry, key, size_of_digest);
+    if (order < 0)
+    {
+        while (order < 0 && ++guess < high)
+        {
+            entry += size_of_digest;
+            order = memcmp(entry, key, size_of_digest);
+        }
+    }
+    else
+    {
+        while (order > 0 && guess-- > low)
+        {
+            entry -= size_of_digest;
+            order = memcmp(entry, key, size_of_digest);
+        }
+    }
+    return order == 0;
+}
+
+/**
+ * @brief Unmaps the known hash set
+ */
+void known_close()
+{
+#ifdef _WIN32
+    if (mapping)
+        UnmapViewOfFile(mapping);
+    if (mapping_handle)
+        CloseHandle(mapping_handle);
+    mapping_handle = NULL;
+#else
+    if (mapping)
+        munmap((void *)mapping, mapping_size);
+#endif
+    mapping = NULL;
+    mapping_size = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef __KNOWNHASH_H__
+#define __KNOWNHASH_H__
+
+#include "hash.h"
+
+// Layout of a known hash set file, all integers little-endian:
+//      header, KNOWN_BUCKETS + 1 uint64 bucket starts, `count` sorted digests of `digest_size` bytes.
+// Bucket b starts at the first digest whose first two bytes are >= b, so a lookup only searches one bucket.
+#define KNOWN_MAGIC "RKHS"
+#define KNOWN_VERSION 1
+#define KNOWN_BUCKETS 65536
+
+// The header of a known hash set file
+typedef struct known_header
+{
+    char magic[4];        // KNOWN_MAGIC
+    uint32_t version;     // KNOWN_VERSION
+    uint32_t algorithm;   // HASH_XXH3 or HASH_SHA256
+    uint32_t digest_size; // 8 for xxHash3, 32 for SHA-256
+    uint64_t count;       // The number of digests
+} known_header;
+
+bool known_open(const char *path, int algorithm);
+bool known_contains(const char *digest);
+void known_close();
+int digest_size(int algorithm);
+bool digest_to_bytes(const char *digest, byte_t *bytes, int size);
+
+#endif //__KNOWNHASH_H__
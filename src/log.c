@@ -0,0 +1,277 @@
+#include "log.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+// A message in the ring, `sequence` tells whose turn the slot is (Vyukov's bounded queue):
+// it equals the position for a producer to fill it and the position + 1 for the log thread to print it
+typedef struct log_slot
+{
+    atomic_size_t sequence;  // The turn of the slot
+    char text[LOG_LINE_MAX]; // The message
+} log_slot;
+
+static log_slot ring[LOG_SLOTS];             // The messages waiting for the log thread
+static atomic_size_t head;                   // The next position a producer claims
+static size_t tail;                          // The next position the log thread prints, only it touches it
+static atomic_size_t dropped;                // The messages dropped on a full ring
+static int verbosity = LOG_INFO;             // The selected level
+static atomic_bool running;                  // Whether the log thread is draining the ring
+static pthread_t drainer;                    // The log thread
+static atomic_uint_least64_t progress_bytes; // The bytes scanned by every job
+static atomic_uint_least64_t progress_total; // The bytes every job will scan, 0 when unknown
+static atomic_int progress_files;            // The carves found by every job
+static bool show_progress;                   // Whether the progress line is drawn, only on a terminal
+static int progress_width;                   // The length of the progress line on screen, 0 when none is shown
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pause_ms(int ms)
+{
+    struct timespec pause = {0, ms * 1000000L};
+    nanosleep(&pause, NULL);
+}
+
+/**
+ * @brief Formats a byte count like 12.3 MiB
+ */
+static void format_bytes(double bytes, char out[16])
+{
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    for (; bytes >= 1024 && unit < 4; unit++)
+    {
+        bytes /= 1024;
+    }
+    snprintf(out, 16, unit ? "%.1f %s" : "%.0f %s", bytes, units[unit]);
+}
+
+/**
+ * @brief Removes the progress line so a message can be printed in its place
+ */
+static void clear_progress()
+{
+    if (progress_width)
+    {
+        printf("\r%*s\r", progress_width, "");
+        progress_width = 0;
+    }
+}
+
+/**
+ * @brief Draws the progress line: bytes scanned, the rate since the last redraw, the time left and the carves found
+ */
+static void draw_progress(double *last_time, uint64_t *last_bytes, double *rate)
+{
+    double t = now_seconds();
+    uint64_t bytes = atomic_load(&progress_bytes), total = atomic_load(&progress_total);
+    if (t > *last_time)
+    {
+        double current = (bytes - *last_bytes) / (t - *last_time);
+        *rate = *rate ? 0.7 * *rate + 0.3 * current : current; // Smoothed so the time left does not jump around
+    }
+    *last_time = t;
+    *last_bytes = bytes;
+
+    char done[16], all[16], speed[16], eta[32] = "";
+    format_bytes((double)bytes, done);
+    format_bytes((double)total, all);
+    format_bytes(*rate, speed);
+    if (total > bytes && *rate > 0)
+    {
+        uint64_t left = (uint64_t)((total - bytes) / *rate);
+        snprintf(eta, sizeof(eta), ", ETA %" PRIu64 ":%02" PRIu64 ":%02" PRIu64, left / 3600, left / 60 % 60, left % 60);
+    }
+
+    char line[160];
+    int n = total ? snprintf(line, sizeof(line), "%s of %s (%.0f%%), %s/s%s, %d carves", done, all, 100.0 * bytes / total, speed, eta, atomic_load(&progress_files))
+                  : snprintf(line, sizeof(line), "%s, %s/s, %d carves", done, speed, atomic_load(&progress_files));
+    printf("\r%-*s", progress_width, line); // Padded over a longer line drawn before
+    progress_width = n > progress_width ? n : progress_width;
+    fflush(stdout);
+}
+
+/**
+ * @brief Prints the messages in the ring in order, returns how many there were
+ */
+static int drain()
+{
+    int printed = 0;
+    for (;;)
+    {
+        log_slot *slot = &ring[tail % LOG_SLOTS];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != tail + 1)
+        {
+            break;
+        }
+        if (!printed)
+        {
+            clear_progress();
+        }
+        fputs(slot->text, stdout);
+        atomic_store_explicit(&slot->sequence, tail + LOG_SLOTS, memory_order_release); // Free for the next lap
+        tail++;
+        printed++;
+    }
+    if (printed)
+    {
+        fflush(stdout);
+    }
+    return printed;
+}
+
+/**
+ * @brief The log thread, the only one writing to stdout while the scan runs
+ */
+static void *log_thread(void *arg)
+{
+    (void)arg;
+    double last_draw = 0, last_time = now_seconds(), rate = 0;
+    uint64_t last_bytes = 0;
+    while (atomic_load(&running))
+    {
+        if (!drain())
+        {
+            pause_ms(10);
+        }
+        if (show_progress && now_seconds() - last_draw >= LOG_PROGRESS_INTERVAL / 1000.0)
+        {
+            draw_progress(&last_time, &last_bytes, &rate);
+            last_draw = now_seconds();
+        }
+    }
+    drain();
+    clear_progress();
+    return NULL;
+}
+
+/**
+ * @brief Starts the log thread, from then on messages are printed by it and the progress line is drawn on a terminal
+ *
+ * @param level The most verbose level printed
+ */
+void log_init(int level)
+{
+    verbosity = level;
+    for (size_t i = 0; i < LOG_SLOTS; i++)
+    {
+        atomic_init(&ring[i].sequence, i);
+    }
+    show_progress = level >= LOG_INFO && isatty(fileno(stdout));
+    atomic_store(&running, true);
+    if (pthread_create(&drainer, NULL, log_thread, NULL) != 0)
+    {
+        atomic_store(&running, false); // Printed directly then
+        return;
+    }
+    atexit(log_close);
+}
+
+/**
+ * @brief Queues a message for the log thread, the caller never waits for the terminal. When the ring is full the message
+ *        is dropped and counted, except for an error which waits for room. Before log_init it is printed directly.
+ *
+ * @param level The level of the message, one of the LOG_* values
+ * @param format The printf format of the message
+ */
+void log_msg(int level, const char *format, ...)
+{
+    if (level > verbosity)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    if (!atomic_load(&running))
+    {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+
+    // Claims a slot, many scan jobs can log at once
+    size_t position = atomic_load_explicit(&head, memory_order_relaxed);
+    log_slot *slot;
+    for (;;)
+    {
+        slot = &ring[position % LOG_SLOTS];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == position)
+        {
+            if (atomic_compare_exchange_weak_explicit(&head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (sequence < position)
+        {
+            if (level != LOG_ERROR)
+            {
+                atomic_fetch_add(&dropped, 1);
+                va_end(args);
+                return;
+            }
+            pause_ms(1); // Full, an error is worth the wait
+            position = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+        else
+        {
+            position = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    vsnprintf(slot->text, LOG_LINE_MAX, format, args);
+    va_end(args);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+/**
+ * @brief Adds to the progress shown on the terminal, called by the scan jobs as they go
+ *
+ * @param bytes The bytes scanned since the last call
+ * @param files The carves started since the last call
+ */
+void log_progress(uint64_t bytes, int files)
+{
+    atomic_fetch_add_explicit(&progress_bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&progress_files, files, memory_order_relaxed);
+}
+
+/**
+ * @brief Adds the bytes a scan job is going to scan to the total of the progress line
+ */
+void log_progress_total(uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&progress_total, bytes, memory_order_relaxed);
+}
+
+/**
+ * @brief Prints what is left in the ring and stops the log thread, messages are printed directly afterwards
+ */
+void log_close()
+{
+    if (!atomic_exchange(&running, false))
+    {
+        return;
+    }
+    pthread_join(drainer, NULL);
+    if (atomic_load(&dropped))
+    {
+        printf("%zu log messages were dropped, the terminal could not keep up\n", (size_t)atomic_load(&dropped));
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,30 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "utils.h"
+
+// The messages waiting for the log thread, a power of two
+#define LOG_SLOTS 4096
+
+// The longest message, longer ones are cut
+#define LOG_LINE_MAX 512
+
+// The milliseconds between two redraws of the progress line
+#define LOG_PROGRESS_INTERVAL 250
+
+// Verbosity levels, a message is printed when its level is at most the selected one
+enum
+{
+    LOG_ERROR,   // Errors and degraded modes, printed even with -q
+    LOG_INFO,    // What the scan is doing and its results, the default
+    LOG_VERBOSE, // Every finished carve, -v
+    LOG_DEBUG    // Every header found, -vv
+};
+
+void log_init(int level);
+void log_msg(int level, const char *format, ...);
+void log_progress(uint64_t bytes, int files);
+void log_progress_total(uint64_t bytes);
+void log_close();
+
+#endif //__LOG_H__
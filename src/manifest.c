@@ -0,0 +1,480 @@
+#include "manifest.h"
+#include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
+
+// The longest row of the manifest
+#define ROW_MAX (2 * FILENAME_MAX + 512)
+
+static THREAD_LOCAL FILE *manifest = NULL; // The manifest file of the scan, NULL when not written
+static THREAD_LOCAL int format;           // MANIFEST_CSV or MANIFEST_JSONL
+static THREAD_LOCAL char *batch = NULL;    // The rows not appended yet, always whole rows
+static THREAD_LOCAL size_t batch_len = 0;  // Their size
+static THREAD_LOCAL time_t batch_time = 0; // The time the batch was last appended
+static THREAD_LOCAL manifest_rows *kept = NULL; // Receives the rows instead of the file, NULL when they are written
+static THREAD_LOCAL FILE *events = NULL;        // Receives every row as a carve event of the daemon, NULL for none
+static THREAD_LOCAL int event_job = 0;          // The daemon job the events belong to
+
+static const char *status_names[] = {"unchecked", "valid", "truncated", "corrupt"}; // In the order of the STATUS_* values
+static const char *reason_names[] = {"trailer", "header", "end_of_input"};         // In the order of the END_* values
+
+/**
+ * @brief Appends the batched rows to the manifest in one write, so a reader following the file never sees half a row
+ */
+static void flush_batch()
+{
+    if (batch_len)
+    {
+        fwrite(batch, 1, batch_len, manifest);
+        fflush(manifest);
+        batch_len = 0;
+    }
+    batch_time = time(NULL);
+}
+
+/**
+ * @brief Opens the manifest, a CSV file or, for a .jsonl or .json file, JSON lines. A new scan starts a new manifest,
+ *        a resumed one keeps its first `keep` bytes which are the rows written before the checkpoint.
+ *
+ * @param path The manifest file
+ * @param keep The bytes to keep, 0 to start over
+ * @return true if the manifest was opened
+ */
+bool manifest_open(const char *path, uint64_t keep)
+{
+    const char *ext = strrchr(path, '.');
+    format = ext && (strcmp(ext, ".jsonl") == 0 || strcmp(ext, ".json") == 0) ? MANIFEST_JSONL : MANIFEST_CSV;
+
+    if (keep && !truncate_file((char *)path, keep))
+    {
+        return false;
+    }
+    manifest = fopen(path, keep ? "ab" : "wb");
+    if (manifest == NULL)
+    {
+        return false;
+    }
+    batch = malloc(MANIFEST_BATCH + ROW_MAX);
+    CHECK_OR_EXIT(batch);
+    batch_len = 0;
+    batch_time = time(NULL);
+    if (!keep && format == MANIFEST_CSV)
+    {
+        fprintf(manifest, "%s\n", MANIFEST_HEADER);
+    }
+    return true;
+}
+
+/**
+ * @brief Keeps the rows of the scan in memory instead of writing them, until manifest_close
+ *
+ * @param rows Receives the rows
+ */
+void manifest_keep(manifest_rows *rows)
+{
+    kept = rows;
+}
+
+/**
+ * @brief Frees the strings of a row kept by manifest_keep
+ */
+void manifest_row_free(carve_record *row)
+{
+    free((char *)row->name);
+    free((char *)row->type);
+    free((char *)row->digest);
+    free((char *)row->duplicate_of);
+}
+
+/**
+ * @brief Frees the rows kept by manifest_keep
+ */
+void manifest_rows_free(manifest_rows *rows)
+{
+    for (size_t i = 0; i < rows->count; i++)
+    {
+        manifest_row_free(&rows->rows[i]);
+    }
+    free(rows->rows);
+    memset(rows, 0, sizeof(manifest_rows));
+}
+
+/**
+ * @brief Appends a copy of a row to the rows
+ */
+void manifest_rows_add(manifest_rows *rows, const carve_record *record)
+{
+    if (rows->count == rows->capacity)
+    {
+        rows->capacity = rows->capacity ? 2 * rows->capacity : 64;
+        rows->rows = realloc(rows->rows, rows->capacity * sizeof(carve_record));
+        CHECK_OR_EXIT(rows->rows);
+    }
+    carve_record *row = &rows->rows[rows->count++];
+    *row = *record;
+    row->name = strdup(record->name);
+    row->type = strdup(record->type);
+    row->digest = strdup(record->digest);
+    row->duplicate_of = record->duplicate_of ? strdup(record->duplicate_of) : NULL;
+    CHECK_OR_EXIT(row->name);
+    CHECK_OR_EXIT(row->type);
+    CHECK_OR_EXIT(row->digest);
+}
+
+/**
+ * @brief Writes a JSON string, quoted and escaped
+ */
+int json_string(char *out, size_t size, const char *value)
+{
+    if (value == NULL)
+    {
+        return snprintf(out, size, "null");
+    }
+    size_t n = 0;
+    out[n++] = '"';
+    for (; *value && n + 8 < size; value++)
+    {
+        if (*value == '"' || *value == '\\')
+        {
+            out[n++] = '\\';
+            out[n++] = *value;
+        }
+        else if ((unsigned char)*value < 0x20)
+        {
+            n += snprintf(out + n, size - n, "\\u%04x", *value);
+        }
+        else
+        {
+            out[n++] = *value;
+        }
+    }
+    out[n++] = '"';
+    out[n] = '\0';
+    return (int)n;
+}
+
+/**
+ * @brief Writes a CSV field as RFC 4180 has it: a value holding a comma, a quote or a line break is quoted and its
+ *        quotes are doubled, any other value is written as it is
+ */
+static int csv_string(char *out, size_t size, const char *value)
+{
+    if (value == NULL || strpbrk(value, ",\"\r\n") == NULL)
+    {
+        return snprintf(out, size, "%s", value ? value : "");
+    }
+    size_t n = 0;
+    out[n++] = '"';
+    for (; *value && n + 4 < size; value++)
+    {
+        if (*value == '"')
+        {
+            out[n++] = '"';
+        }
+        out[n++] = *value;
+    }
+    out[n++] = '"';
+    out[n] = '\0';
+    return (int)n;
+}
+
+/**
+ * @brief Writes the fields of a row as JSON, without the braces around them
+ *
+ * @return The length of the fields
+ */
+static int json_fields(char *out, const carve_record *record)
+{
+    char name[FILENAME_MAX + 64], duplicate_of[FILENAME_MAX + 64];
+    json_string(name, sizeof(name), record->name);
+    json_string(duplicate_of, sizeof(duplicate_of), record->duplicate_of);
+    int n = snprintf(out, ROW_MAX,
+                     "\"name\":%s,\"type\":\"%s\",\"start\":%" PRIu64 ",\"end\":%" PRIu64 ",\"size\":%" PRIu64
+                     ",\"hash\":\"%s\",\"status\":\"%s\",\"end_reason\":\"%s\",\"duplicate_of\":%s,\"error_offset\":",
+                     name, record->type, record->start, record->end, record->size, record->digest,
+                     status_names[record->status], reason_names[record->reason], duplicate_of);
+    n += record->error_offset < 0 ? snprintf(out + n, 8, "null")
+                                  : snprintf(out + n, 32, "%" PRId64, record->error_offset);
+    return n;
+}
+
+/**
+ * @brief Sends every row of the scan as a carve event of a daemon job as well, written and flushed right away
+ *
+ * @param stream The connection of the client, NULL to stop
+ * @param job The job the carves belong to
+ */
+void manifest_events(FILE *stream, int job)
+{
+    events = stream;
+    event_job = job;
+}
+
+/**
+ * @brief Adds the row of a finished carve. Rows are batched and appended together at MANIFEST_BATCH bytes or after
+ *        MANIFEST_BATCH_SECONDS, so a tool following the manifest sees the carves as they come without a write per row.
+ */
+void manifest_record(const carve_record *record)
+{
+    if (events)
+    {
+        char fields[ROW_MAX];
+        json_fields(fields, record);
+        fprintf(events, "{\"event\":\"carve\",\"job\":%d,%s}\n", event_job, fields);
+        fflush(events);
+    }
+    if (kept)
+    {
+        manifest_rows_add(kept, record);
+        return;
+    }
+    if (manifest == NULL)
+    {
+        return;
+    }
+
+    char *row = batch + batch_len;
+    if (format == MANIFEST_JSONL)
+    {
+        row[0] = '{';
+        batch_len += 1 + json_fields(row + 1, record);
+        batch_len += snprintf(batch + batch_len, 4, "}\n");
+    }
+    else
+    {
+        char name[FILENAME_MAX + 64], duplicate_of[FILENAME_MAX + 64];
+        csv_string(name, sizeof(name), record->name);
+        csv_string(duplicate_of, sizeof(duplicate_of), record->duplicate_of);
+        batch_len += snprintf(row, ROW_MAX, "%s,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%s,%s,%s,%s,",
+                              name, record->type, record->start, record->end, record->size, record->digest,
+                              status_names[record->status], reason_names[record->reason], duplicate_of);
+        batch_len += record->error_offset < 0 ? snprintf(batch + batch_len, 8, "\n")
+                                              : snprintf(batch + batch_len, 32, "%" PRId64 "\n", record->error_offset);
+    }
+
+    if (batch_len >= MANIFEST_BATCH || time(NULL) - batch_time >= MANIFEST_BATCH_SECONDS)
+    {
+        flush_batch();
+    }
+}
+
+/**
+ * @brief Appends the batched rows once MANIFEST_BATCH_SECONDS passed, called by the scan as it reads so the last rows
+ *        before a stretch without carves do not wait for the next carve or checkpoint
+ */
+void manifest_tick()
+{
+    if (manifest && batch_len && time(NULL) - batch_time >= MANIFEST_BATCH_SECONDS)
+    {
+        flush_batch();
+    }
+}
+
+/**
+ * @brief Flushes the manifest and returns its size, which is what a checkpoint keeps on resume
+ */
+uint64_t manifest_size()
+{
+    if (manifest == NULL)
+    {
+        return 0;
+    }
+    flush_batch();
+    return get_file_size(manifest);
+}
+
+void manifest_close()
+{
+    if (manifest)
+    {
+        flush_batch();
+        fclose(manifest);
+        manifest = NULL;
+    }
+    free(batch);
+    batch = NULL;
+    kept = NULL;
+}
+
+/**
+ * @brief Finds a field of a JSON line written by manifest_record, strings are unescaped in place
+ *
+ * @return The value, NULL for null or a missing field
+ */
+static char *json_field(char *line, const char *key)
+{
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    char *value = strstr(line, pattern);
+    if (value == NULL)
+    {
+        return NULL;
+    }
+    value += strlen(pattern);
+    if (*value != '"')
+    {
+        return strncmp(value, "null", 4) == 0 ? NULL : value; // A number, strtoull stops at the comma
+    }
+
+    // The escapes are never shorter than what they stand for, so the value is decoded over itself
+    char *out = ++value, *in = value;
+    for (; *in && *in != '"'; in++)
+    {
+        if (*in != '\\' || !in[1])
+        {
+            *out++ = *in;
+            continue;
+        }
+        in++;
+        switch (*in)
+        {
+        case 'b':
+            *out++ = '\b';
+            break;
+        case 'f':
+            *out++ = '\f';
+            break;
+        case 'n':
+            *out++ = '\n';
+            break;
+        case 'r':
+            *out++ = '\r';
+            break;
+        case 't':
+            *out++ = '\t';
+            break;
+        case 'u': // \u00XX for a control character, the other code points are written as UTF-8
+            if (isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2]) && isxdigit((unsigned char)in[3]) &&
+                isxdigit((unsigned char)in[4]))
+            {
+                char digits[5] = {in[1], in[2], in[3], in[4], '\0'};
+                unsigned long code = strtoul(digits, NULL, 16);
+                in += 4;
+                if (code < 0x80)
+                {
+                    *out++ = (char)code;
+                }
+                else if (code < 0x800)
+                {
+                    *out++ = (char)(0xC0 | code >> 6);
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                }
+                else
+                {
+                    *out++ = (char)(0xE0 | code >> 12);
+                    *out++ = (char)(0x80 | (code >> 6 & 0x3F));
+                    *out++ = (char)(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            *out++ = *in;
+            break;
+        default: // \" \\ and \/
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return value;
+}
+
+/**
+ * @brief Cuts the next field of a CSV row in place, a quoted field is unquoted and its doubled quotes undone
+ *
+ * @param cursor The start of the field, moved to the next one, NULL after the last field of the row
+ * @return The field
+ */
+static char *csv_field(char **cursor)
+{
+    char *field = *cursor;
+    if (*field != '"')
+    {
+        *cursor = strchr(field, ',');
+        if (*cursor)
+        {
+            *(*cursor)++ = '\0';
+        }
+        return field;
+    }
+
+    char *out = field, *in = field + 1;
+    for (; *in; in++)
+    {
+        if (*in == '"' && *++in != '"')
+        {
+            break; // The closing quote
+        }
+        *out++ = *in;
+    }
+    *cursor = *in == ',' ? in + 1 : NULL;
+    *out = '\0';
+    return field;
+}
+
+/**
+ * @brief Whether a CSV row ends inside a quoted field, i.e. the field holds a line break and the row goes on
+ */
+static bool csv_open_quote(const char *line)
+{
+    bool open = false;
+    for (; *line; line++)
+    {
+        open ^= *line == '"';
+    }
+    return open;
+}
+
+/**
+ * @brief Calls `visit` for every row of an existing manifest
+ *
+ * @return false if the manifest could not be read
+ */
+bool manifest_each(const char *path, void (*visit)(const char *name, uint64_t size, const char *digest, const char *duplicate_of))
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    char line[ROW_MAX];
+    while (fgets(line, sizeof(line), file))
+    {
+        size_t length = strlen(line);
+        while (line[0] != '{' && csv_open_quote(line) && length + 1 < sizeof(line) &&
+               fgets(line + length, (int)(sizeof(line) - length), file))
+        {
+            length += strlen(line + length);
+        }
+        while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        {
+            line[--length] = '\0';
+        }
+        if (line[0] == '{')
+        {
+            // The fields are read back to front, unescaping a string overwrites the line after it
+            char *duplicate_of = json_field(line, "duplicate_of");
+            char *digest = json_field(line, "hash");
+            char *size = json_field(line, "size");
+            char *name = json_field(line, "name");
+            if (name && size && digest)
+            {
+                visit(name, strtoull(size, NULL, 10), digest, duplicate_of);
+            }
+            continue;
+        }
+
+        char *fields[10] = {0}; // A manifest from before the error_offset column has 9
+        char *cursor = line;
+        for (int i = 0; i < 10 && cursor; i++)
+        {
+            fields[i] = csv_field(&cursor);
+        }
+        if (fields[8] == NULL || strcmp(fields[0], "name") == 0)
+        {
+            continue; // The header or a torn row
+        }
+        visit(fields[0], strtoull(fields[4], NULL, 10), fields[5], fields[8][0] ? fields[8] : NULL);
+    }
+    fclose(file);
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include "utils.h"
+
+// The columns of the manifest, one row per carve
+#define MANIFEST_HEADER "name,type,start,end,size,hash,status,end_reason,duplicate_of,error_offset"
+
+// The duplicate_of column of a carve that matched the known hash set
+#define KNOWN_MARK "known"
+
+// The rows kept back before they are appended to the manifest together, and the seconds they are kept at most
+#define MANIFEST_BATCH (64 * 1024)
+#define MANIFEST_BATCH_SECONDS 1
+
+// Manifest formats, picked from the extension of the manifest file
+#define MANIFEST_CSV 0   // A header line and comma separated rows
+#define MANIFEST_JSONL 1 // One JSON object per line, for a .jsonl or .json file
+
+// Validation status of a carve
+enum
+{
+    STATUS_UNCHECKED, // Ended on a trailer, its type has no validator
+    STATUS_VALID,     // Its structure checked out
+    STATUS_TRUNCATED, // Ended before its structure was complete
+    STATUS_CORRUPT    // Its structure is broken
+};
+
+// Why a carve ended
+enum
+{
+    END_TRAILER, // Its trailer was found
+    END_HEADER,  // The header of the next carve cut it short
+    END_INPUT    // The input ended
+};
+
+// The row of one carve
+typedef struct carve_record
+{
+    const char *name;         // The output file, or the file it would have been for a dropped carve
+    const char *type;         // The file type
+    uint64_t start;           // The offset of its first byte in the image or drive
+    uint64_t end;             // The offset just past its last byte in the image or drive
+    uint64_t size;            // Its size in bytes
+    const char *digest;       // Its content hash
+    int status;               // One of the STATUS_* values
+    int reason;               // One of the END_* values
+    const char *duplicate_of; // The output file with the same content, KNOWN_MARK for a known file, NULL if unique
+    int64_t error_offset;     // The offset in the carve where its structure broke or ended early, -1 if none
+} carve_record;
+
+// The rows of a scan kept in memory, for a chunk of a batch image whose rows are merged with those of the other chunks
+typedef struct manifest_rows
+{
+    carve_record *rows; // The rows, their strings are copies owned by them
+    size_t count;       // Their number
+    size_t capacity;    // The rows allocated
+} manifest_rows;
+
+bool manifest_open(const char *path, uint64_t keep);
+void manifest_keep(manifest_rows *rows);
+void manifest_row_free(carve_record *row);
+void manifest_rows_add(manifest_rows *rows, const carve_record *record);
+void manifest_rows_free(manifest_rows *rows);
+void manifest_events(FILE *stream, int job);
+void manifest_record(const carve_record *record);
+void manifest_tick();
+uint64_t manifest_size();
+void manifest_close();
+int json_string(char *out, size_t size, const char *value);
+bool manifest_each(const char *path, void (*visit)(const char *name, uint64_t size, const char *digest, const char *duplicate_of));
+
+#endif //__MANIFEST_H__
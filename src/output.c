@@ -0,0 +1,615 @@
+#include "output.h"
+#include "log.h"
+#include "manifest.h"
+#include "knownhash.h"
+#include "validate.h"
+#include <inttypes.h>
+#include <pthread.h>
+
+// The carve being written. Its bytes are staged in memory and hashed on the way in, so a duplicate
+// is dropped before anything reaches the disk. Carves larger than STAGE_LIMIT are spilled to their file
+// a piece at a time, and the writer threads do the writing while the scan goes on.
+typedef struct output
+{
+    bool open;                   // Whether a carve is being written
+    char filename[FILENAME_MAX]; // Its output file
+    char type[8];                // Its file type
+    byte_t *staged;              // The bytes not handed to the writers yet, NULL after a spill until the next write
+    size_t staged_len;           // Their number
+    size_t staged_cap;           // The allocated size of `staged`, kept for the next buffer after a spill
+    bool spilled;                // Whether a piece was handed to the writers, the file exists or is about to
+    uint64_t written;            // The bytes handed to the writers, the offset of the next piece
+    uint64_t size;               // The total size of the carve so far
+    uint64_t start;              // The offset of its first byte in the scanned stream
+    hash_state hash;             // The running content hash
+    validator check;             // The structure check of its type, fed the bytes as they leave the stage
+} output;
+
+// A finished carve waiting to be written or dropped. A carve checked whole (a JPEG test-decode) waits for the
+// validation workers, and the carves after it wait behind it, so they are written and listed in the manifest in order.
+typedef struct closed_carve
+{
+    char filename[FILENAME_MAX]; // Its output file
+    char type[8];                // Its file type
+    byte_t *staged;              // Its last bytes, not handed to the writers yet
+    size_t staged_len;           // Their number
+    bool spilled;                // Whether pieces of it were handed to the writers
+    uint64_t size;               // Its size
+    uint64_t start;              // The offset of its first byte in the scanned stream
+    char digest[DIGEST_MAX];     // Its content hash
+    int reason;                  // Why it ended, one of the END_* values
+    int status;                  // Its validation status, one of the STATUS_* values
+    int64_t error_offset;        // The offset of the first error in it, -1 if none
+    bool deferred;               // Whether `job` checks it on the validation workers
+    validation_job job;          // The check, the workers read `staged` until it is done
+    struct closed_carve *next;   // The carve finished after it
+} closed_carve;
+
+// A unique carve in the deduplication index
+typedef struct dedup_entry
+{
+    char digest[DIGEST_MAX];     // Its content hash, empty for a free slot
+    uint64_t size;               // Its size
+    char *name;                  // Its output file, owned by the index
+} dedup_entry;
+
+// The deduplication index, a scan has one of its own unless the regions of a disk share one
+struct dedup_index
+{
+    dedup_entry *slots;   // Open addressing table of the unique carves
+    size_t capacity;      // The number of slots, a power of two
+    size_t count;         // The number of used slots
+    bool shared;          // Whether the scans of several threads use it
+    pthread_mutex_t lock; // Guards a shared index
+};
+
+static THREAD_LOCAL output current = {0};            // The carve being written
+static THREAD_LOCAL bool deduplicate = false;        // Whether carves with already seen content are dropped
+static THREAD_LOCAL bool drop_corrupt = false;       // Whether carves with a broken structure are dropped
+static THREAD_LOCAL int algorithm = HASH_XXH3;       // The content hash algorithm
+static THREAD_LOCAL source *scanned = NULL;          // The source being scanned, maps carve offsets to the input
+static THREAD_LOCAL dedup_index own_index = {0};     // The index of the scan when it shares none
+static THREAD_LOCAL dedup_index *active_index = NULL; // The index in use, own_index or a shared one
+static THREAD_LOCAL closed_carve *closed_head = NULL; // The oldest finished carve not written yet
+static THREAD_LOCAL closed_carve *closed_tail = NULL; // The newest one
+static THREAD_LOCAL size_t closed_count = 0;         // Their number
+static THREAD_LOCAL size_t closed_bytes = 0;         // Their staged bytes
+
+/**
+ * @brief Sets up the writer
+ *
+ * @param dedup Whether carves with the same content as an earlier carve are dropped
+ * @param skip_corrupt Whether carves whose structure is broken (e.g. a PNG chunk CRC mismatch) are dropped
+ * @param hash_algorithm HASH_XXH3 or HASH_SHA256
+ * @param input The source being scanned, the manifest gives the offsets of the carves in the image or drive under it
+ * @param shared The index shared with the other scans of the disk, NULL to deduplicate within this scan only
+ */
+void output_init(bool dedup, bool skip_corrupt, int hash_algorithm, source *input, dedup_index *shared)
+{
+    deduplicate = dedup;
+    drop_corrupt = skip_corrupt;
+    algorithm = hash_algorithm;
+    scanned = input;
+    active_index = shared ? shared : &own_index;
+    writer_begin();
+}
+
+/**
+ * @brief Creates an index for the scans of several threads, a carve is then dropped when any of them wrote the same
+ *        content. Which of the copies is kept depends on which scan finishes it first.
+ */
+dedup_index *dedup_index_create()
+{
+    dedup_index *index = calloc(1, sizeof(dedup_index));
+    CHECK_OR_EXIT(index);
+    index->shared = true;
+    pthread_mutex_init(&index->lock, NULL);
+    return index;
+}
+
+/**
+ * @brief Frees the entries of an index
+ */
+static void index_clear(dedup_index *index)
+{
+    for (size_t i = 0; i < index->capacity; i++)
+    {
+        free(index->slots[i].name);
+    }
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = index->count = 0;
+}
+
+/**
+ * @brief Frees an index made by dedup_index_create once its scans are done
+ */
+void dedup_index_free(dedup_index *index)
+{
+    index_clear(index);
+    pthread_mutex_destroy(&index->lock);
+    free(index);
+}
+
+static void index_lock(dedup_index *index)
+{
+    if (index->shared)
+    {
+        pthread_mutex_lock(&index->lock);
+    }
+}
+
+static void index_unlock(dedup_index *index)
+{
+    if (index->shared)
+    {
+        pthread_mutex_unlock(&index->lock);
+    }
+}
+
+/**
+ * @brief Returns the first slot of the index that is free or holds the carve
+ */
+static dedup_entry *index_find(dedup_index *index, const char *digest, uint64_t size)
+{
+    char prefix[17] = {0}; // The first 64 bits of the digest are as good as any hash of it
+    strncpy(prefix, digest, 16);
+    uint64_t key = strtoull(prefix, NULL, 16) ^ (size * 0x9e3779b97f4a7c15ULL);
+
+    for (size_t i = key & (index->capacity - 1);; i = (i + 1) & (index->capacity - 1))
+    {
+        dedup_entry *entry = &index->slots[i];
+        if (entry->digest[0] == '\0' || (entry->size == size && strcmp(entry->digest, digest) == 0))
+        {
+            return entry;
+        }
+    }
+}
+
+/**
+ * @brief Looks a carve up in the index, the caller holds its lock
+ *
+ * @return The output file with the same content, NULL if there is none. It stays valid as long as the index.
+ */
+static const char *index_lookup(dedup_index *index, const char *digest, uint64_t size)
+{
+    if (index->capacity == 0)
+    {
+        return NULL;
+    }
+    dedup_entry *entry = index_find(index, digest, size);
+    return entry->digest[0] ? entry->name : NULL;
+}
+
+/**
+ * @brief Adds a unique carve to the deduplication index, growing it at half load. The caller holds its lock.
+ */
+static void index_insert(dedup_index *index, const char *digest, uint64_t size, const char *name)
+{
+    if ((index->count + 1) * 2 > index->capacity)
+    {
+        dedup_entry *old = index->slots;
+        size_t old_capacity = index->capacity;
+        index->capacity = index->capacity ? index->capacity * 2 : 1024;
+        index->slots = calloc(index->capacity, sizeof(dedup_entry));
+        CHECK_OR_EXIT(index->slots);
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old[i].digest[0])
+            {
+                *index_find(index, old[i].digest, old[i].size) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    dedup_entry *entry = index_find(index, digest, size);
+    if (entry->digest[0] == '\0')
+    {
+        strcpy(entry->digest, digest);
+        entry->size = size;
+        entry->name = strdup(name);
+        CHECK_OR_EXIT(entry->name);
+        index->count++;
+    }
+}
+
+/**
+ * @brief Hands the staged bytes to the writers, the staging buffer goes with them
+ *
+ * @param final_size The size of the carve when these are its last bytes, -1 otherwise
+ */
+static void spill(int64_t final_size)
+{
+    writer_submit(current.filename, current.written, current.staged, current.staged_len, final_size);
+    current.written += current.staged_len;
+    current.spilled = true;
+    current.staged = NULL;
+    current.staged_len = 0;
+}
+
+/**
+ * @brief Starts a new carve. A carve still open is finished first, as it is when another header cuts it short.
+ *
+ * @param filename The output file of the carve
+ * @param type The file type
+ * @param start The offset of the header in the scanned stream
+ */
+void output_open(char *filename, char *type, uint64_t start)
+{
+    output_close(END_HEADER);
+    current.open = true;
+    current.start = start;
+    strncpy(current.filename, filename, FILENAME_MAX - 1);
+    strncpy(current.type, type, sizeof(current.type) - 1);
+    current.staged_len = 0;
+    current.size = 0;
+    current.spilled = false;
+    current.written = 0;
+    hash_init(&current.hash, algorithm);
+    validate_begin(&current.check, current.type);
+}
+
+/**
+ * @brief Appends bytes to the carve, nothing happens when no carve is open
+ */
+void output_write(const byte_t *data, size_t length)
+{
+    if (!current.open)
+    {
+        return;
+    }
+
+    hash_update(&current.hash, data, length);
+    current.size += length;
+
+    if (current.staged == NULL)
+    {
+        current.staged_cap = current.staged_cap ? current.staged_cap : 64 * 1024;
+        current.staged = malloc(current.staged_cap);
+        CHECK_OR_EXIT(current.staged);
+    }
+    if (current.staged_len + length > current.staged_cap)
+    {
+        size_t capacity = current.staged_cap;
+        while (capacity < current.staged_len + length && capacity < STAGE_LIMIT)
+        {
+            capacity *= 2;
+        }
+        if (capacity > current.staged_cap)
+        {
+            current.staged = realloc(current.staged, capacity);
+            CHECK_OR_EXIT(current.staged);
+            current.staged_cap = capacity;
+        }
+        if (current.staged_len + length > current.staged_cap)
+        {
+            validate_update(&current.check, current.staged, current.staged_len);
+            spill(-1);
+            current.staged = malloc(current.staged_cap);
+            CHECK_OR_EXIT(current.staged);
+        }
+    }
+
+    if (length > current.staged_cap)
+    {
+        // Larger than the stage, handed to the writers as a piece of its own
+        byte_t *piece = malloc(length);
+        CHECK_OR_EXIT(piece);
+        memcpy(piece, data, length);
+        validate_update(&current.check, piece, length);
+        writer_submit(current.filename, current.written, piece, length, -1);
+        current.written += length;
+        current.spilled = true;
+        return;
+    }
+    memcpy(current.staged + current.staged_len, data, length);
+    current.staged_len += length;
+}
+
+/**
+ * @brief Writes out or drops a finished carve: a carve in the known hash set, with already seen content or, with
+ *        skip_corrupt, with a broken structure is dropped, anything else is written out. Either way it gets its row
+ *        in the manifest. Frees the carve.
+ */
+static void finish(closed_carve *carve)
+{
+    if (carve->deferred)
+    {
+        validate_wait(&carve->job);
+        carve->status = carve->job.status;
+        carve->error_offset = carve->job.error_offset;
+    }
+
+    bool known = known_contains(carve->digest);
+    bool corrupt = drop_corrupt && carve->status == STATUS_CORRUPT;
+    // The lookup and the insert of a unique carve are one step, so two scans sharing the index keep only one copy
+    const char *original = NULL;
+    if (!known && !corrupt && deduplicate)
+    {
+        index_lock(active_index);
+        original = index_lookup(active_index, carve->digest, carve->size);
+        if (original == NULL)
+        {
+            index_insert(active_index, carve->digest, carve->size, carve->filename);
+        }
+        index_unlock(active_index);
+    }
+
+    if (known || corrupt || original)
+    {
+        if (carve->spilled)
+        {
+            writer_drain(); // The spilled pieces must be on disk before the file goes
+        }
+        remove(carve->filename); // Also drops a spilled part or the part written before a checkpoint
+        free(carve->staged);
+        if (known)
+            log_msg(LOG_VERBOSE, "%s is a known file\n", carve->filename);
+        else if (corrupt)
+            log_msg(LOG_VERBOSE, "%s is corrupt\n", carve->filename);
+        else
+            log_msg(LOG_VERBOSE, "%s is a duplicate of %s\n", carve->filename, original);
+    }
+    else
+    {
+        // The last piece, even an empty one, so the file exists at its size
+        writer_submit(carve->filename, carve->size - carve->staged_len, carve->staged, carve->staged_len, (int64_t)carve->size);
+    }
+
+    // A fragmented carve (e.g. over the unallocated extents) spans more than [start, end) of the input
+    carve_record record = {.name = carve->filename, .type = carve->type, .size = carve->size, .digest = carve->digest,
+                           .start = source_origin(scanned, carve->start),
+                           .end = carve->size ? source_origin(scanned, carve->start + carve->size - 1) + 1 : source_origin(scanned, carve->start),
+                           .status = carve->status,
+                           .reason = carve->reason,
+                           .duplicate_of = known ? KNOWN_MARK : original,
+                           .error_offset = carve->error_offset};
+    manifest_record(&record);
+    free(carve);
+}
+
+/**
+ * @brief Reads the spilled part of a finished carve back in front of its staged bytes, so it can be checked whole.
+ *        The whole carve is then written again as its last piece.
+ *
+ * @return false if the file could not be read, the carve is left as it was
+ */
+static bool reload(closed_carve *carve)
+{
+    uint64_t written = carve->size - carve->staged_len;
+    byte_t *whole = malloc(carve->size ? carve->size : 1);
+    CHECK_OR_EXIT(whole);
+    writer_drain(); // The spilled pieces must be on disk before they are read
+    FILE *file = fopen(carve->filename, "rb");
+    bool ok = file && fread(whole, 1, written, file) == written;
+    if (file)
+    {
+        fclose(file);
+    }
+    if (!ok)
+    {
+        free(whole);
+        return false;
+    }
+    memcpy(whole + written, carve->staged, carve->staged_len);
+    free(carve->staged);
+    carve->staged = whole;
+    carve->staged_len = carve->size;
+    return true;
+}
+
+/**
+ * @brief Finishes the oldest finished carve, waiting for its validation
+ */
+static void finish_oldest()
+{
+    closed_carve *carve = closed_head;
+    closed_head = carve->next;
+    closed_tail = closed_head ? closed_tail : NULL;
+    closed_count--;
+    closed_bytes -= carve->staged_len;
+    finish(carve);
+}
+
+/**
+ * @brief Finishes the oldest carves in order, those already checked and, with `all`, the rest after waiting for them
+ */
+static void finish_closed(bool all)
+{
+    while (closed_head && (all || !closed_head->deferred || validate_ready(&closed_head->job)))
+    {
+        finish_oldest();
+    }
+}
+
+/**
+ * @brief Finishes the carve. A carve checked whole is handed to the validation workers and written once they are
+ *        done with it, the scan only waits for them when VALIDATION_BACKLOG carves or VALIDATION_MAX_BYTES are behind.
+ *
+ * @param reason Why the carve ended, one of the END_* values
+ */
+void output_close(int reason)
+{
+    if (!current.open)
+    {
+        return;
+    }
+    current.open = false;
+
+    closed_carve *carve = malloc(sizeof(closed_carve));
+    CHECK_OR_EXIT(carve);
+    memcpy(carve->filename, current.filename, FILENAME_MAX);
+    memcpy(carve->type, current.type, sizeof(carve->type));
+    hash_final(&current.hash, carve->digest);
+    validate_update(&current.check, current.staged, current.staged_len);
+    carve->status = validate_end(&current.check, reason, &carve->error_offset);
+    carve->staged = current.staged; // The stage goes with the carve as it does with a spill
+    carve->staged_len = current.staged_len;
+    carve->spilled = current.spilled;
+    carve->size = current.size;
+    carve->start = current.start;
+    carve->reason = reason;
+    carve->next = NULL;
+    current.staged = NULL;
+    current.staged_len = 0;
+
+    // A carve spilled before its end (at a checkpoint, or larger than the stage) is read back to be checked whole,
+    // unless it is too large to hold, then it keeps the status it got while staged
+    carve->deferred = validate_deferred(&current.check) &&
+                      (!carve->spilled || (carve->size <= VALIDATION_MAX_BYTES && reload(carve)));
+    if (carve->deferred)
+    {
+        validate_submit(&carve->job, &current.check, carve->staged, carve->staged_len);
+    }
+
+    if (closed_tail)
+        closed_tail->next = carve;
+    else
+        closed_head = carve;
+    closed_tail = carve;
+    closed_count++;
+    closed_bytes += carve->staged_len;
+
+    finish_closed(false);
+    while (closed_count > VALIDATION_BACKLOG || (closed_count > 1 && closed_bytes > VALIDATION_MAX_BYTES))
+    {
+        finish_oldest();
+    }
+}
+
+/**
+ * @brief Writes the staged part of the carve to its file and waits for the writers, so the disk matches the scan
+ *        position, used for checkpoints
+ *
+ * @param size Receives the size of the open carve, 0 if none
+ * @return false if a carve of the scan could not be written, a checkpoint past it would lose it
+ */
+bool output_sync(uint64_t *size)
+{
+    if (current.open && (current.staged_len || !current.spilled))
+    {
+        validate_update(&current.check, current.staged, current.staged_len);
+        spill(-1);
+    }
+    finish_closed(true);
+    *size = current.open ? current.size : 0;
+    return writer_drain(); // Also the carves finished before it
+}
+
+/**
+ * @brief Finishes the open carve and the carves waiting for their validation and waits for the writers, at the end
+ *        of the input
+ *
+ * @return false if a carve of the scan could not be written
+ */
+bool output_flush()
+{
+    output_close(END_INPUT);
+    finish_closed(true);
+    return writer_drain();
+}
+
+/**
+ * @brief Maps an offset in the scanned stream to the image or drive under it, e.g. for naming a carve after it
+ */
+uint64_t output_origin(uint64_t offset)
+{
+    return scanned ? source_origin(scanned, offset) : offset;
+}
+
+/**
+ * @brief Reopens a carve that was in progress at a checkpoint, its first `size` bytes are already on disk. A file
+ *        shorter than that lost its end in a crash, it is not extended with zeros.
+ *
+ * @param filename The output file of the carve
+ * @param start The offset of its header in the scanned stream
+ * @param size The size of the carve at the checkpoint
+ * @return true if the carve was reopened
+ */
+bool output_resume(char *filename, uint64_t start, uint64_t size)
+{
+    FILE *file = fopen(filename, "rb");
+    uint64_t on_disk = file ? get_file_size(file) : 0;
+    if (file)
+    {
+        fclose(file);
+    }
+    if (on_disk < size)
+    {
+        log_msg(LOG_ERROR, "'%s' holds %" PRIu64 " of the %" PRIu64 " bytes of the checkpoint, its end was lost\n",
+                filename, on_disk, size);
+        return false;
+    }
+    if (!truncate_file(filename, size))
+    {
+        return false;
+    }
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    const char *ext = strrchr(filename, '.');
+    output_open(filename, ext ? (char *)ext + 1 : "", start);
+
+    // Rebuilds the hash from what is on disk
+    byte_t block[64 * 1024];
+    size_t n;
+    while ((n = fread(block, 1, sizeof(block), file)) > 0)
+    {
+        hash_update(&current.hash, block, n);
+        validate_update(&current.check, block, n);
+        current.size += n;
+    }
+    fclose(file);
+
+    current.written = current.size;
+    current.spilled = true;
+    return true;
+}
+
+/**
+ * @brief Adds a carve of an earlier run to the deduplication index, used with manifest_each on resume
+ */
+void output_remember(const char *name, uint64_t size, const char *digest, const char *duplicate_of)
+{
+    if (deduplicate && duplicate_of == NULL) // Neither a duplicate nor KNOWN_MARK
+    {
+        index_lock(active_index);
+        index_insert(active_index, digest, size, name);
+        index_unlock(active_index);
+    }
+}
+
+/**
+ * @brief Looks a carve up in the deduplication index, used with output_remember to deduplicate the chunks of a batch image
+ *
+ * @return The output file with the same content, NULL if there is none
+ */
+const char *output_original(const char *digest, uint64_t size)
+{
+    if (!deduplicate)
+    {
+        return NULL;
+    }
+    index_lock(active_index);
+    const char *original = index_lookup(active_index, digest, size);
+    index_unlock(active_index);
+    return original;
+}
+
+/**
+ * @brief Finishes the open carve and frees the writer
+ */
+void output_shutdown()
+{
+    output_close(END_INPUT);
+    finish_closed(true);
+    free(current.staged);
+    current.staged = NULL;
+    current.staged_cap = 0;
+    index_clear(&own_index); // A shared index is freed by whoever created it
+    active_index = NULL;
+}
@@ -0,0 +1,43 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include "hash.h"
+#include "source.h"
+
+// The bytes of a carve kept in memory before it is spilled to its file
+#define STAGE_LIMIT (32 * 1024 * 1024)
+
+// The pieces of carves waiting for the writer threads, a power of two
+#define WRITER_SLOTS 256
+
+// The bytes waiting for the writer threads before the scan waits for them to catch up
+#define WRITER_MAX_BYTES (128 * 1024 * 1024)
+
+// The finished carves, and their bytes, waiting for their validation before the scan waits for the oldest one
+#define VALIDATION_BACKLOG 64
+#define VALIDATION_MAX_BYTES (256 * 1024 * 1024)
+
+// A deduplication index, shared by the scans of the regions of a disk
+typedef struct dedup_index dedup_index;
+
+void output_init(bool dedup, bool skip_corrupt, int hash_algorithm, source *input, dedup_index *shared);
+void output_open(char *filename, char *type, uint64_t start);
+void output_write(const byte_t *data, size_t length);
+void output_close(int reason);
+bool output_sync(uint64_t *size);
+bool output_flush();
+uint64_t output_origin(uint64_t offset);
+bool output_resume(char *filename, uint64_t start, uint64_t size);
+void output_remember(const char *name, uint64_t size, const char *digest, const char *duplicate_of);
+const char *output_original(const char *digest, uint64_t size);
+void output_shutdown();
+dedup_index *dedup_index_create();
+void dedup_index_free(dedup_index *index);
+
+void writer_init(int threads);
+void writer_submit(const char *filename, uint64_t offset, byte_t *data, size_t length, int64_t final_size);
+void writer_begin();
+bool writer_drain();
+bool writer_shutdown();
+
+#endif //__OUTPUT_H__
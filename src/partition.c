@@ -0,0 +1,229 @@
+#include "partition.h"
+
+// The most logical partitions followed in an extended partition, guards against loops in the chain
+#define MAX_LOGICAL 128
+
+static uint32_t le32(const byte_t *p)
+{
+    return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const byte_t *p)
+{
+    return (uint64_t)le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+/**
+ * @brief Reads `length` bytes at `offset` of the disk
+ */
+static bool read_at(source *disk, uint64_t offset, byte_t *data, size_t length)
+{
+    return source_seek(disk, offset) && source_read(disk, data, length) == length;
+}
+
+/**
+ * @brief Appends a partition to the list
+ */
+static void add_partition(region **regions, int *count, int *capacity, uint64_t offset, uint64_t length, const char *type)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 16;
+        *regions = realloc(*regions, *capacity * sizeof(region));
+        CHECK_OR_EXIT(*regions);
+    }
+    region *r = &(*regions)[(*count)++];
+    memset(r, 0, sizeof(region));
+    r->offset = offset;
+    r->length = length;
+    strncpy(r->type, type, sizeof(r->type) - 1);
+}
+
+/**
+ * @brief Whether a first sector is the boot sector of a filesystem rather than an MBR, both end in 55 AA
+ */
+static bool is_boot_sector(const byte_t *sector)
+{
+    return memcmp(sector + 3, "NTFS    ", 8) == 0 || memcmp(sector + 3, "EXFAT   ", 8) == 0 ||
+           ((sector[0] == 0xEB || sector[0] == 0xE9) && (memcmp(sector + 54, "FAT", 3) == 0 || memcmp(sector + 82, "FAT", 3) == 0));
+}
+
+static bool is_extended(byte_t type)
+{
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+/**
+ * @brief Lists the partitions of a GPT disk, whose header is in the second logical block
+ */
+static bool read_gpt(source *disk, uint32_t block_size, region **regions, int *count, int *capacity)
+{
+    byte_t header[512];
+    if (!read_at(disk, block_size, header, sizeof(header)) || memcmp(header, "EFI PART", 8) != 0)
+    {
+        return false;
+    }
+    uint64_t entries_lba = le64(header + 72);
+    uint32_t entry_count = le32(header + 80), entry_size = le32(header + 84);
+    if (entry_size < 128 || entry_size > 4096 || entry_count > 65536)
+    {
+        return false;
+    }
+
+    byte_t *entries = malloc((size_t)entry_count * entry_size);
+    CHECK_OR_EXIT(entries);
+    if (!read_at(disk, entries_lba * block_size, entries, (size_t)entry_count * entry_size))
+    {
+        free(entries);
+        return false;
+    }
+    for (uint32_t i = 0; i < entry_count; i++)
+    {
+        const byte_t *entry = entries + (size_t)i * entry_size;
+        static const byte_t unused[16] = {0};
+        uint64_t first = le64(entry + 32), last = le64(entry + 40);
+        if (memcmp(entry, unused, 16) == 0 || last < first)
+        {
+            continue;
+        }
+
+        // The name is UTF-16, anything outside of ASCII is replaced
+        char name[37] = {0};
+        for (int c = 0; c < 36 && (entry[56 + c * 2] || entry[57 + c * 2]); c++)
+        {
+            name[c] = entry[57 + c * 2] == 0 && entry[56 + c * 2] >= 0x20 && entry[56 + c * 2] < 0x7F ? (char)entry[56 + c * 2] : '?';
+        }
+        add_partition(regions, count, capacity, first * block_size, (last - first + 1) * block_size, name[0] ? name : "GPT");
+    }
+    free(entries);
+    return true;
+}
+
+/**
+ * @brief Lists the partitions of an MBR disk, following the chain of logical partitions in an extended one
+ */
+static bool read_mbr(source *disk, const byte_t *mbr, region **regions, int *count, int *capacity)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        const byte_t *entry = mbr + 446 + i * 16;
+        if (entry[0] != 0x00 && entry[0] != 0x80)
+        {
+            return false; // Not a partition table
+        }
+    }
+
+    char type[40];
+    for (int i = 0; i < 4; i++)
+    {
+        const byte_t *entry = mbr + 446 + i * 16;
+        uint64_t start = le32(entry + 8), sectors = le32(entry + 12);
+        if (entry[4] == 0 || sectors == 0)
+        {
+            continue;
+        }
+        if (!is_extended(entry[4]))
+        {
+            snprintf(type, sizeof(type), "MBR type 0x%02X", entry[4]);
+            add_partition(regions, count, capacity, start * SECTOR_SIZE, sectors * SECTOR_SIZE, type);
+            continue;
+        }
+
+        // Every EBR holds a logical partition relative to itself and a link relative to the extended partition
+        uint64_t ebr = start;
+        byte_t sector[SECTOR_SIZE];
+        for (int logical = 0; logical < MAX_LOGICAL && read_at(disk, ebr * SECTOR_SIZE, sector, SECTOR_SIZE); logical++)
+        {
+            if (sector[510] != 0x55 || sector[511] != 0xAA)
+            {
+                break;
+            }
+            const byte_t *part = sector + 446, *link = sector + 462;
+            if (part[4] && le32(part + 12))
+            {
+                snprintf(type, sizeof(type), "MBR type 0x%02X (logical)", part[4]);
+                add_partition(regions, count, capacity, (ebr + le32(part + 8)) * SECTOR_SIZE, (uint64_t)le32(part + 12) * SECTOR_SIZE, type);
+            }
+            if (!is_extended(link[4]) || le32(link + 8) == 0)
+            {
+                break;
+            }
+            ebr = start + le32(link + 8);
+        }
+    }
+    return true;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    const region *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/**
+ * @brief Reads the partition table of a disk (MBR with extended partitions, or GPT) and splits the disk into
+ *        its partitions and the gaps between them, which can hold deleted partitions. The source is left at offset 0.
+ *
+ * @param disk The source of the whole disk
+ * @param regions The place where the allocated array of regions in disk order is stored
+ * @return The number of regions, 0 if the disk has no partition table
+ */
+int partition_regions(source *disk, region **regions)
+{
+    *regions = NULL;
+    int count = 0, capacity = 0;
+    byte_t mbr[SECTOR_SIZE];
+    if (!read_at(disk, 0, mbr, SECTOR_SIZE) || mbr[510] != 0x55 || mbr[511] != 0xAA || is_boot_sector(mbr))
+    {
+        source_seek(disk, 0);
+        return 0;
+    }
+
+    // A protective MBR entry (type EE) hands over to the GPT, with 512 or 4096 byte logical blocks
+    bool gpt = false;
+    for (int i = 0; i < 4; i++)
+    {
+        gpt = gpt || mbr[446 + i * 16 + 4] == 0xEE;
+    }
+    bool found = gpt ? read_gpt(disk, 512, regions, &count, &capacity) || read_gpt(disk, 4096, regions, &count, &capacity)
+                     : read_mbr(disk, mbr, regions, &count, &capacity);
+    if (!found)
+    {
+        free(*regions);
+        *regions = NULL;
+        source_seek(disk, 0);
+        return 0;
+    }
+    qsort(*regions, count, sizeof(region), compare_offsets);
+
+    // Names the partitions in disk order and adds the gaps, the partition table itself is not a gap
+    region *partitions = *regions;
+    int partition_count = count;
+    *regions = NULL;
+    count = capacity = 0;
+    uint64_t end = SECTOR_SIZE;
+    int gaps = 0;
+    for (int i = 0; i <= partition_count; i++)
+    {
+        uint64_t next = i < partition_count ? partitions[i].offset : disk->size;
+        if (next > end && next - end >= MIN_GAP_SIZE)
+        {
+            add_partition(regions, &count, &capacity, end, next - end, "");
+            (*regions)[count - 1].is_gap = true;
+            snprintf((*regions)[count - 1].name, sizeof((*regions)[count - 1].name), "gap%d", ++gaps);
+        }
+        if (i == partition_count)
+        {
+            break;
+        }
+        add_partition(regions, &count, &capacity, partitions[i].offset, partitions[i].length, partitions[i].type);
+        snprintf((*regions)[count - 1].name, sizeof((*regions)[count - 1].name), "partition%d", i + 1);
+        if (partitions[i].offset + partitions[i].length > end)
+        {
+            end = partitions[i].offset + partitions[i].length;
+        }
+    }
+    free(partitions);
+    source_seek(disk, 0);
+    return count;
+}
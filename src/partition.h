@@ -0,0 +1,21 @@
+#ifndef __PARTITION_H__
+#define __PARTITION_H__
+
+#include "source.h"
+
+// Gaps between partitions smaller than this are alignment padding and are not scanned
+#define MIN_GAP_SIZE (64 * 1024)
+
+// A partition or the unpartitioned space between two, as found in the partition table
+typedef struct region
+{
+    char name[32];   // e.g. partition2 or gap1, also the output directory of its scan
+    char type[40];   // The partition type or GPT name, empty for a gap
+    uint64_t offset; // Its first byte
+    uint64_t length; // Its size in bytes
+    bool is_gap;     // Whether it is outside of every partition
+} region;
+
+int partition_regions(source *disk, region **regions);
+
+#endif //__PARTITION_H__
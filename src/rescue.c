@@ -0,0 +1,338 @@
+#include "source.h"
+#include "log.h"
+#include <inttypes.h>
+#include <time.h>
+
+// The first stretch skipped after an unreadable sector, doubled for every bad sector in a row
+#define RESCUE_MIN_SKIP (64 * 1024)
+
+// The longest stretch skipped at once
+#define RESCUE_MAX_SKIP (64 * 1024 * 1024)
+
+// The seconds a sector is retried for at most, a failing drive can take seconds per attempt
+#define RESCUE_RETRY_TIME 10
+
+// Status of the runs in the bad sector map, as in a ddrescue mapfile
+#define MAP_BAD '-'     // Read and failed
+#define MAP_SKIPPED '*' // Skipped over after a bad sector, never read
+
+// State of the rescue backend, a raw input whose read errors are worked around instead of ending the scan
+typedef struct rescue_state
+{
+    source *inner;       // The raw file, image or drive
+    int retries;         // The attempts at a sector in the ranges of `retry`
+    uint64_t skip;       // The stretch skipped after the next bad sector
+    uint64_t skip_until; // The end of the stretch being skipped, read as zeros
+    extent_list bad;     // The sectors that could not be read
+    extent_list skipped; // The stretches skipped over
+    extent_list retry;   // The ranges of an earlier map to read sector by sector, in order
+    size_t next_retry;   // The first range of `retry` not yet behind the reads
+    byte_t *sector;      // An aligned buffer of one sector, for unbuffered drives
+} rescue_state;
+
+// The rescue source of the scan running on this thread, its map is loaded and saved through it
+static THREAD_LOCAL source *current;
+
+/**
+ * @brief Reads at an offset of the inner source, seeking first when the last read did not end there
+ */
+static size_t read_inner(rescue_state *state, byte_t *data, uint64_t offset, size_t length)
+{
+    if (state->inner->position != offset && !source_seek(state->inner, offset))
+    {
+        return 0;
+    }
+    size_t n = source_read(state->inner, data, length);
+    if (n < length)
+    {
+        state->inner->position = UINT64_MAX; // Where a failed read left the inner source is unknown
+    }
+    return n;
+}
+
+/**
+ * @brief Reads a range a sector at a time so that only the unreadable sectors are lost, they are zero filled.
+ *        With one attempt per sector (the first pass) a bad sector ends the range and starts a skip, so a damaged
+ *        area costs a few failed reads instead of one per sector; the skipped area is recorded for the retry pass.
+ *
+ * @return The bytes of the range that were handled
+ */
+static size_t read_sectors(rescue_state *state, byte_t *data, uint64_t offset, size_t length, int attempts)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        uint64_t at = offset + done;
+        uint64_t sector = at - at % SECTOR_SIZE;
+        size_t piece = SECTOR_SIZE - (size_t)(at - sector);
+        piece = piece < length - done ? piece : length - done;
+        size_t whole = state->inner->size && sector + SECTOR_SIZE > state->inner->size ? (size_t)(state->inner->size - sector) : SECTOR_SIZE;
+
+        // Whole sectors into the aligned buffer, unbuffered drives take nothing else
+        bool read = false;
+        time_t start = time(NULL);
+        for (int attempt = 0; attempt < attempts && !read && (attempt == 0 || time(NULL) - start < RESCUE_RETRY_TIME); attempt++)
+        {
+            read = read_inner(state, state->sector, sector, whole) == whole;
+        }
+        if (read)
+        {
+            memcpy(data + done, state->sector + (at - sector), piece);
+            done += piece;
+            continue;
+        }
+
+        memset(data + done, 0, piece);
+        extent_add(&state->bad, at, piece);
+        done += piece;
+        if (attempts == 1)
+        {
+            log_msg(LOG_ERROR, "Unreadable sector at offset %" PRIu64 ", skipping %" PRIu64 " bytes\n", sector, state->skip);
+            state->skip_until = at + piece + state->skip;
+            state->skip = state->skip * 2 < RESCUE_MAX_SKIP ? state->skip * 2 : RESCUE_MAX_SKIP;
+            break;
+        }
+    }
+    return done;
+}
+
+/**
+ * @brief Returns the first range to retry that ends after `offset`, NULL when there is none
+ */
+static extent *find_retry(rescue_state *state, uint64_t offset)
+{
+    // Reads mostly move forward, a seek backwards starts the search over
+    if (state->next_retry && state->next_retry <= state->retry.count && offset < state->retry.items[state->next_retry - 1].offset)
+    {
+        state->next_retry = 0;
+    }
+    while (state->next_retry < state->retry.count &&
+           state->retry.items[state->next_retry].offset + state->retry.items[state->next_retry].length <= offset)
+    {
+        state->next_retry++;
+    }
+    return state->next_retry < state->retry.count ? &state->retry.items[state->next_retry] : NULL;
+}
+
+static size_t rescue_read(source *src, byte_t *data, size_t length)
+{
+    rescue_state *state = src->state;
+    uint64_t offset = src->position;
+    if (src->size)
+    {
+        length = offset >= src->size ? 0 : (src->size - offset < length ? (size_t)(src->size - offset) : length);
+    }
+
+    size_t done = 0;
+    while (done < length)
+    {
+        uint64_t at = offset + done;
+        size_t left = length - done;
+
+        // The ranges of the map are read sector by sector with retries, without skipping
+        extent *retry = find_retry(state, at);
+        if (retry && retry->offset <= at)
+        {
+            size_t span = retry->offset + retry->length - at < left ? (size_t)(retry->offset + retry->length - at) : left;
+            state->skip_until = 0;
+            done += read_sectors(state, data + done, at, span, state->retries);
+            continue;
+        }
+        size_t wanted = retry && retry->offset - at < left ? (size_t)(retry->offset - at) : left;
+
+        // The stretch after a bad sector is not read at all
+        if (at < state->skip_until)
+        {
+            size_t skipped = state->skip_until - at < wanted ? (size_t)(state->skip_until - at) : wanted;
+            memset(data + done, 0, skipped);
+            extent_add(&state->skipped, at, skipped);
+            done += skipped;
+            continue;
+        }
+
+        size_t n = read_inner(state, data + done, at, wanted);
+        done += n;
+        if (n == wanted)
+        {
+            state->skip = RESCUE_MIN_SKIP;
+            continue;
+        }
+        if (src->size == 0)
+        {
+            break; // Without a size a short read is the end of the input
+        }
+
+        // A read error, the request is read on in sectors up to the first bad one
+        done += read_sectors(state, data + done, at + n, wanted - n, 1);
+    }
+    src->failed = state->inner->failed;
+    return done;
+}
+
+static bool rescue_seek(source *src, uint64_t offset)
+{
+    rescue_state *state = src->state;
+    state->skip_until = 0;
+    return offset <= src->size || src->size == 0;
+}
+
+static void rescue_close(source *src)
+{
+    rescue_state *state = src->state;
+    if (current == src)
+    {
+        current = NULL;
+    }
+    source_close(state->inner);
+    free(state->bad.items);
+    free(state->skipped.items);
+    free(state->retry.items);
+    buffer_free(state->sector, SECTOR_SIZE);
+    free(state);
+}
+
+/**
+ * @brief Wraps a raw input so that read errors do not end or corrupt the scan, the way ddrescue reads a failing drive.
+ *        A failed read is split into sectors, the unreadable ones are zero filled and a growing stretch after each is
+ *        skipped, so a damaged area does not stall the scan. Both are recorded in a bad sector map (rescue_save)
+ *        whose ranges a later pass reads sector by sector with retries (rescue_load).
+ *
+ * @param inner The raw source, it must be seekable and is owned by the rescue source from now on
+ * @param retries The attempts at each sector of a range loaded from a map
+ * @return The rescue source, or `inner` itself when it cannot seek
+ */
+source *source_open_rescue(source *inner, int retries)
+{
+    if (inner->seek == NULL)
+    {
+        return inner;
+    }
+    rescue_state *state = calloc(1, sizeof(rescue_state));
+    source *src = calloc(1, sizeof(source));
+    CHECK_OR_EXIT(state);
+    CHECK_OR_EXIT(src);
+    state->inner = inner;
+    state->retries = retries;
+    state->skip = RESCUE_MIN_SKIP;
+    state->sector = buffer_alloc(SECTOR_SIZE);
+
+    src->size = inner->size;
+    src->read = rescue_read;
+    src->seek = rescue_seek;
+    src->close = rescue_close;
+    src->state = state;
+    src->position = inner->position;
+    current = src;
+    return src;
+}
+
+/**
+ * @brief Loads a bad sector map written by rescue_save into the rescue source of this thread's scan
+ *
+ * @param path The map
+ * @param retry Whether every range is read again sector by sector (a retry pass), otherwise the ranges before the
+ *              position recorded in the map are taken as already found and only the rest is retried (a resumed scan)
+ * @return true if the map was read, a missing map is an empty one
+ */
+bool rescue_load(const char *path, bool retry)
+{
+    if (current == NULL)
+    {
+        return true;
+    }
+    rescue_state *state = current->state;
+    FILE *map = fopen(path, "r");
+    if (map == NULL)
+    {
+        return true;
+    }
+
+    char line[256];
+    uint64_t position = retry ? 0 : UINT64_MAX;
+    while (fgets(line, sizeof(line), map))
+    {
+        uint64_t offset, length;
+        char status;
+        if (line[0] == '#')
+        {
+            if (!retry)
+            {
+                sscanf(line, "# position 0x%" SCNx64, &position);
+            }
+            continue;
+        }
+        if (sscanf(line, "0x%" SCNx64 " 0x%" SCNx64 " %c", &offset, &length, &status) != 3)
+        {
+            continue;
+        }
+        if (offset >= position)
+        {
+            extent_add(&state->retry, offset, length);
+        }
+        else
+        {
+            extent_add(status == MAP_BAD ? &state->bad : &state->skipped, offset, length);
+        }
+    }
+    fclose(map);
+    return true;
+}
+
+/**
+ * @brief Writes the bad sector map of this thread's scan: what could not be read so far and, for a pass that has not
+ *        finished, the ranges of the loaded map still ahead of it. Nothing is written when everything was read.
+ *
+ * @param path The map
+ * @param final Whether the scan is complete, a summary is then printed
+ * @return true if the map was written or is not needed
+ */
+bool rescue_save(const char *path, bool final)
+{
+    if (current == NULL)
+    {
+        return true;
+    }
+    rescue_state *state = current->state;
+    uint64_t position = current->position, bad = 0, skipped = 0;
+    size_t ahead = 0;
+    while (ahead < state->retry.count && state->retry.items[ahead].offset + state->retry.items[ahead].length <= position)
+    {
+        ahead++;
+    }
+    if (!state->bad.count && !state->skipped.count && ahead == state->retry.count)
+    {
+        remove(path);
+        return true;
+    }
+
+    FILE *map = fopen(path, "w");
+    if (map == NULL)
+    {
+        return false;
+    }
+    fprintf(map, "# Bad sector map, retried with --retry-bad\n# position 0x%08" PRIx64 "\n# offset length status\n", position);
+
+    // Both lists are in order, they are merged so the map is too
+    size_t b = 0, s = 0;
+    while (b < state->bad.count || s < state->skipped.count)
+    {
+        bool is_bad = s == state->skipped.count || (b < state->bad.count && state->bad.items[b].offset < state->skipped.items[s].offset);
+        extent *e = is_bad ? &state->bad.items[b++] : &state->skipped.items[s++];
+        fprintf(map, "0x%08" PRIx64 "  0x%08" PRIx64 "  %c\n", e->offset, e->length, is_bad ? MAP_BAD : MAP_SKIPPED);
+        *(is_bad ? &bad : &skipped) += e->length;
+    }
+    for (; ahead < state->retry.count; ahead++)
+    {
+        // A range cut by the position is written from the position on, the part before it was read again already
+        extent e = state->retry.items[ahead];
+        uint64_t start = e.offset > position ? e.offset : position;
+        fprintf(map, "0x%08" PRIx64 "  0x%08" PRIx64 "  %c\n", start, e.offset + e.length - start, MAP_SKIPPED);
+    }
+    fclose(map);
+
+    if (final)
+    {
+        log_msg(LOG_ERROR, "%" PRIu64 " bytes could not be read and %" PRIu64 " were skipped, see '%s'\n", bad, skipped, path);
+    }
+    return true;
+}
@@ -0,0 +1,409 @@
+#include "scan.h"
+#include "carve.h"
+#include "checkpoint.h"
+#include "log.h"
+#include "manifest.h"
+#include "output.h"
+#include "source.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+// The jobs shared by the workers of scan_all
+typedef struct job_queue
+{
+    cl_args *args;        // The command line args
+    scan_job *jobs;       // The jobs, largest first
+    int count;            // Their number
+    int next;             // The next job to hand out
+    pthread_mutex_t lock; // Guards `next`
+} job_queue;
+
+/**
+ * @brief Places a file of the job in its directory, the directory part of `file` is dropped
+ *
+ * @return false if the path is longer than FILENAME_MAX
+ */
+bool job_path(const scan_job *job, const char *file, char path[FILENAME_MAX])
+{
+    if (!job->directory[0])
+    {
+        strncpy(path, file, FILENAME_MAX - 1);
+        path[FILENAME_MAX - 1] = '\0';
+        return true;
+    }
+    const char *name = strrchr(file, '/');
+    const char *backslash = strrchr(file, '\\');
+    name = backslash > name ? backslash : name;
+    int length = snprintf(path, FILENAME_MAX, "%s/%s", job->directory, name ? name + 1 : file);
+    return length >= 0 && length < FILENAME_MAX;
+}
+
+/**
+ * @brief Picks the header alignment of a job whose alignment is 0, i.e. the cluster size of its filesystem
+ */
+static void detect_alignment(source *src, scan_job *job)
+{
+    uint64_t cluster, base;
+    if (fs_geometry(src, &cluster, &base) && cluster <= 64 * 1024 * 1024)
+    {
+        job->alignment = (int)cluster;
+        alignment_base = base;
+    }
+    else
+    {
+        job->alignment = 1;
+    }
+}
+
+/**
+ * @brief Scans one region of the input: carves it, keeps its manifest and checkpoints it.
+ *        All of the carving state is thread local, so jobs can run on several threads at once.
+ *
+ * @param args The command line args
+ * @param job The region to scan, its results are stored in it
+ * @return EXIT_SUCCESS if the region was scanned
+ */
+int scan_run(cl_args *args, scan_job *job)
+{
+    char checkpoint_path[FILENAME_MAX], manifest_path[FILENAME_MAX], done_path[FILENAME_MAX], bad_map_path[FILENAME_MAX];
+    job->status = EXIT_FAILURE;
+    if (!job_path(job, args->checkpoint, checkpoint_path) || !job_path(job, args->bad_map, bad_map_path) ||
+        !job_path(job, args->manifest, manifest_path) || !job_path(job, JOB_DONE, done_path))
+    {
+        log_msg(LOG_ERROR, "The directory '%s' is too long for the files of the scan\n", job->directory);
+        return EXIT_FAILURE;
+    }
+
+    // A chunk of a batch image is one part of a scan, the batch keeps its manifest and marks the image done
+    bool chunk = job->header_end > 0;
+    bool resume = args->resume && !chunk;
+    if (job->directory[0] && !chunk)
+    {
+        if (!make_directory(job->directory))
+        {
+            log_msg(LOG_ERROR, "Error creating the directory '%s'\n", job->directory);
+            return EXIT_FAILURE;
+        }
+        FILE *done = fopen(done_path, "r");
+        if (done)
+        {
+            fclose(done);
+            if (resume)
+            {
+                log_msg(LOG_INFO, "%s was already scanned\n", job->name);
+                job->status = EXIT_SUCCESS;
+                return EXIT_SUCCESS;
+            }
+            remove(done_path);
+        }
+
+        // A job that never reached its first checkpoint starts over
+        FILE *saved = fopen(checkpoint_path, "r");
+        if (saved)
+            fclose(saved);
+        else
+            resume = false;
+    }
+
+    // Every job runs on its own thread and the I/O class belongs to the thread
+    if (args->io_class != IO_CLASS_NONE && !set_io_priority(args->io_class, args->io_level))
+    {
+        log_msg(LOG_ERROR, "Error setting the I/O priority, scanning with the default one\n");
+    }
+
+    BUFFER_SIZE = args->buffer_size == BUFFER_AUTO ? TUNE_MAX_READ : args->buffer_size; // The largest read
+    uint64_t bytes_read = 0L;
+    uint64_t last_checkpoint = 0L; // bytes_read at the time of the last checkpoint
+    uint64_t checkpoint_bytes = chunk ? 0 : (uint64_t)args->checkpoint_interval * 1024 * 1024;
+    checkpoint cp = {0};
+    file_count = 0;
+    memset(file_progresses, 0, sizeof(file_progresses));
+    memset(new_filename, 0, sizeof(new_filename));
+    strcpy(carve_directory, job->directory);
+    alignment_base = job->cluster_base;
+    header_limit = chunk ? job->header_end : UINT64_MAX;
+    limit_reached = false;
+    carves_refused = 0;
+
+    source *src = source_open(args, job->offset, job->length); // Opens the file, compressed file or drive
+    if (src == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    // A resumed scan keeps the bad sectors found before the checkpoint, a retry pass reads all of them again
+    if (resume || (args->retry_bad && !chunk))
+    {
+        rescue_load(bad_map_path, !resume);
+    }
+    if (job->alignment == 0)
+    {
+        detect_alignment(src, job);
+    }
+    if (args->unallocated)
+    {
+        if (src->seek == NULL)
+        {
+            log_msg(LOG_ERROR, "The filesystem analysis needs a seekable input, scanning the whole input\n");
+        }
+        else
+        {
+            src = source_open_unallocated(src);
+            alignment_base = 0; // The unallocated extents are whole clusters
+        }
+    }
+    header_alignment = job->alignment;
+    carve_layout_init(args->layout, args->offset_names);
+    if (job->alignment > 1 && !chunk)
+    {
+        log_msg(LOG_INFO, "%s: looking for headers at the start of every %d byte cluster\n", job->name[0] ? job->name : "Scan", job->alignment);
+    }
+
+    // The reads go to a page aligned part of the window for direct reads, on huge pages when it is large enough
+    byte_t *window = buffer_alloc(WINDOW_HEAD + BUFFER_SIZE + BUFFER_PADDING);
+    byte_t *reads = window + WINDOW_HEAD;
+    size_t carried = 0; // The last bytes of the previous read, kept in front of the next one
+
+    // Identifies the scan so a checkpoint is only ever resumed on the same source with the same settings
+    cp.mode = args->mode;
+    strcpy(cp.source, (args->mode == MODE_DRIVE) ? args->drivename : args->filename);
+    cp.buffer_size = args->buffer_size;
+    cp.object_size = src->size;
+    cp.alignment = job->alignment;
+
+    int status = EXIT_FAILURE;
+    output_init(args->dedup, args->skip_corrupt, args->hash, src, job->dedup);
+    if (resume)
+    {
+        checkpoint saved;
+        if (!checkpoint_load(checkpoint_path, &saved))
+        {
+            log_msg(LOG_ERROR, "Error reading the checkpoint '%s'\n", checkpoint_path);
+            goto cleanup;
+        }
+        // The carves do not depend on the buffer size, a scan can be resumed with another one or a tuned one
+        if (saved.mode != cp.mode || strcmp(saved.source, cp.source) != 0 ||
+            saved.object_size != cp.object_size || saved.alignment != cp.alignment)
+        {
+            log_msg(LOG_ERROR, "The checkpoint '%s' belongs to a different scan of '%s'\n", checkpoint_path, saved.source);
+            goto cleanup;
+        }
+
+        // Restores the carving state, the carve in progress and the manifest are cut back to what they were
+        // at the checkpoint since anything written after it will be written again.
+        file_count = saved.file_count;
+        memcpy(file_progresses, saved.progresses, sizeof(file_progresses));
+        strcpy(new_filename, saved.filename);
+        if (args->manifest[0])
+        {
+            if (!manifest_open(manifest_path, saved.manifest_size) || !manifest_each(manifest_path, output_remember))
+            {
+                log_msg(LOG_ERROR, "Error restoring the manifest '%s'\n", manifest_path);
+                goto cleanup;
+            }
+        }
+        if (new_filename[0] && !output_resume(new_filename, saved.offset - saved.filename_size, saved.filename_size))
+        {
+            log_msg(LOG_ERROR, "Error restoring '%s' to %" PRIu64 " bytes\n", new_filename, saved.filename_size);
+            goto cleanup;
+        }
+
+        if (!source_seek(src, saved.offset))
+        {
+            log_msg(LOG_ERROR, "Error seeking to offset %" PRIu64 "\n", saved.offset);
+            goto cleanup;
+        }
+        bytes_read = last_checkpoint = saved.offset;
+        log_msg(LOG_INFO, "Resuming from offset %" PRIu64 " with %d files already recovered\n", bytes_read, file_count);
+    }
+    else if (job->rows)
+    {
+        manifest_keep(job->rows);
+    }
+    else if (args->manifest[0] && !manifest_open(manifest_path, 0))
+    {
+        log_msg(LOG_ERROR, "Error creating the manifest '%s'\n", manifest_path);
+        goto cleanup;
+    }
+
+    log_progress_total(chunk ? job->header_end : src->size > bytes_read ? src->size - bytes_read : 0);
+    int files_shown = file_count; // The carves already counted in the progress line
+    time_t last_report = time(NULL); // When `progress` was last called
+
+    read_tuner tuner; // Picks the read size with --buffer auto
+    tune_init(&tuner);
+    bool tuning = args->buffer_size == BUFFER_AUTO;
+
+    size_t n; // The bytes read in the current iteration
+    while ((n = source_read(src, reads, tuning ? tune_read_size(&tuner, bytes_read) : (size_t)BUFFER_SIZE)) > 0)
+    {
+        // The window slides over the input: the bytes carried over from the last read are right in front of this one,
+        // so a header or trailer spanning two reads is matched like any other, and nothing is cleared in between
+        buffer = reads - carried;
+        buffer_offset = bytes_read - carried;
+        size_t available = carried + n;
+
+        // Carves the buffer a span at a time, i.e. JPEG, PNG and GIF, up to where the predicates would look past the read
+        size_t complete = available > SIGNATURE_MAX - 1 ? available - (SIGNATURE_MAX - 1) : 0;
+        carve_buffer((int)complete);
+        carried = available - complete;
+        memmove(reads - carried, buffer + complete, carried);
+        if (tuning)
+        {
+            tune_record(&tuner, n);
+        }
+
+        bytes_read += n;                         // Incrementing the bytes_read by the bytes read
+        log_progress(n, file_count - files_shown);
+        files_shown = file_count;
+        manifest_tick();
+        if (job->progress && time(NULL) != last_report)
+        {
+            job->progress(job, bytes_read, src->size, file_count);
+            last_report = time(NULL);
+        }
+
+        // Periodically saves the progress so an interrupted scan can be resumed
+        if (checkpoint_bytes && bytes_read - last_checkpoint >= checkpoint_bytes)
+        {
+            cp.offset = bytes_read - carried; // The carried bytes are carved again after a resume
+            cp.file_count = file_count;
+            memcpy(cp.progresses, file_progresses, sizeof(file_progresses));
+            strcpy(cp.filename, new_filename);
+            if (!output_sync(&cp.filename_size)) // The staged part of the carve has to be on disk
+            {
+                log_msg(LOG_ERROR, "Error writing the carves, the scan stops at the last checkpoint\n");
+                goto cleanup;
+            }
+            cp.manifest_size = manifest_size();
+            // The carves and the manifest the checkpoint counts reach the disk before it does
+            if (!sync_directory(job->directory[0] ? job->directory : ".") || !checkpoint_save(checkpoint_path, &cp) || !rescue_save(bad_map_path, false))
+            {
+                log_msg(LOG_ERROR, "Error writing the checkpoint '%s'\n", checkpoint_path);
+            }
+            last_checkpoint = bytes_read;
+        }
+        if (limit_reached)
+        {
+            break; // The rest of the image belongs to the next chunks
+        }
+    }
+
+    // The last bytes of the input, with zeros behind them for the predicates
+    if (!limit_reached)
+    {
+        buffer = reads - carried;
+        buffer_offset = bytes_read - carried;
+        memset(reads, 0, BUFFER_PADDING);
+        carve_buffer((int)carried);
+    }
+    job->stop = job->offset + (limit_reached ? limit_stop : bytes_read);
+    if (!output_flush())
+    {
+        log_msg(LOG_ERROR, "Error writing the carves, the scan is incomplete\n");
+        goto cleanup;
+    }
+    if (carves_refused)
+    {
+        log_msg(LOG_ERROR, "%d files were not carved, their paths are too long\n", carves_refused);
+        goto cleanup;
+    }
+    if (src->failed)
+    {
+        log_msg(LOG_ERROR, "The input is corrupt or cut short after %" PRIu64 " bytes, the scan is incomplete\n",
+                bytes_read);
+        goto cleanup;
+    }
+    status = EXIT_SUCCESS;
+    if (!chunk && !rescue_save(bad_map_path, true))
+    {
+        log_msg(LOG_ERROR, "Error writing the bad sector map '%s'\n", bad_map_path);
+    }
+
+    // The scan is complete, there is nothing left to resume
+    if (checkpoint_bytes)
+    {
+        remove(checkpoint_path);
+    }
+    if (job->directory[0] && !chunk)
+    {
+        FILE *done = fopen(done_path, "w");
+        if (done)
+            fclose(done);
+    }
+
+cleanup:
+    output_shutdown(); // Writes out the carve cut short by the end of the input
+    manifest_close();
+    source_close(src); // Closes the file or drive
+    buffer_free(window, WINDOW_HEAD + BUFFER_SIZE + BUFFER_PADDING); // Frees the memory taken up by the buffer
+    buffer = NULL;
+
+    job->bytes_read = bytes_read;
+    job->files = file_count;
+    job->status = status;
+    return status;
+}
+
+/**
+ * @brief Runs the next queued job until none is left
+ */
+static void *scan_worker(void *arg)
+{
+    job_queue *queue = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        int next = queue->next < queue->count ? queue->next++ : -1;
+        pthread_mutex_unlock(&queue->lock);
+        if (next < 0)
+        {
+            return NULL;
+        }
+        scan_run(queue->args, &queue->jobs[next]);
+    }
+}
+
+static int compare_job_sizes(const void *a, const void *b)
+{
+    const scan_job *x = a, *y = b;
+    return (x->length < y->length) - (x->length > y->length);
+}
+
+/**
+ * @brief Scans several regions at once, the largest first so the last job to finish is a short one
+ *
+ * @param args The command line args
+ * @param jobs The regions, their order is changed
+ * @param count Their number
+ * @param threads The number of regions scanned at once
+ * @return true if every region was scanned
+ */
+bool scan_all(cl_args *args, scan_job *jobs, int count, int threads)
+{
+    qsort(jobs, count, sizeof(scan_job), compare_job_sizes);
+    job_queue queue = {.args = args, .jobs = jobs, .count = count};
+    pthread_mutex_init(&queue.lock, NULL);
+
+    threads = threads < count ? threads : count;
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    CHECK_OR_EXIT(workers);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_create(&workers[i], NULL, scan_worker, &queue);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&queue.lock);
+
+    bool ok = true;
+    for (int i = 0; i < count; i++)
+    {
+        ok = ok && jobs[i].status == EXIT_SUCCESS;
+    }
+    return ok;
+}
@@ -0,0 +1,67 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include "utils.h"
+
+// Marks the directory of a scan job that ran to the end, so a resumed run skips it
+#define JOB_DONE "recover.done"
+
+// The read sizes tried by --buffer auto, the powers of two from TUNE_MIN_READ to TUNE_MAX_READ
+#define TUNE_MIN_READ (64 * 1024)
+#define TUNE_MAX_READ (16 * 1024 * 1024)
+#define TUNE_SIZES 9
+
+// The bytes read with each size to measure it, at least one read, and the bytes over which the rate is watched
+// once a size is picked
+#define TUNE_PROBE_BYTES (8 * 1024 * 1024)
+#define TUNE_WINDOW (256 * 1024 * 1024)
+
+// The change of the rate, as a fraction of it, after which the sizes are measured again
+#define TUNE_DRIFT 0.3
+
+// A region of the input scanned on its own, e.g. a partition or the gap between two
+typedef struct scan_job
+{
+    char name[32];                // The region name, empty for the whole input
+    uint64_t offset;              // The first byte of the region
+    uint64_t length;              // Its size in bytes, 0 for the whole input
+    int alignment;                // Headers are only looked for at multiples of it, 0 to take the cluster size from the boot sector
+    char directory[FILENAME_MAX]; // The carves, manifest and checkpoint of the job go there, empty for the current directory
+    uint64_t bytes_read;          // The bytes scanned once the job ran
+    int files;                    // The files carved once the job ran
+    int status;                   // EXIT_SUCCESS or EXIT_FAILURE once the job ran
+    uint64_t header_end;          // A chunk of a batch image starts no carve this far into the region or past it, 0 for no limit
+    uint64_t cluster_base;        // The offset of the first cluster in the region, when the alignment is given
+    struct manifest_rows *rows;   // Receives the manifest rows of a chunk instead of the manifest file, NULL for the file
+    uint64_t stop;                // The offset in the input where a chunk left off once the job ran
+    void (*progress)(struct scan_job *job, uint64_t bytes_read, uint64_t total, int files); // Called about once a second while it runs, NULL for none
+    void *context;                // Passed along to `progress`, e.g. the daemon client the job came from
+    struct dedup_index *dedup;    // The deduplication index shared with the other regions of the disk, NULL for its own
+} scan_job;
+
+// The read size picked by --buffer auto, measured on the scan itself so no byte is read twice
+typedef struct read_tuner
+{
+    int current;               // The size in use, as a power of two times TUNE_MIN_READ
+    bool probing;              // Whether the sizes of a round are being measured, otherwise the rate is watched
+    int first;                 // The first size of the round
+    int last;                  // Its last size
+    int centre;                // The size the round is around when it was started by a drift, -1 for the first round
+    double rates[TUNE_SIZES];  // The bytes per second measured for each size
+    double rate;               // The rate of the size picked
+    uint64_t bytes;            // The bytes of the current measurement
+    double seconds;            // Its time, reads and carving
+    double last_time;          // The time of the last read
+} read_tuner;
+
+bool job_path(const scan_job *job, const char *file, char path[FILENAME_MAX]);
+int scan_run(cl_args *args, scan_job *job);
+bool scan_all(cl_args *args, scan_job *jobs, int count, int threads);
+int batch_run(cl_args *args);
+int daemon_run(cl_args *args);
+int extract_run(cl_args *args);
+void tune_init(read_tuner *tuner);
+size_t tune_read_size(const read_tuner *tuner, uint64_t position);
+void tune_record(read_tuner *tuner, size_t bytes);
+
+#endif //__SCAN_H__
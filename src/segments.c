@@ -0,0 +1,252 @@
+#include "source.h"
+#include "log.h"
+#include <ctype.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+// How close to the end of a segment the next one is opened and its start read ahead
+#define PREFETCH_DISTANCE (16 * 1024 * 1024)
+
+// A single file of a split image
+typedef struct segment
+{
+    char filename[FILENAME_MAX]; // The segment file, e.g. image.002
+    uint64_t start;              // The logical offset of its first byte
+    uint64_t size;               // Its size
+} segment;
+
+// State of the segmented backend
+typedef struct segments_state
+{
+    segment *segments; // The segments in order
+    int count;         // Their number
+    int current;       // The segment being read
+    FILE *file;        // The opened current segment
+    FILE *next;        // The next segment, opened ahead of time once the current one is almost read
+} segments_state;
+
+/**
+ * @brief Returns the offset of the numeric extension of `filename` (e.g. `.001`), or -1 if it has none
+ */
+static int numeric_extension(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    if (dot == NULL || dot[1] == '\0')
+    {
+        return -1;
+    }
+    for (const char *c = dot + 1; *c; c++)
+    {
+        if (!isdigit((unsigned char)*c))
+        {
+            return -1;
+        }
+    }
+    return (int)(dot - filename);
+}
+
+/**
+ * @brief Tells the OS the segment will be read sequentially from `offset` on, so it can read ahead
+ */
+static void advise_sequential(FILE *file, uint64_t offset, uint64_t length)
+{
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fileno(file), (off_t)offset, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fileno(file), (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED);
+#else
+    (void)file;
+    (void)offset;
+    (void)length;
+#endif
+}
+
+/**
+ * @brief Makes `index` the current segment, reusing the prefetched file when it is the next one
+ */
+static bool open_segment(segments_state *state, int index, uint64_t offset)
+{
+    if (state->file)
+    {
+        fclose(state->file);
+        state->file = NULL;
+    }
+    if (state->next && index == state->current + 1)
+    {
+        state->file = state->next;
+        state->next = NULL;
+    }
+    else
+    {
+        if (state->next)
+        {
+            fclose(state->next);
+            state->next = NULL;
+        }
+        state->file = fopen(state->segments[index].filename, "rb");
+        if (state->file == NULL)
+        {
+            log_msg(LOG_ERROR, "Error opening the segment '%s'\n", state->segments[index].filename);
+            return false;
+        }
+    }
+    state->current = index;
+    return seek_file(state->file, offset);
+}
+
+static size_t segments_read(source *src, byte_t *data, size_t length)
+{
+    segments_state *state = src->state;
+    size_t copied = 0;
+
+    while (copied < length && state->current < state->count)
+    {
+        segment *current = &state->segments[state->current];
+        uint64_t position = src->position + copied - current->start; // The offset in the current segment
+        uint64_t left = current->size - position;
+
+        // Reads the start of the next segment ahead while the rest of this one is scanned
+        if (left <= PREFETCH_DISTANCE && state->next == NULL && state->current + 1 < state->count)
+        {
+            state->next = fopen(state->segments[state->current + 1].filename, "rb");
+            if (state->next)
+            {
+                advise_sequential(state->next, 0, PREFETCH_DISTANCE);
+            }
+        }
+
+        size_t wanted = length - copied < left ? length - copied : (size_t)left;
+        size_t n = wanted ? fread(data + copied, 1, wanted, state->file) : 0;
+        copied += n;
+        if (n < wanted)
+        {
+            log_msg(LOG_ERROR, "Error reading the segment '%s'\n", current->filename);
+            break;
+        }
+
+        // Carries on with the next segment, the scan sees one continuous stream
+        if (position + n == current->size)
+        {
+            if (state->current + 1 == state->count)
+            {
+                state->current++;
+                break;
+            }
+            if (!open_segment(state, state->current + 1, 0))
+            {
+                break;
+            }
+            advise_sequential(state->file, 0, 0);
+        }
+    }
+    return copied;
+}
+
+static bool segments_seek(source *src, uint64_t offset)
+{
+    segments_state *state = src->state;
+
+    // Binary search for the segment holding `offset`
+    int low = 0, high = state->count - 1;
+    while (low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if (state->segments[middle].start <= offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    if (offset >= src->size)
+    {
+        if (state->file)
+        {
+            fclose(state->file);
+            state->file = NULL;
+        }
+        state->current = state->count;
+        return offset == src->size;
+    }
+    return open_segment(state, low, offset - state->segments[low].start);
+}
+
+static void segments_close(source *src)
+{
+    segments_state *state = src->state;
+    if (state->file)
+    {
+        fclose(state->file);
+    }
+    if (state->next)
+    {
+        fclose(state->next);
+    }
+    free(state->segments);
+    free(state);
+}
+
+/**
+ * @brief Opens a split image (image.001, image.002, ...) as one stream. The segments are found by counting up
+ *        from the numeric extension of `filename` with the same width, until one is missing.
+ *
+ * @param filename The first segment
+ * @return The source, or NULL if `filename` has no numeric extension or cannot be opened
+ */
+source *source_open_segments(char *filename)
+{
+    int dot = numeric_extension(filename);
+    if (dot < 0)
+    {
+        return NULL;
+    }
+
+    int width = (int)strlen(filename + dot + 1);
+    long number = strtol(filename + dot + 1, NULL, 10);
+    int capacity = 16;
+    segments_state *state = calloc(1, sizeof(segments_state));
+    CHECK_OR_EXIT(state);
+    state->segments = malloc(capacity * sizeof(segment));
+    CHECK_OR_EXIT(state->segments);
+
+    uint64_t total = 0;
+    for (;; number++)
+    {
+        segment s;
+        snprintf(s.filename, FILENAME_MAX, "%.*s.%0*ld", dot, filename, width, number);
+        FILE *file = fopen(s.filename, "rb");
+        if (file == NULL)
+        {
+            break;
+        }
+        s.start = total;
+        s.size = get_file_size(file);
+        fclose(file);
+
+        if (state->count == capacity)
+        {
+            capacity *= 2;
+            state->segments = realloc(state->segments, capacity * sizeof(segment));
+            CHECK_OR_EXIT(state->segments);
+        }
+        state->segments[state->count++] = s;
+        total += s.size;
+    }
+
+    if (state->count == 0 || !open_segment(state, 0, 0))
+    {
+        free(state->segments);
+        free(state);
+        return NULL;
+    }
+    advise_sequential(state->file, 0, 0);
+
+    source *src = calloc(1, sizeof(source));
+    CHECK_OR_EXIT(src);
+    src->size = total;
+    src->read = segments_read;
+    src->seek = segments_seek;
+    src->close = segments_close;
+    src->state = state;
+
+    log_msg(LOG_INFO, "Reading %d segments of '%.*s' as one image\n", state->count, dot, filename);
+    return src;
+}
@@ -0,0 +1,318 @@
+#include "source.h"
+#include "log.h"
+#include <inttypes.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#endif
+
+/**
+ * @brief Detects the input format from the first bytes of the file, the file position is left untouched
+ *
+ * @param file The image/dump file
+ * @return One of FORMAT_RAW, FORMAT_GZIP or FORMAT_ZSTD
+ */
+static int detect_format(FILE *file)
+{
+    byte_t magic[4] = {0};
+    size_t n = fread(magic, 1, sizeof(magic), file);
+    seek_file(file, 0);
+
+    if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+    {
+        return FORMAT_GZIP;
+    }
+    if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+    {
+        return FORMAT_ZSTD;
+    }
+    return FORMAT_RAW;
+}
+
+/**
+ * @brief Opens the file or drive selected on the command line with the matching backend
+ *
+ * @param args The command line args
+ * @param offset The first byte of the region to read, e.g. a partition
+ * @param length The size of the region, 0 for the whole input
+ * @return The source, or NULL if it could not be opened
+ */
+source *source_open(cl_args *args, uint64_t offset, uint64_t length)
+{
+    source *src = NULL;
+    bool raw = false; // Whether the reads go straight to the medium, and so can fail on a bad sector
+    if (args->mode == MODE_DRIVE)
+    {
+#ifdef _WIN32
+        // Unbuffered drive reads have to be whole sectors
+        bool direct = args->direct && args->buffer_size % SECTOR_SIZE == 0;
+        if (args->direct && !direct)
+        {
+            log_msg(LOG_ERROR, "Direct reads need a buffer size that is a multiple of %d, reading through the cache\n", SECTOR_SIZE);
+        }
+
+        // The filesystem and partition analyses need the first sectors, a plain scan skips them
+        src = source_open_drive(args->drivename, args->unallocated || args->partitions ? 0 : 5, direct);
+        raw = true;
+#else
+        log_msg(LOG_ERROR, "Drive mode is only supported on Windows\n");
+#endif
+    }
+    else
+    {
+        FILE *file = fopen(args->filename, "rb"); // Opens the file in read-bytes mode
+        if (file == NULL)
+        {
+            log_msg(LOG_ERROR, "Error opening the file '%s'\n", args->filename);
+            return NULL;
+        }
+
+        int format = args->format == FORMAT_AUTO ? detect_format(file) : args->format;
+        bool direct = false; // Whether the file is read with O_DIRECT
+        if (format != FORMAT_RAW)
+        {
+            src = source_open_compressed(file, format, args->threads);
+        }
+        else if ((src = source_open_segments(args->filename)) != NULL)
+        {
+            fclose(file); // A split image like image.001 is read together with the segments following it
+        }
+#ifndef _WIN32
+        else if (args->direct && (src = source_open_direct(args->filename)) != NULL)
+        {
+            fclose(file);
+            direct = true;
+        }
+#endif
+        else
+        {
+            src = source_open_file(file);
+        }
+        raw = format == FORMAT_RAW;
+        // Compressed and split images, and filesystems refusing O_DIRECT, are read through the page cache
+        if (src && args->direct && !direct)
+        {
+            log_msg(LOG_ERROR, "Direct reads are not supported for '%s', reading through the page cache\n", args->filename);
+        }
+    }
+
+    // Read errors of the medium are worked around sector by sector, see rescue.c
+    if (src && raw)
+    {
+        src = source_open_rescue(src, args->retries);
+    }
+
+    if (src && (offset || length))
+    {
+        if (src->seek == NULL || offset > src->size)
+        {
+            log_msg(LOG_ERROR, "Error seeking to offset %" PRIu64 "\n", offset);
+            source_close(src);
+            return NULL;
+        }
+        extent_list region = {0};
+        extent_add(&region, offset, length && length < src->size - offset ? length : src->size - offset);
+        src = source_open_extents(src, &region);
+    }
+    if (src)
+    {
+        src = source_open_throttled(src); // Unchanged when no read limit is set
+    }
+    return src;
+}
+
+/**
+ * @brief Reads up to `length` bytes from the source, fewer only at the end of the input
+ *
+ * @return The number of bytes read
+ */
+size_t source_read(source *src, byte_t *data, size_t length)
+{
+    size_t n = src->read(src, data, length);
+    src->position += n;
+    return n;
+}
+
+/**
+ * @brief Moves the source to a logical offset. Sequential-only backends read their way up to it.
+ *
+ * @return true if the source is now at `offset`
+ */
+bool source_seek(source *src, uint64_t offset)
+{
+    if (src->seek)
+    {
+        if (!src->seek(src, offset))
+        {
+            return false;
+        }
+        src->position = offset;
+        return true;
+    }
+
+    if (offset < src->position)
+    {
+        return false;
+    }
+
+    byte_t skip[64 * 1024];
+    while (src->position < offset)
+    {
+        uint64_t left = offset - src->position;
+        if (source_read(src, skip, left < sizeof(skip) ? (size_t)left : sizeof(skip)) == 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Maps a logical offset of the source to the offset in the image or drive underneath it,
+ *        e.g. an offset in the unallocated space of a partition to the offset on the disk
+ */
+uint64_t source_origin(source *src, uint64_t offset)
+{
+    return src && src->origin ? src->origin(src, offset) : offset;
+}
+
+/**
+ * @brief Closes the source and frees it
+ */
+void source_close(source *src)
+{
+    if (src)
+    {
+        src->close(src);
+        free(src);
+    }
+}
+
+static size_t file_read(source *src, byte_t *data, size_t length)
+{
+    FILE *file = src->state;
+    size_t n = fread(data, 1, length, file);
+    if (n < length && ferror(file))
+    {
+        clearerr(file); // A read error, the rescue backend seeks past it and reads on
+    }
+    return n;
+}
+
+static bool file_seek(source *src, uint64_t offset)
+{
+    return seek_file((FILE *)src->state, offset);
+}
+
+static void file_close(source *src)
+{
+    fclose((FILE *)src->state);
+}
+
+/**
+ * @brief Wraps a plain image/dump file
+ *
+ * @param file The opened file, owned by the source from now on
+ */
+source *source_open_file(FILE *file)
+{
+    source *src = calloc(1, sizeof(source));
+    CHECK_OR_EXIT(src);
+    src->size = get_file_size(file);
+    src->read = file_read;
+    src->seek = file_seek;
+    src->close = file_close;
+    src->state = file;
+    return src;
+}
+
+#ifdef _WIN32
+// State of the drive backend
+typedef struct drive_state
+{
+    HANDLE device;     // Drive handle
+    uint64_t base;     // The offset the scan starts at
+} drive_state;
+
+static size_t drive_read(source *src, byte_t *data, size_t length)
+{
+    drive_state *state = src->state;
+    DWORD n = 0;
+    if (!ReadFile(state->device, data, (DWORD)length, &n, NULL))
+    {
+        return 0; // The rescue backend reads the block again sector by sector
+    }
+    return n;
+}
+
+static bool drive_seek(source *src, uint64_t offset)
+{
+    drive_state *state = src->state;
+    LARGE_INTEGER position;
+    position.QuadPart = (LONGLONG)(state->base + offset);
+    return SetFilePointerEx(state->device, position, NULL, FILE_BEGIN);
+}
+
+static uint64_t drive_origin(source *src, uint64_t offset)
+{
+    return ((drive_state *)src->state)->base + offset;
+}
+
+static void drive_close(source *src)
+{
+    drive_state *state = src->state;
+    CloseHandle(state->device);
+    free(state);
+}
+
+/**
+ * @brief Opens a drive like `C:` for raw reading
+ *
+ * @param drivename The drive
+ * @param num_sectors The sectors skipped at the start of the drive
+ * @param direct Whether the reads bypass the system cache, they then have to be whole sectors into an aligned buffer
+ */
+source *source_open_drive(char *drivename, int num_sectors, bool direct)
+{
+    char drivepath[64] = {0}; // Drive path
+    sprintf(drivepath, "\\\\.\\%s", drivename); // Generating the custom drivepath
+
+    // Opening the file and readying it for access
+    HANDLE device = CreateFile(drivepath,                           // Drive to open
+                               GENERIC_READ,                        // Access mode
+                               FILE_SHARE_READ | FILE_SHARE_WRITE,  // Share Mode
+                               NULL,                                // Security Descriptor
+                               OPEN_EXISTING,                       // How to create
+                               direct ? FILE_FLAG_NO_BUFFERING : 0, // File attributes
+                               NULL);                               // Handle to template
+
+    // Checking if the drive was opened correctly
+    if (device == INVALID_HANDLE_VALUE)
+    {
+        log_msg(LOG_ERROR, "Error opening the file: %lu\n", GetLastError()); // Printing the error code in case of error
+        return NULL;
+    }
+
+    drive_state *state = calloc(1, sizeof(drive_state));
+    source *src = calloc(1, sizeof(source));
+    CHECK_OR_EXIT(state);
+    CHECK_OR_EXIT(src);
+    state->device = device;
+    state->base = (uint64_t)num_sectors * SECTOR_SIZE;
+
+    // Getting the drive's total size, the rescue backend tells a bad sector from the end of the drive with it
+    GET_LENGTH_INFORMATION length = {0};
+    DWORD returned;
+    DeviceIoControl(device, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &length, sizeof(length), &returned, NULL);
+    src->size = (uint64_t)length.Length.QuadPart > state->base ? (uint64_t)length.Length.QuadPart - state->base : 0;
+    src->read = drive_read;
+    src->seek = drive_seek;
+    src->origin = drive_origin;
+    src->close = drive_close;
+    src->state = state;
+
+    // Setting the file pointer to `num_sectors` * SECTOR_SIZE bytes offset
+    drive_seek(src, 0);
+    return src;
+}
+#endif
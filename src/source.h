@@ -0,0 +1,66 @@
+#ifndef __SOURCE_H__
+#define __SOURCE_H__
+
+#include "utils.h"
+
+// A readable input of the scan, i.e. an image file, a compressed image or a drive.
+// Backends fill in the function pointers, the rest of the program only goes through source_read/source_seek.
+typedef struct source
+{
+    uint64_t size;                                                  // The logical size in bytes, 0 when unknown (e.g. streamed gzip)
+    size_t (*read)(struct source *src, byte_t *data, size_t length); // Reads up to `length` bytes, fewer only at the end of the input
+    bool (*seek)(struct source *src, uint64_t offset);               // Moves to a logical offset, NULL for sequential-only backends
+    uint64_t (*origin)(struct source *src, uint64_t offset);         // Maps a logical offset to the input, NULL when they are the same
+    void (*close)(struct source *src);                              // Releases everything the backend holds
+    void *state;                                                    // Backend specific state
+    uint64_t position;                                              // The logical offset of the next read
+    bool failed;                                                    // Set once the input turned out to be corrupt or cut short
+} source;
+
+// A run of bytes of the input underneath a source
+typedef struct extent
+{
+    uint64_t offset; // Its first byte
+    uint64_t length; // Its size in bytes
+} extent;
+
+// A growable list of extents in ascending order
+typedef struct extent_list
+{
+    extent *items;   // The extents
+    size_t count;    // Their number
+    size_t capacity; // The allocated number of items
+} extent_list;
+
+source *source_open(cl_args *args, uint64_t offset, uint64_t length);
+size_t source_read(source *src, byte_t *data, size_t length);
+bool source_seek(source *src, uint64_t offset);
+uint64_t source_origin(source *src, uint64_t offset);
+void source_close(source *src);
+
+// Backends
+source *source_open_file(FILE *file);
+source *source_open_compressed(FILE *file, int format, int threads);
+source *source_open_segments(char *filename);
+#ifndef _WIN32
+source *source_open_direct(const char *filename);
+#endif
+source *source_open_extents(source *inner, extent_list *extents);
+source *source_open_unallocated(source *volume);
+source *source_open_throttled(source *inner);
+source *source_open_rescue(source *inner, int retries);
+bool fs_geometry(source *volume, uint64_t *cluster, uint64_t *base);
+void extent_add(extent_list *list, uint64_t offset, uint64_t length);
+#ifdef _WIN32
+source *source_open_drive(char *drivename, int num_sectors, bool direct);
+#endif
+
+// Bad sector map of the rescue backend
+bool rescue_load(const char *path, bool retry);
+bool rescue_save(const char *path, bool final);
+
+// Read throttling
+void throttle_init(double max_mbps, int max_iops, double max_latency_ms);
+bool set_io_priority(int io_class, int level);
+
+#endif //__SOURCE_H__
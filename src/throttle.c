@@ -0,0 +1,214 @@
+#include "source.h"
+#include "log.h"
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Reads are passed on in pieces of at most this size, each one a single request whose latency tells how busy the device is
+#define THROTTLE_CHUNK (1024 * 1024)
+
+// The tokens saved up while the scan is busy carving, in seconds of the rate
+#define THROTTLE_BURST 0.05
+
+// The lowest rate in bytes per second the latency limit backs off to
+#define THROTTLE_FLOOR (1024.0 * 1024.0)
+
+// The read budget, shared by every scan job so running partitions in parallel does not multiply it
+typedef struct throttle
+{
+    double max_rate;      // The configured bytes per second, 0 for no limit
+    double max_iops;      // The configured reads per second, 0 for no limit
+    double max_latency;   // The read latency in seconds above which the rate backs off, 0 for none
+    double rate;          // The current bytes per second, lower than max_rate while the device is slow, 0 for no limit
+    double peak;          // The fastest throughput of a read within the latency limit
+    double bytes;         // The byte tokens, negative when the reads ran ahead of the budget
+    double reads;         // The read tokens
+    double last;          // The time of the last refill
+    pthread_mutex_t lock; // Guards all of the above
+} throttle;
+
+static throttle budget = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static bool throttling = false; // Whether any limit is set
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Sets the read limits of every source opened from now on, called once before the scan starts
+ *
+ * @param max_mbps The read rate in MiB/s, 0 for no limit
+ * @param max_iops The reads per second, 0 for no limit
+ * @param max_latency_ms The read latency in milliseconds above which the rate is halved, 0 to ignore the latency
+ */
+void throttle_init(double max_mbps, int max_iops, double max_latency_ms)
+{
+    budget.max_rate = budget.rate = max_mbps * 1024 * 1024;
+    budget.max_iops = max_iops;
+    budget.max_latency = max_latency_ms / 1000;
+    budget.last = now();
+    throttling = max_mbps > 0 || max_iops > 0 || max_latency_ms > 0;
+}
+
+/**
+ * @brief Takes the tokens for one read, sleeping until the budget covers it
+ */
+static void throttle_acquire(size_t length)
+{
+    pthread_mutex_lock(&budget.lock);
+    double t = now(), wait = 0;
+    double elapsed = t - budget.last;
+    budget.last = t;
+    if (budget.rate > 0)
+    {
+        budget.bytes = fmin(budget.bytes + elapsed * budget.rate, budget.rate * THROTTLE_BURST) - (double)length;
+        wait = budget.bytes < 0 ? -budget.bytes / budget.rate : 0;
+    }
+    if (budget.max_iops > 0)
+    {
+        budget.reads = fmin(budget.reads + elapsed * budget.max_iops, fmax(1, budget.max_iops * THROTTLE_BURST)) - 1;
+        wait = budget.reads < 0 ? fmax(wait, -budget.reads / budget.max_iops) : wait;
+    }
+    pthread_mutex_unlock(&budget.lock);
+
+    if (wait > 0)
+    {
+        struct timespec pause = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&pause, NULL);
+    }
+}
+
+/**
+ * @brief Adapts the rate to the latency of a read: halved while reads are slower than the limit,
+ *        raised again by 5% per fast read up to the configured rate (or no limit at all)
+ */
+static void throttle_observe(size_t n, double latency)
+{
+    if (budget.max_latency <= 0 || n == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&budget.lock);
+    double throughput = n / fmax(latency, 1e-6);
+    if (latency > budget.max_latency)
+    {
+        double rate = fmax((budget.rate > 0 ? budget.rate : throughput) / 2, THROTTLE_FLOOR);
+        if (budget.rate == 0 || rate < budget.rate)
+        {
+            log_msg(LOG_INFO, "Read latency of %.1f ms, throttling the scan to %.1f MiB/s\n", latency * 1000, rate / (1024 * 1024));
+            budget.rate = rate;
+            budget.bytes = fmin(budget.bytes, 0);
+        }
+    }
+    else if (latency < budget.max_latency / 2)
+    {
+        budget.peak = fmax(budget.peak, throughput);
+        if (budget.rate > 0 && budget.rate != budget.max_rate)
+        {
+            budget.rate *= 1.05;
+            if (budget.max_rate > 0 ? budget.rate >= budget.max_rate : budget.rate >= budget.peak)
+            {
+                budget.rate = budget.max_rate;
+                log_msg(LOG_INFO, "Read latency is back under the limit\n");
+            }
+        }
+    }
+    pthread_mutex_unlock(&budget.lock);
+}
+
+static size_t throttled_read(source *src, byte_t *data, size_t length)
+{
+    source *inner = src->state;
+    size_t copied = 0;
+    while (copied < length)
+    {
+        size_t wanted = length - copied < THROTTLE_CHUNK ? length - copied : THROTTLE_CHUNK;
+        throttle_acquire(wanted);
+        double start = now();
+        size_t n = source_read(inner, data + copied, wanted);
+        throttle_observe(n, now() - start);
+        copied += n;
+        if (n < wanted)
+        {
+            break;
+        }
+    }
+    src->failed = inner->failed;
+    return copied;
+}
+
+static bool throttled_seek(source *src, uint64_t offset)
+{
+    return source_seek((source *)src->state, offset);
+}
+
+static uint64_t throttled_origin(source *src, uint64_t offset)
+{
+    return source_origin((source *)src->state, offset);
+}
+
+static void throttled_close(source *src)
+{
+    source_close((source *)src->state);
+}
+
+/**
+ * @brief Limits the reads of a source to the budget set by throttle_init, so a disk that is still serving
+ *        other work can be scanned without hurting its latency
+ *
+ * @param inner The source, owned by the throttled source from now on
+ * @return The throttled source, or `inner` itself when no limit is set
+ */
+source *source_open_throttled(source *inner)
+{
+    if (!throttling)
+    {
+        return inner;
+    }
+    source *src = calloc(1, sizeof(source));
+    CHECK_OR_EXIT(src);
+    src->size = inner->size;
+    src->read = throttled_read;
+    src->seek = inner->seek ? throttled_seek : NULL;
+    src->origin = throttled_origin;
+    src->close = throttled_close;
+    src->state = inner;
+    src->position = inner->position;
+    return src;
+}
+
+/**
+ * @brief Sets the I/O scheduling class of the calling thread, like ionice
+ *
+ * @param io_class IO_CLASS_IDLE, IO_CLASS_BEST_EFFORT or IO_CLASS_REALTIME
+ * @param level The priority within the class, 0 (highest) to 7
+ * @return true if the class was set
+ */
+bool set_io_priority(int io_class, int level)
+{
+#ifdef _WIN32
+    // Windows only has the background mode, which lowers the I/O priority of the thread
+    if (io_class == IO_CLASS_IDLE)
+    {
+        return SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    }
+    (void)level;
+    return false;
+#elif defined(__linux__) && defined(SYS_ioprio_set)
+    // IOPRIO_WHO_PROCESS with 0 is the calling thread, the class is in the bits above the 13 bits of the level
+    return syscall(SYS_ioprio_set, 1, 0, io_class << 13 | level) == 0;
+#else
+    (void)io_class;
+    (void)level;
+    return false;
+#endif
+}
@@ -0,0 +1,183 @@
+#include "../knownhash.h"
+#include <inttypes.h>
+
+#define MKHASHSET_USAGE "Usage: ./mkhashset --out <hash set> [--hash <xxh3|sha256>] [--column <n>] <hash list>..."
+
+// Options of the hash set builder
+typedef struct mkhashset_args
+{
+    char out[FILENAME_MAX]; // Path of the hash set to write
+    int algorithm;          // HASH_XXH3 or HASH_SHA256
+    int column;             // The 1-based column holding the digest in each line of the lists
+} mkhashset_args;
+
+static int size_of_digest; // The digest size of the selected algorithm, used by compare_digests
+
+static void print_usage()
+{
+    printf("%s\n", MKHASHSET_USAGE);
+}
+
+static void parse_args(mkhashset_args *args, int argc, char *argv[])
+{
+    struct option options[] = {
+        {.name = "out", .has_arg = required_argument, NULL, .val = 'o'},
+        {.name = "hash", .has_arg = required_argument, NULL, .val = 'H'},
+        {.name = "column", .has_arg = required_argument, NULL, .val = 'c'},
+        {.name = "help", .has_arg = no_argument, NULL, .val = 'h'},
+        {0}};
+
+    memset(args, 0, sizeof(*args));
+    args->algorithm = HASH_SHA256;
+    args->column = 1;
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "o:H:c:h", options, NULL)) != -1)
+    {
+        switch (ch)
+        {
+        case 'o':
+            strncpy(args->out, optarg, FILENAME_MAX - 1);
+            break;
+        case 'H':
+            if (strcmp(optarg, "xxh3") == 0)
+                args->algorithm = HASH_XXH3;
+            else if (strcmp(optarg, "sha256") == 0)
+                args->algorithm = HASH_SHA256;
+            else
+                args->algorithm = -1;
+            break;
+        case 'c':
+            args->column = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!args->out[0] || args->algorithm < 0 || args->column < 1 || optind == argc)
+    {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Returns the digest in column `column` of a line split on commas, tabs or spaces, without quotes
+ */
+static char *find_column(char *line, int column)
+{
+    char *field = strtok(line, ", \t\r\n");
+    while (field && --column)
+    {
+        field = strtok(NULL, ", \t\r\n");
+    }
+    if (field == NULL)
+    {
+        return NULL;
+    }
+    if (*field == '"')
+    {
+        field++;
+        char *quote = strchr(field, '"');
+        if (quote)
+            *quote = '\0';
+    }
+    return field;
+}
+
+static int compare_digests(const void *a, const void *b)
+{
+    return memcmp(a, b, size_of_digest);
+}
+
+/**
+ * @brief Builds a known hash set for `recover --known-hashes` from lists of hex digests, one per line.
+ *        Lines whose column is not a digest of the selected algorithm, like CSV headers, are skipped.
+ *        The lists can be sha256sum output, an NSRL style CSV or the manifest of an earlier run (--column 4).
+ */
+int main(int argc, char *argv[])
+{
+    mkhashset_args args;
+    parse_args(&args, argc, argv);
+    size_of_digest = digest_size(args.algorithm);
+
+    size_t count = 0, capacity = 1024 * 1024;
+    byte_t *digests = malloc(capacity * size_of_digest);
+    CHECK_OR_EXIT(digests);
+
+    char line[4096];
+    uint64_t skipped = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        FILE *list = fopen(argv[i], "r");
+        if (list == NULL)
+        {
+            printf("Error opening the hash list '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        while (fgets(line, sizeof(line), list))
+        {
+            if (count == capacity)
+            {
+                capacity *= 2;
+                digests = realloc(digests, capacity * size_of_digest);
+                CHECK_OR_EXIT(digests);
+            }
+            char *field = find_column(line, args.column);
+            if (field && strlen(field) == (size_t)size_of_digest * 2 &&
+                digest_to_bytes(field, digests + count * size_of_digest, size_of_digest))
+                count++;
+            else
+                skipped++;
+        }
+        fclose(list);
+    }
+
+    // Sorts and drops repeated digests
+    qsort(digests, count, size_of_digest, compare_digests);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (unique == 0 || memcmp(digests + (unique - 1) * size_of_digest, digests + i * size_of_digest, size_of_digest) != 0)
+        {
+            memmove(digests + unique * size_of_digest, digests + i * size_of_digest, size_of_digest);
+            unique++;
+        }
+    }
+
+    // Bucket b starts at the first digest with a two byte prefix >= b
+    uint64_t *buckets = malloc((KNOWN_BUCKETS + 1) * sizeof(uint64_t));
+    CHECK_OR_EXIT(buckets);
+    size_t next = 0;
+    for (unsigned b = 0; b <= KNOWN_BUCKETS; b++)
+    {
+        while (next < unique && (unsigned)(digests[next * size_of_digest] << 8 | digests[next * size_of_digest + 1]) < b)
+        {
+            next++;
+        }
+        buckets[b] = next;
+    }
+
+    // The integers are written in the host order, which is little-endian on every supported platform
+    known_header header = {.version = KNOWN_VERSION, .algorithm = args.algorithm, .digest_size = size_of_digest, .count = unique};
+    memcpy(header.magic, KNOWN_MAGIC, 4);
+    FILE *out = fopen(args.out, "wb");
+    if (out == NULL ||
+        fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(buckets, sizeof(uint64_t), KNOWN_BUCKETS + 1, out) != KNOWN_BUCKETS + 1 ||
+        fwrite(digests, size_of_digest, unique, out) != unique ||
+        fclose(out) != 0)
+    {
+        printf("Error writing the hash set '%s'\n", args.out);
+        return EXIT_FAILURE;
+    }
+
+    printf("Wrote %zu %s hashes to '%s' (%zu repeated, %" PRIu64 " lines skipped)\n", unique,
+           args.algorithm == HASH_SHA256 ? "SHA-256" : "xxHash3", args.out, count - unique, skipped);
+    free(buckets);
+    free(digests);
+    return EXIT_SUCCESS;
+}
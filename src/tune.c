@@ -0,0 +1,112 @@
+#include "scan.h"
+#include "log.h"
+#include <math.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Starts measuring the read sizes from `first` to `last`, one after the other
+ */
+static void start_round(read_tuner *tuner, int first, int last)
+{
+    tuner->first = first < 0 ? 0 : first;
+    tuner->last = last >= TUNE_SIZES ? TUNE_SIZES - 1 : last;
+    tuner->current = tuner->first;
+    tuner->probing = true;
+    tuner->bytes = 0;
+    tuner->seconds = 0;
+}
+
+/**
+ * @brief Starts tuning the read size of a scan, every size from TUNE_MIN_READ to TUNE_MAX_READ is measured first
+ */
+void tune_init(read_tuner *tuner)
+{
+    memset(tuner, 0, sizeof(read_tuner));
+    tuner->last_time = now();
+    tuner->centre = -1;
+    start_round(tuner, 0, TUNE_SIZES - 1);
+}
+
+/**
+ * @brief The length of the next read. Every size is a multiple of TUNE_MIN_READ, and a read starting off that grid,
+ *        as after a resume, is shortened to get back on it, so direct reads stay aligned to the device blocks.
+ *
+ * @param position The offset of the read in the source
+ */
+size_t tune_read_size(const read_tuner *tuner, uint64_t position)
+{
+    return ((size_t)TUNE_MIN_READ << tuner->current) - (size_t)(position % TUNE_MIN_READ);
+}
+
+/**
+ * @brief Adds a read and the carving of it to the measurement. Each size of a round is read for TUNE_PROBE_BYTES,
+ *        then the fastest is kept. Its rate is watched every TUNE_WINDOW bytes from then on, and when it drifts by
+ *        more than TUNE_DRIFT (the scan moved from a cache to the disk, another job started on the device) the sizes
+ *        next to it are measured again, climbing on while a neighbour turns out faster.
+ *
+ * @param bytes The bytes read
+ */
+void tune_record(read_tuner *tuner, size_t bytes)
+{
+    double t = now();
+    tuner->seconds += t - tuner->last_time;
+    tuner->last_time = t;
+    tuner->bytes += bytes;
+
+    if (!tuner->probing)
+    {
+        if (tuner->bytes < TUNE_WINDOW)
+        {
+            return;
+        }
+        double rate = tuner->bytes / fmax(tuner->seconds, 1e-9);
+        tuner->bytes = 0;
+        tuner->seconds = 0;
+        if (fabs(rate - tuner->rate) > TUNE_DRIFT * tuner->rate)
+        {
+            log_msg(LOG_VERBOSE, "The read rate went from %.0f to %.0f MiB/s, tuning the read size again\n",
+                    tuner->rate / (1024 * 1024), rate / (1024 * 1024));
+            tuner->centre = tuner->current;
+            start_round(tuner, tuner->current - 1, tuner->current + 1);
+        }
+        return;
+    }
+
+    if (tuner->bytes < TUNE_PROBE_BYTES)
+    {
+        return;
+    }
+    tuner->rates[tuner->current] = tuner->bytes / fmax(tuner->seconds, 1e-9);
+    tuner->bytes = 0;
+    tuner->seconds = 0;
+    if (tuner->current < tuner->last)
+    {
+        tuner->current++;
+        return;
+    }
+
+    int best = tuner->first;
+    for (int i = tuner->first + 1; i <= tuner->last; i++)
+    {
+        best = tuner->rates[i] > tuner->rates[best] ? i : best;
+    }
+    if (tuner->centre >= 0 && best != tuner->centre)
+    {
+        // A neighbour was faster, the one past it may be faster still
+        tuner->centre = best;
+        start_round(tuner, best - 1, best + 1);
+        return;
+    }
+    tuner->centre = -1;
+    tuner->current = best;
+    tuner->rate = tuner->rates[best];
+    tuner->probing = false;
+    log_msg(LOG_VERBOSE, "Reading in %d KiB pieces, %.0f MiB/s\n", (TUNE_MIN_READ << best) / 1024, tuner->rate / (1024 * 1024));
+}
@@ -1,13 +1,28 @@
+#define _GNU_SOURCE // syncfs
 #include "utils.h"
+#include "log.h"
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <errno.h>
 
 /**
- * @brief Validates the command line arguments, handles flags both short and long flags for buffer size, filename or drive name.
+ * @brief Parses the command line arguments, handles flags both short and long flags for buffer size, filename or drive name.
+ *        Also parses the scan requests of the daemon, which are written like a command line.
  *
  * @param args The place where all the arguments and relavent information will be stored.
  * @param argc The argc passed by main
  * @param argv The argv passed by main
+ * @return false if the arguments are incorrect
  */
-void validate_args(cl_args *args, int argc, char *argv[])
+bool parse_cl_args(cl_args *args, int argc, char *argv[])
 {
     // Setting up the required and compatible command line arguments
     // they support both long and short order arguments like (--buffer 1024 or -b 1024) are equivalent.
@@ -15,23 +30,110 @@ void validate_args(cl_args *args, int argc, char *argv[])
         {.name = "buffer", .has_arg = required_argument, NULL, .val = 'b'}, // For the setting of buffer length
         {.name = "file", .has_arg = required_argument, NULL, .val = 'f'},   // For providing the dumpname/image file from which images will be extracted
         {.name = "drive", .has_arg = required_argument, NULL, .val = 'd'},  // For providing the Drive that needs to parsed for deleted images
-        {.name = "help", .has_arg = no_argument, NULL, .val = 'h'}          // Help option
-    };
+        {.name = "checkpoint", .has_arg = required_argument, NULL, .val = 'c'},       // For the file the progress is saved to
+        {.name = "checkpoint-every", .has_arg = required_argument, NULL, .val = 'C'}, // For the MiB scanned between two checkpoints
+        {.name = "resume", .has_arg = no_argument, NULL, .val = 'r'},                 // For continuing from the last checkpoint
+        {.name = "format", .has_arg = required_argument, NULL, .val = 'F'},           // For the input format of the image/dump file
+        {.name = "threads", .has_arg = required_argument, NULL, .val = 't'},          // For the number of decompression threads
+        {.name = "dedup", .has_arg = no_argument, NULL, .val = 'D'},                  // For dropping carves with already seen content
+        {.name = "hash", .has_arg = required_argument, NULL, .val = 'H'},             // For the content hash algorithm
+        {.name = "manifest", .has_arg = required_argument, NULL, .val = 'm'},         // For the manifest listing every carve
+        {.name = "known-hashes", .has_arg = required_argument, NULL, .val = 'k'},     // For the hash set of files not worth carving
+        {.name = "unallocated", .has_arg = no_argument, NULL, .val = 'u'},           // For scanning only the free space of the filesystem
+        {.name = "partitions", .has_arg = no_argument, NULL, .val = 'P'},            // For scanning every partition and gap on its own
+        {.name = "list-partitions", .has_arg = no_argument, NULL, .val = 'L'},       // For printing the partitions and gaps
+        {.name = "regions", .has_arg = required_argument, NULL, .val = 'R'},         // For the partitions and gaps to scan
+        {.name = "jobs", .has_arg = required_argument, NULL, .val = 'j'},            // For the number of regions scanned at once
+        {.name = "align", .has_arg = required_argument, NULL, .val = 'a'},           // For the header alignment
+        {.name = "direct", .has_arg = no_argument, NULL, .val = 'O'},                // For reading around the page cache
+        {.name = "max-read-mbps", .has_arg = required_argument, NULL, .val = 'M'},   // For the read rate limit
+        {.name = "max-iops", .has_arg = required_argument, NULL, .val = 'I'},        // For the reads per second limit
+        {.name = "max-latency-ms", .has_arg = required_argument, NULL, .val = 'l'},  // For the latency the read rate backs off at
+        {.name = "ioprio", .has_arg = required_argument, NULL, .val = 'p'},          // For the I/O scheduling class
+        {.name = "bad-map", .has_arg = required_argument, NULL, .val = 'B'},         // For the map of the unreadable sectors
+        {.name = "retry-bad", .has_arg = no_argument, NULL, .val = 'e'},             // For reading the mapped sectors again
+        {.name = "retries", .has_arg = required_argument, NULL, .val = 'T'},         // For the attempts per mapped sector
+        {.name = "layout", .has_arg = required_argument, NULL, .val = 'y'},          // For the subdirectories of the carves
+        {.name = "names", .has_arg = required_argument, NULL, .val = 'n'},           // For naming the carves by count or offset
+        {.name = "skip-corrupt", .has_arg = no_argument, NULL, .val = 'S'},         // For dropping carves with a broken structure
+        {.name = "writers", .has_arg = required_argument, NULL, .val = 'w'},         // For the number of output writer threads
+        {.name = "validators", .has_arg = required_argument, NULL, .val = 'V'},      // For the number of validation threads
+        {.name = "batch", .has_arg = required_argument, NULL, .val = 'A'},           // For the list or directory of images to scan
+        {.name = "chunk-size", .has_arg = required_argument, NULL, .val = 'z'},      // For the MiB of an image scanned by one batch task
+        {.name = "incremental", .has_arg = no_argument, NULL, .val = 'i'},           // For scanning again only the chunks that changed
+        {.name = "output", .has_arg = required_argument, NULL, .val = 'o'},          // For the directory of the carves
+        {.name = "offset", .has_arg = required_argument, NULL, .val = 'g'},          // For the first byte of the range to scan
+        {.name = "length", .has_arg = required_argument, NULL, .val = 'N'},          // For the size of the range to scan
+        {.name = "daemon", .has_arg = required_argument, NULL, .val = 'G'},          // For serving scan requests on a Unix socket
+        {.name = "type", .has_arg = required_argument, NULL, .val = 'x'},            // For the type of the file extracted
+        {.name = "offsets", .has_arg = required_argument, NULL, .val = 'X'},         // For the list of offsets to extract at
+        {.name = "quiet", .has_arg = no_argument, NULL, .val = 'q'},                 // For printing only the errors
+        {.name = "verbose", .has_arg = no_argument, NULL, .val = 'v'},               // For printing every carve, twice for every header
+        {.name = "help", .has_arg = no_argument, NULL, .val = 'h'},                   // Help option
+        {0}};
 
-    args->buffer_size = MIN_BUFFER_SIZE; // Setting the default buffer size of MIN_BUFFER_SIZE
-    char ch;                             // Character for storing the current command line character
+    args->buffer_size = BUFFER_AUTO; // The read size is tuned on the scan by default
+    strcpy(args->checkpoint, DEFAULT_CHECKPOINT);
+    args->checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+    args->resume = false;
+    args->format = FORMAT_AUTO;
+    args->threads = cpu_count();
+    args->dedup = false;
+    args->hash = HASH_XXH3;
+    args->manifest[0] = '\0';
+    args->known_hashes[0] = '\0';
+    args->unallocated = false;
+    args->partitions = false;
+    args->list_partitions = false;
+    args->regions[0] = '\0';
+    args->jobs = cpu_count();
+    args->align = -1;
+    args->direct = false;
+    args->max_read_mbps = 0;
+    args->max_iops = 0;
+    args->max_latency_ms = 0;
+    args->io_class = IO_CLASS_NONE;
+    args->io_level = 4;
+    strcpy(args->bad_map, DEFAULT_BAD_MAP);
+    args->retry_bad = false;
+    args->retries = DEFAULT_RETRIES;
+    args->layout = LAYOUT_FLAT;
+    args->offset_names = false;
+    args->skip_corrupt = false;
+    args->writers = DEFAULT_WRITERS;
+    args->validators = cpu_count();
+    args->batch[0] = '\0';
+    args->chunk_size = DEFAULT_CHUNK_SIZE;
+    args->incremental = false;
+    args->output[0] = '\0';
+    args->offset = 0;
+    args->length = 0;
+    args->daemon[0] = '\0';
+    args->extract_type[0] = '\0';
+    args->offsets[0] = '\0';
+    args->verbosity = LOG_INFO;
+    int ch;                              // Character for storing the current command line character
     bool method_selected = false;        // Checks if either the file or the drive methods have been set
-    while ((ch = getopt_long(argc, argv, "b:f:d:h", options, NULL)) != -1)
+    optind = 0; // Starts over, the daemon parses a command line for every request
+
+    // `recover extract ...` carves the files at given offsets instead of scanning, the options follow the subcommand
+    args->extract = argc > 1 && strcmp(argv[1], "extract") == 0;
+    if (args->extract)
+    {
+        argc--;
+        argv++;
+    }
+    while ((ch = getopt_long(argc, argv, "b:f:d:c:C:rF:t:DH:m:k:uPLR:j:a:OM:I:l:p:B:eT:y:n:Sw:V:A:z:io:g:N:G:x:X:qvh", options, NULL)) != -1)
     { // Defining the arguments
+        args->rejected = argv[optind - 1]; // The option or its value, blamed when it is incorrect
         switch (ch)
         {
 
         case 'b':                             // For buffer
-            args->buffer_size = atoi(optarg); // Converts the buffer_size to an integer
-            if (args->buffer_size < MIN_BUFFER_SIZE)
+            args->buffer_size = strcmp(optarg, "auto") == 0 ? BUFFER_AUTO : atoi(optarg); // Converts the buffer_size to an integer
+            if (args->buffer_size != BUFFER_AUTO && args->buffer_size < MIN_BUFFER_SIZE)
             {                       // If the buffer size < MIN_BUFFER_SIZE then it needs to change to a higher value
-                usage();            // Prints the usage
-                exit(EXIT_FAILURE); // Exits with status code EXIT_FAILURE or non-zero.
+                return false;
             }
             break;
 
@@ -56,15 +158,325 @@ void validate_args(cl_args *args, int argc, char *argv[])
                 args->mode = MODE_DRIVE;                     // Setting the mode in which the file or drive will be read
             }
             break;
+
+        case 'c': // For the checkpoint file
+            strip(optarg);
+            strncpy(args->checkpoint, optarg, FILENAME_MAX - 1);
+            break;
+
+        case 'C': // For the checkpoint interval
+            args->checkpoint_interval = atoi(optarg);
+            if (args->checkpoint_interval < 0)
+            {
+                return false;
+            }
+            break;
+
+        case 'r': // For resuming
+            args->resume = true;
+            break;
+
+        case 'F': // For the input format
+        {
+            const char *formats[] = {"auto", "raw", "gzip", "zstd"}; // In the order of the FORMAT_* values
+            args->format = -1;
+            for (int i = 0; i < 4; i++)
+            {
+                if (strcmp(optarg, formats[i]) == 0)
+                {
+                    args->format = i;
+                }
+            }
+            if (args->format < 0)
+            {
+                return false;
+            }
+            break;
+        }
+
+        case 't': // For the decompression threads
+            args->threads = atoi(optarg);
+            if (args->threads < 1)
+            {
+                return false;
+            }
+            break;
+
+        case 'D': // For deduplication, which needs the manifest to record the duplicates
+            args->dedup = true;
+            if (!args->manifest[0])
+            {
+                strcpy(args->manifest, DEFAULT_MANIFEST);
+            }
+            break;
+
+        case 'H': // For the hash algorithm
+            if (strcmp(optarg, "xxh3") == 0)
+                args->hash = HASH_XXH3;
+            else if (strcmp(optarg, "sha256") == 0)
+                args->hash = HASH_SHA256;
+            else
+            {
+                return false;
+            }
+            break;
+
+        case 'm': // For the manifest file
+            strip(optarg);
+            strncpy(args->manifest, optarg, FILENAME_MAX - 1);
+            break;
+
+        case 'k': // For the known hash set
+            strip(optarg);
+            strncpy(args->known_hashes, optarg, FILENAME_MAX - 1);
+            break;
+
+        case 'u': // For the filesystem analysis
+            args->unallocated = true;
+            break;
+
+        case 'L': // For listing the regions, which needs the partition analysis
+            args->list_partitions = true;
+            // fall through
+        case 'P': // For the partition analysis
+            args->partitions = true;
+            break;
+
+        case 'R': // For the regions to scan, e.g. partition1,gap2
+            strip(optarg);
+            snprintf(args->regions, sizeof(args->regions), ",%s,", optarg);
+            break;
+
+        case 'j': // For the number of regions scanned at once
+            args->jobs = atoi(optarg);
+            if (args->jobs < 1)
+            {
+                return false;
+            }
+            break;
+
+        case 'a': // For the header alignment, 0 for the cluster size of the filesystem
+            args->align = atoi(optarg);
+            if (args->align < 0)
+            {
+                return false;
+            }
+            break;
+
+        case 'O': // For direct I/O
+            args->direct = true;
+            break;
+
+        case 'M': // For the read rate limit
+            args->max_read_mbps = atof(optarg);
+            if (args->max_read_mbps <= 0)
+            {
+                return false;
+            }
+            break;
+
+        case 'I': // For the reads per second limit
+            args->max_iops = atoi(optarg);
+            if (args->max_iops < 1)
+            {
+                return false;
+            }
+            break;
+
+        case 'l': // For the latency the read rate backs off at
+            args->max_latency_ms = atof(optarg);
+            if (args->max_latency_ms <= 0)
+            {
+                return false;
+            }
+            break;
+
+        case 'p': // For the I/O scheduling class, e.g. idle or be:7
+        {
+            const char *classes[] = {"", "rt", "be", "idle"}; // In the order of the IO_CLASS_* values
+            char *level = strchr(optarg, ':');
+            if (level)
+            {
+                *level++ = '\0';
+                args->io_level = atoi(level);
+            }
+            args->io_class = IO_CLASS_NONE;
+            for (int i = IO_CLASS_REALTIME; i <= IO_CLASS_IDLE; i++)
+            {
+                if (strcmp(optarg, classes[i]) == 0)
+                {
+                    args->io_class = i;
+                }
+            }
+            if (args->io_class == IO_CLASS_NONE || args->io_level < 0 || args->io_level > 7)
+            {
+                return false;
+            }
+            if (args->io_class == IO_CLASS_IDLE)
+            {
+                args->io_level = 0; // The idle class has no levels
+            }
+            break;
+        }
+
+        case 'B': // For the bad sector map
+            strip(optarg);
+            strncpy(args->bad_map, optarg, FILENAME_MAX - 1);
+            break;
+
+        case 'e': // For the retry pass over the bad sector map
+            args->retry_bad = true;
+            break;
+
+        case 'T': // For the attempts per sector of the retry pass
+            args->retries = atoi(optarg);
+            if (args->retries < 1)
+            {
+                return false;
+            }
+            break;
+
+        case 'y': // For the subdirectories of the carves
+            if (strcmp(optarg, "flat") == 0)
+                args->layout = LAYOUT_FLAT;
+            else if (strcmp(optarg, "counter") == 0)
+                args->layout = LAYOUT_COUNTER;
+            else if (strcmp(optarg, "hash") == 0)
+                args->layout = LAYOUT_HASH;
+            else
+            {
+                return false;
+            }
+            break;
+
+        case 'n': // For naming the carves
+            if (strcmp(optarg, "count") == 0)
+                args->offset_names = false;
+            else if (strcmp(optarg, "offset") == 0)
+                args->offset_names = true;
+            else
+            {
+                return false;
+            }
+            break;
+
+        case 'S': // For dropping the corrupt carves
+            args->skip_corrupt = true;
+            break;
+
+        case 'w': // For the number of output writer threads
+            args->writers = atoi(optarg);
+            if (args->writers < 0)
+            {
+                return false;
+            }
+            break;
+
+        case 'V': // For the number of validation threads
+            args->validators = atoi(optarg);
+            if (args->validators < 0)
+            {
+                return false;
+            }
+            break;
+
+        case 'A': // For the images to scan, a file listing them or a directory holding them
+            if (!method_selected)
+            {
+                strip(optarg);
+                strncpy(args->batch, optarg, FILENAME_MAX - 1);
+                method_selected = true;
+                args->mode = MODE_FILE; // Every image is read as a file
+            }
+            break;
+
+        case 'z': // For the MiB of an image scanned by one batch task
+            args->chunk_size = atoi(optarg);
+            if (args->chunk_size < 1)
+            {
+                return false;
+            }
+            break;
+
+        case 'i': // For reusing the carves of the chunks that did not change since the last scan
+            args->incremental = true;
+            break;
+
+        case 'o': // For the directory of the carves, manifest and checkpoint
+            strip(optarg);
+            strncpy(args->output, optarg, FILENAME_MAX - 1);
+            break;
+
+        case 'g': // For the first byte of the range to scan
+            args->offset = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'N': // For the size of the range to scan, 0 for up to the end
+            args->length = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'G': // For serving scan requests instead of scanning
+            if (!method_selected)
+            {
+                strip(optarg);
+                strncpy(args->daemon, optarg, FILENAME_MAX - 1);
+                method_selected = true;
+            }
+            break;
+
+        case 'x': // For the type of the file extracted, any type when not set
+            strip(optarg);
+            strncpy(args->extract_type, optarg, sizeof(args->extract_type) - 1);
+            break;
+
+        case 'X': // For the offsets to extract at, one per line
+            strip(optarg);
+            strncpy(args->offsets, optarg, FILENAME_MAX - 1);
+            break;
+
+        case 'q': // For printing only the errors
+            args->verbosity = LOG_ERROR;
+            break;
+
+        case 'v': // For more detail, -vv for the most
+            args->verbosity = args->verbosity < LOG_DEBUG ? args->verbosity + 1 : LOG_DEBUG;
+            break;
+
         case 'h': // For printing the help
         default:
-            usage(); // If nothing correct is selected then it prints the usage and exits.
-            exit(EXIT_FAILURE);
+            return false;
         }
     }
 
-    // If no correct option is selected then print usage and exit.
-    if (!method_selected)
+    args->rejected = NULL;
+
+    // Extracting carves the files at the given offsets of one input, the options of an extraction go with nothing else
+    if (args->extract ? args->batch[0] || args->daemon[0] || args->partitions || args->incremental || args->unallocated
+                      : args->extract_type[0] || args->offsets[0])
+    {
+        return false;
+    }
+
+    // An incremental scan splits an image file into chunks, as a batch does
+    if (args->incremental && (args->mode == MODE_DRIVE || args->partitions || args->offset || args->length))
+    {
+        return false;
+    }
+
+    // Without a file, drive, batch or daemon socket there is nothing to do
+    return method_selected;
+}
+
+/**
+ * @brief Parses the command line arguments, printing the usage and exiting when they are incorrect
+ *
+ * @param args The place where all the arguments and relavent information will be stored.
+ * @param argc The argc passed by main
+ * @param argv The argv passed by main
+ */
+void validate_args(cl_args *args, int argc, char *argv[])
+{
+    if (!parse_cl_args(args, argc, argv))
     {
         usage();
         exit(EXIT_FAILURE);
@@ -87,15 +499,217 @@ void usage()
 */
 size_t get_file_size(FILE *file)
 {
-    size_t initial_pt = ftell(file); // Gets the initial location of the file. i.e. The start
-    fseek(file, 0L, SEEK_END);       // Moves to the end
-    size_t file_size = ftell(file);  // Gets the byte-number there, this is the size of the file.
+#ifdef _WIN32
+    __int64 initial_pt = _ftelli64(file); // Gets the initial location of the file. i.e. The start
+    _fseeki64(file, 0L, SEEK_END);        // Moves to the end
+    size_t file_size = _ftelli64(file);   // Gets the byte-number there, this is the size of the file.
+#else
+    off_t initial_pt = ftello(file);     // Gets the initial location of the file. i.e. The start
+    fseeko(file, 0L, SEEK_END);          // Moves to the end
+    size_t file_size = ftello(file);     // Gets the byte-number there, this is the size of the file.
+#endif
 
-    fseek(file, initial_pt, SEEK_SET); // Goes back to the start of the file.
+    seek_file(file, initial_pt); // Goes back to the start of the file.
 
     return file_size; // Returns the file size
 }
 
+/**
+* @brief Moves the file pointer to `offset` bytes from the start, past the 2 GiB limit of fseek
+* @param file The file to seek
+* @param offset The offset from the start of the file
+* @return Returns true on success
+*/
+bool seek_file(FILE *file, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+/**
+* @brief Flushes a file being written to the disk, so it survives a crash of the system and not only of the process
+* @param file The file
+* @return Returns true on success
+*/
+bool sync_file(FILE *file)
+{
+    if (fflush(file) != 0)
+    {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+/**
+* @brief Flushes to the disk what was written to the filesystem holding a directory, e.g. the carves and the manifest
+*        a checkpoint counts, and the entries of the directory itself, e.g. a file renamed into it
+* @param directory The directory
+* @return Returns true on success
+*/
+bool sync_directory(const char *directory)
+{
+#ifdef _WIN32
+    (void)directory; // The files are flushed one by one with sync_file, a directory cannot be
+    return true;
+#else
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return false;
+    }
+#ifdef __linux__
+    bool synced = syncfs(fd) == 0;
+#else
+    sync();
+    bool synced = true;
+#endif
+    synced = fsync(fd) == 0 && synced;
+    close(fd);
+    return synced;
+#endif
+}
+
+/**
+* @brief Cuts the file down to `size` bytes
+* @param filename The file to truncate
+* @param size The new size of the file
+* @return Returns true on success
+*/
+bool truncate_file(char *filename, uint64_t size)
+{
+#ifdef _WIN32
+    FILE *file = fopen(filename, "r+b");
+    if (file == NULL)
+    {
+        return false;
+    }
+    bool truncated = _chsize_s(_fileno(file), (__int64)size) == 0;
+    fclose(file);
+    return truncated;
+#else
+    return truncate(filename, (off_t)size) == 0;
+#endif
+}
+
+/**
+* @brief Allocates a zeroed buffer aligned to a page, or to a huge page when it is large enough to be backed by them.
+*        The alignment is what direct I/O needs, and huge pages keep a large scan buffer from thrashing the TLB.
+* @param size The size of the buffer
+* @return Returns the buffer, the program exits when no memory is left
+*/
+byte_t *buffer_alloc(size_t size)
+{
+#ifdef _WIN32
+    byte_t *ptr = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Reserved huge pages, only there when the administrator set some aside
+    if (size % HUGE_PAGE_SIZE == 0)
+    {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (ptr == MAP_FAILED && size >= HUGE_PAGE_SIZE)
+    {
+        // Transparent huge pages need a huge page aligned mapping, the excess around it is given back
+        byte_t *area = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (area != MAP_FAILED)
+        {
+            size_t head = (HUGE_PAGE_SIZE - (uintptr_t)area % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+            if (head)
+            {
+                munmap(area, head);
+            }
+            munmap(area + head + size, HUGE_PAGE_SIZE - head);
+            ptr = area + head;
+#ifdef MADV_HUGEPAGE
+            madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+        }
+    }
+    if (ptr == MAP_FAILED)
+    {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (ptr == MAP_FAILED)
+    {
+        ptr = NULL;
+    }
+#endif
+    CHECK_OR_EXIT(ptr);
+    return ptr;
+}
+
+/**
+* @brief Frees a buffer of buffer_alloc
+* @param ptr The buffer
+* @param size Its size
+*/
+void buffer_free(byte_t *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+/**
+* @brief Creates a directory and its parents, an existing one is fine
+* @return Returns true if the directory exists afterwards
+*/
+bool make_directory(char *path)
+{
+    // The parents first, e.g. the --output directory of a partition directory
+    for (char *separator = path + 1; *separator; separator++)
+    {
+        if (*separator == '/' || *separator == '\\')
+        {
+            char kept = *separator;
+            *separator = '\0';
+#ifdef _WIN32
+            _mkdir(path);
+#else
+            mkdir(path, 0777);
+#endif
+            *separator = kept;
+        }
+    }
+#ifdef _WIN32
+    return _mkdir(path) == 0 || errno == EEXIST;
+#else
+    return mkdir(path, 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+/**
+* @brief Returns the number of online CPUs, at least 1
+*/
+int cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
 /**
 * @brief Creates a file with filename as the name in the current working directory
 * @param filename The filename of the file to be created
@@ -7,13 +7,55 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wctype.h>
 
 // The Usage string, printed when called for help or incorrect command line args
-#define USAGE_STR "Usage: ./recover.exe --filename <filename, usb.dmp> | --drive <drive, C:> --buffer <buffer_size, >=512> (optional)"
-
-// Minimum and default buffer size.
+#define USAGE_STR "Usage: ./recover.exe --filename <filename, usb.dmp> | --drive <drive, C:> | --batch <list file | directory> | --daemon <socket>" \
+                  " | extract --filename <filename> --offset <bytes> | --offsets <list file> --type <jpeg|png|gif> (optional)" \
+                  " --output <directory> (optional) --offset <bytes> (optional) --length <bytes> (optional)" \
+                  " --buffer <buffer_size, >=512 | auto> (optional)" \
+                  " --checkpoint <checkpoint file> (optional) --checkpoint-every <MiB, 0 disables> (optional) --resume (optional)" \
+                  " --format <auto|raw|gzip|zstd> (optional) --threads <decompression threads> (optional)" \
+                  " --dedup (optional) --hash <xxh3|sha256> (optional) --manifest <manifest file> (optional)" \
+                  " --known-hashes <hash set built by mkhashset> (optional) --unallocated (optional)" \
+                  " --partitions (optional) --list-partitions (optional) --regions <partition1,gap1,...> (optional)" \
+                  " --jobs <regions or batch tasks scanned at once> (optional) --chunk-size <MiB per batch task> (optional)" \
+                  " --incremental (optional)" \
+                  " --align <bytes, 0 for the cluster size> (optional)" \
+                  " --direct (optional) --max-read-mbps <MiB/s> (optional) --max-iops <reads/s> (optional)" \
+                  " --max-latency-ms <ms> (optional) --ioprio <idle|be[:0-7]|rt[:0-7]> (optional)" \
+                  " --bad-map <bad sector map> (optional) --retry-bad (optional) --retries <attempts per sector> (optional)" \
+                  " --writers <output writer threads, 0 writes on the scan thread> (optional)" \
+                  " --validators <JPEG validation threads, 0 validates on the scan thread> (optional)" \
+                  " --layout <flat|counter|hash> (optional) --names <count|offset> (optional) --skip-corrupt (optional) -q | -v | -vv (optional)"
+
+// Minimum buffer size.
 #define MIN_BUFFER_SIZE 512
 
+// The buffer size that tunes the read size on the scan, the default
+#define BUFFER_AUTO 0
+
+// The default checkpoint file, written to the current working directory next to the carves
+#define DEFAULT_CHECKPOINT "recover.checkpoint"
+
+// The default number of MiB scanned between two checkpoints
+#define DEFAULT_CHECKPOINT_INTERVAL 256
+
+// The default map of the unreadable sectors, written next to the carves when there are any
+#define DEFAULT_BAD_MAP "recover.badmap"
+
+// The default attempts at a sector of the bad sector map on a retry pass
+#define DEFAULT_RETRIES 3
+
+// The default number of threads writing the carves
+#define DEFAULT_WRITERS 2
+
+// The default manifest file listing every carve
+#define DEFAULT_MANIFEST "manifest.csv"
+
+// The default MiB of an image scanned by one task of --batch
+#define DEFAULT_CHUNK_SIZE 256
+
 // Sector size
 #define SECTOR_SIZE 512
 
@@ -22,6 +64,9 @@
 #define GIF_TRAILER_SIZE 2
 #define JPEG_TRAILER_SIZE 2
 
+// The size of a huge page, large buffers are aligned to it
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 // The max number of character for a drive name
 #define DRIVE_MAX 4
 
@@ -34,21 +79,95 @@
 
 typedef uint8_t byte_t;
 
+// Storage of the per scan state, every scan job runs on its own thread
+#define THREAD_LOCAL _Thread_local
+
 // Recovery modes, either from an Image/Dump File or from a Drive directly
 #define MODE_DRIVE 1
 #define MODE_FILE 2
 
+// Input formats of an image/dump file
+#define FORMAT_AUTO 0 // Detected from the magic bytes
+#define FORMAT_RAW 1  // Plain image
+#define FORMAT_GZIP 2 // gzip, including multi-member and BGZF blocked files
+#define FORMAT_ZSTD 3 // zstd, single or multi-frame
+
+// Hash algorithms of the carves
+#define HASH_XXH3 0   // 64-bit xxHash3, fast
+#define HASH_SHA256 1 // SHA-256, for when the hashes are used as evidence
+
+// Layouts of the carves, how they are spread over subdirectories of the carve directory
+#define LAYOUT_FLAT 0    // All in the carve directory
+#define LAYOUT_COUNTER 1 // SHARD_FILES carves per subdirectory, 0000, 0001, ... in the order they were found
+#define LAYOUT_HASH 2    // HASH_SHARDS subdirectories, 00 to ff, picked by a hash of the name
+
+// I/O scheduling classes of --ioprio, as numbered by the Linux ioprio_set
+#define IO_CLASS_NONE 0        // Left as it is
+#define IO_CLASS_REALTIME 1    // Served before everything else
+#define IO_CLASS_BEST_EFFORT 2 // The default class
+#define IO_CLASS_IDLE 3        // Only served when the disk is otherwise idle
+
 // A Struct for holding the command-line-args information
 typedef struct cl_args
 {
-    int buffer_size;             // The buffer chosen from the user.
-    char filename[FILENAME_MAX]; // The filename of the image/dump file.
-    char drivename[DRIVE_MAX];   // The drive name if the drive option is selected
-    int mode;                    // The mode in which the data is to be recovered (File or Drive)
+    int buffer_size;                 // The buffer chosen from the user, BUFFER_AUTO to tune it
+    char filename[FILENAME_MAX];     // The filename of the image/dump file.
+    char drivename[DRIVE_MAX];       // The drive name if the drive option is selected
+    int mode;                        // The mode in which the data is to be recovered (File or Drive)
+    char checkpoint[FILENAME_MAX];   // The file the scan progress is periodically saved to
+    int checkpoint_interval;         // The number of MiB scanned between two checkpoints, 0 disables them
+    bool resume;                     // Whether to continue from the checkpoint instead of starting over
+    int format;                      // The input format of the image/dump file
+    int threads;                     // The number of threads used for decompressing blocked images
+    bool dedup;                      // Whether carves with the same content as an earlier carve are dropped
+    int hash;                        // The content hash algorithm of the carves
+    char manifest[FILENAME_MAX];     // The manifest file, empty when none is written
+    char known_hashes[FILENAME_MAX]; // The hash set of known files that are not carved, empty when none
+    bool unallocated;                // Whether only the unallocated space of the filesystem is scanned
+    bool partitions;                 // Whether every partition and gap of the disk is scanned on its own
+    bool list_partitions;            // Whether the partitions and gaps are only listed
+    char regions[256];               // The regions to scan as ",name,name,", empty for all
+    int jobs;                        // The number of regions scanned at once
+    bool direct;                     // Whether the input is read with direct I/O, bypassing the page cache
+    int align;                       // Headers are only looked for at multiples of it, 0 for the cluster size, -1 when not set
+    double max_read_mbps;            // The read rate limit in MiB/s, 0 for none
+    int max_iops;                    // The reads per second limit, 0 for none
+    double max_latency_ms;           // The read latency above which the read rate backs off, 0 for none
+    int io_class;                    // The I/O scheduling class of the scan threads
+    int io_level;                    // The priority within the class, 0 (highest) to 7
+    char bad_map[FILENAME_MAX];      // The map of the sectors that could not be read
+    bool retry_bad;                  // Whether the ranges of the bad sector map are read again with retries
+    int retries;                     // The attempts at each sector of the bad sector map
+    int layout;                      // How the carves are spread over subdirectories, one of the LAYOUT_* values
+    bool offset_names;               // Whether carves are named after their offset in the input instead of a counter
+    bool skip_corrupt;               // Whether carves whose structure is broken are dropped
+    int writers;                     // The number of threads writing the carves, 0 to write them on the scan thread
+    int validators;                  // The number of threads test-decoding the carves, 0 to do it on the scan thread
+    char batch[FILENAME_MAX];        // The list file or directory of the images to scan, empty for a single input
+    int chunk_size;                  // The MiB of an image of the batch scanned by one task
+    bool incremental;                // Whether the chunks of an image that did not change since the last scan are not scanned again
+    char output[FILENAME_MAX];       // The directory of the carves, manifest and checkpoint, empty for the current one
+    uint64_t offset;                 // The first byte of the input to scan
+    uint64_t length;                 // The bytes to scan from there, 0 for up to the end
+    char daemon[FILENAME_MAX];       // The Unix socket scan requests are served on, empty when scanning directly
+    bool extract;                    // Whether the files at given offsets are carved instead of scanning, the extract subcommand
+    char extract_type[8];            // The file type expected at those offsets, empty for any
+    char offsets[FILENAME_MAX];      // The list file of the offsets to extract at, one per line, empty for --offset alone
+    int verbosity;                   // The most verbose log level printed, see log.h
+    const char *rejected;            // The argument the parsing failed at, NULL when the options do not go together
 } cl_args;
 
+bool parse_cl_args(cl_args *args, int argc, char *argv[]);
 void validate_args(cl_args *args, int argc, char *argv[]);
 size_t get_file_size(FILE *file);
+bool seek_file(FILE *file, uint64_t offset);
+bool truncate_file(char *filename, uint64_t size);
+bool sync_file(FILE *file);
+bool sync_directory(const char *directory);
+int cpu_count();
+bool make_directory(char *path);
+byte_t *buffer_alloc(size_t size);
+void buffer_free(byte_t *ptr, size_t size);
 
 void generate_filename(int file_count, char *ext, char *filename_holder);
 void create_file(char *filename, char *mode);
@@ -0,0 +1,321 @@
+#include "validate.h"
+#include "hash.h"
+#include <pthread.h>
+
+// The validators, looked up by the carve type. A validator either walks the carve a block at a time on the scan
+// thread (begin, update, end), for checks as cheap as a CRC, or checks the whole carve on the workers (whole).
+typedef struct validator_type
+{
+    const char *type;                                                       // The file type it checks
+    void (*begin)(validator *check);                                        // Starts a carve
+    void (*update)(validator *check, const byte_t *data, size_t length);    // Walks the next bytes
+    int (*end)(validator *check, int64_t *error_offset);                    // The status of the carve, one of the STATUS_* values
+    int (*whole)(const byte_t *data, size_t length, int64_t *error_offset); // Checks the whole carve, on a worker
+} validator_type;
+
+// The validation workers, shared by every scan job
+typedef struct validation_pool
+{
+    pthread_t *threads;       // The workers
+    int count;                // Their number, 0 when carves are checked on the scan thread
+    validation_job *head;     // The oldest job waiting for a worker
+    validation_job *tail;     // The newest one
+    bool stop;                // Tells the workers to exit
+    pthread_mutex_t lock;     // Guards all of the above and the `done` of the jobs
+    pthread_cond_t work;      // Signalled when a job is queued
+    pthread_cond_t finished;  // Signalled when a job is done
+} validation_pool;
+
+static validation_pool pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER};
+
+static uint32_t read_be32(const byte_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void png_begin(validator *check)
+{
+    memset(&check->png, 0, sizeof(check->png));
+    check->png.phase = PNG_SIGNATURE;
+}
+
+/**
+ * @brief Walks the chunks of a PNG: every chunk has a sane length and type and its CRC matches, the first one is IHDR.
+ *        The CRC is where a fragmented or overwritten carve shows, and it is checked a block at a time.
+ */
+static void png_update(validator *check, const byte_t *data, size_t length)
+{
+    static const byte_t signature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+    png_check *png = &check->png;
+    png->seen += length;
+    uint64_t offset = png->seen - length; // Of data[0] in the carve
+    while (length && png->phase < PNG_COMPLETE)
+    {
+        if (png->phase == PNG_CHUNK_DATA)
+        {
+            size_t n = png->remaining < length ? png->remaining : length;
+            png->crc = crc32_update(png->crc, data, n);
+            png->remaining -= (uint32_t)n;
+            data += n;
+            length -= n;
+            offset += n;
+            if (png->remaining == 0)
+            {
+                png->phase = PNG_CHUNK_CRC;
+            }
+            continue;
+        }
+
+        // The fixed size fields, collected across blocks
+        int size = png->phase == PNG_CHUNK_CRC ? 4 : 8;
+        size_t n = (size_t)(size - png->field_len) < length ? (size_t)(size - png->field_len) : length;
+        memcpy(png->field + png->field_len, data, n);
+        png->field_len += (int)n;
+        data += n;
+        length -= n;
+        offset += n;
+        if (png->field_len < size)
+        {
+            break;
+        }
+        png->field_len = 0;
+
+        if (png->phase == PNG_SIGNATURE)
+        {
+            png->phase = memcmp(png->field, signature, 8) == 0 ? PNG_CHUNK_HEAD : PNG_BROKEN;
+        }
+        else if (png->phase == PNG_CHUNK_HEAD)
+        {
+            png->error = offset - 8; // A broken chunk is reported at its start
+            const byte_t *type = png->field + 4;
+            png->remaining = read_be32(png->field);
+            bool letters = true;
+            for (int i = 0; i < 4; i++)
+            {
+                letters = letters && ((type[i] >= 'A' && type[i] <= 'Z') || (type[i] >= 'a' && type[i] <= 'z'));
+            }
+            if (png->remaining > 0x7FFFFFFF || !letters || (png->chunks == 0 && memcmp(type, "IHDR", 4) != 0))
+            {
+                png->phase = PNG_BROKEN;
+                break;
+            }
+            png->last = memcmp(type, "IEND", 4) == 0;
+            png->crc = crc32_update(0, type, 4);
+            png->phase = png->remaining ? PNG_CHUNK_DATA : PNG_CHUNK_CRC;
+        }
+        else
+        {
+            if (read_be32(png->field) != png->crc)
+            {
+                png->phase = PNG_BROKEN;
+                break;
+            }
+            png->chunks++;
+            png->phase = png->last ? PNG_COMPLETE : PNG_CHUNK_HEAD;
+        }
+    }
+}
+
+/**
+ * @brief Valid when IEND was reached with every CRC matching, truncated when the carve ended before it
+ */
+static int png_end(validator *check, int64_t *error_offset)
+{
+    if (check->png.phase == PNG_COMPLETE)
+    {
+        *error_offset = -1;
+        return STATUS_VALID;
+    }
+    *error_offset = (int64_t)(check->png.phase == PNG_BROKEN ? check->png.error : check->png.seen);
+    return check->png.phase == PNG_BROKEN ? STATUS_CORRUPT : STATUS_TRUNCATED;
+}
+
+static const validator_type validators[] = {
+    {"png", png_begin, png_update, png_end, NULL},
+    {"jpeg", NULL, NULL, NULL, jpeg_validate}};
+
+#define VALIDATOR_COUNT (int)(sizeof(validators) / sizeof(validators[0]))
+
+/**
+ * @brief Starts validating a carve
+ *
+ * @param check The validation state of the carve
+ * @param type The file type of the carve, a type without a validator is left unchecked
+ */
+void validate_begin(validator *check, const char *type)
+{
+    check->kind = -1;
+    for (int i = 0; i < VALIDATOR_COUNT; i++)
+    {
+        if (strcmp(validators[i].type, type) == 0)
+        {
+            check->kind = i;
+            if (validators[i].begin)
+            {
+                validators[i].begin(check);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Validates the next bytes of the carve, called with the staged blocks rather than byte by byte
+ */
+void validate_update(validator *check, const byte_t *data, size_t length)
+{
+    if (check->kind >= 0 && validators[check->kind].update)
+    {
+        validators[check->kind].update(check, data, length);
+    }
+}
+
+/**
+ * @brief Whether the carve type is checked whole on the workers, with validate_submit, rather than as it is staged
+ */
+bool validate_deferred(const validator *check)
+{
+    return check->kind >= 0 && validators[check->kind].whole;
+}
+
+/**
+ * @brief Finishes validating the carve as it was staged
+ *
+ * @param check The validation state of the carve
+ * @param reason Why the carve ended, one of the END_* values
+ * @param error_offset Receives the offset of the first error in the carve, -1 when there is none or it was not checked
+ * @return Its status, one of the STATUS_* values, a carve not checked as it was staged is unchecked unless cut short
+ */
+int validate_end(validator *check, int reason, int64_t *error_offset)
+{
+    *error_offset = -1;
+    if (check->kind < 0 || validators[check->kind].end == NULL)
+    {
+        return reason == END_TRAILER ? STATUS_UNCHECKED : STATUS_TRUNCATED;
+    }
+    return validators[check->kind].end(check, error_offset);
+}
+
+/**
+ * @brief Checks the queued carves until the pool is shut down
+ */
+static void *validation_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;)
+    {
+        if (pool.head == NULL)
+        {
+            if (pool.stop)
+            {
+                break;
+            }
+            pthread_cond_wait(&pool.work, &pool.lock);
+            continue;
+        }
+        validation_job *job = pool.head;
+        pool.head = job->next;
+        pool.tail = pool.head ? pool.tail : NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        int64_t error_offset;
+        int status = validators[job->kind].whole(job->data, job->length, &error_offset);
+
+        pthread_mutex_lock(&pool.lock);
+        job->status = status;
+        job->error_offset = error_offset;
+        job->done = true;
+        pthread_cond_broadcast(&pool.finished);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts the validation workers, so checking a carve never holds up the scan
+ *
+ * @param threads The number of workers, 0 to check the carves on the scan thread
+ */
+void validate_pool_init(int threads)
+{
+    pool.threads = calloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+    CHECK_OR_EXIT(pool.threads);
+    pool.stop = false;
+    for (pool.count = 0; pool.count < threads; pool.count++)
+    {
+        if (pthread_create(&pool.threads[pool.count], NULL, validation_worker, NULL) != 0)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Queues a whole carve for the workers, it has to stay in memory until validate_wait returns
+ *
+ * @param job Receives the result
+ * @param check The validation state of the carve, its type is checked on the workers
+ * @param data The carve
+ * @param length Its size
+ */
+void validate_submit(validation_job *job, const validator *check, const byte_t *data, size_t length)
+{
+    *job = (validation_job){.data = data, .length = length, .kind = check->kind, .error_offset = -1};
+    if (pool.count == 0)
+    {
+        job->status = validators[job->kind].whole(data, length, &job->error_offset);
+        job->done = true;
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail)
+        pool.tail->next = job;
+    else
+        pool.head = job;
+    pool.tail = job;
+    pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * @brief Whether the result of a submitted carve is in
+ */
+bool validate_ready(validation_job *job)
+{
+    pthread_mutex_lock(&pool.lock);
+    bool done = job->done;
+    pthread_mutex_unlock(&pool.lock);
+    return done;
+}
+
+/**
+ * @brief Waits for the result of a submitted carve
+ */
+void validate_wait(validation_job *job)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (!job->done)
+    {
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * @brief Stops the workers, every submitted carve has been waited for by then
+ */
+void validate_pool_shutdown()
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.count; i++)
+    {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.count = 0;
+}
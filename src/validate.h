@@ -0,0 +1,61 @@
+#ifndef __VALIDATE_H__
+#define __VALIDATE_H__
+
+#include "manifest.h"
+
+// Progress of the PNG structure walk
+enum
+{
+    PNG_SIGNATURE,  // Reading the 8 byte signature
+    PNG_CHUNK_HEAD, // Reading the length and type of a chunk
+    PNG_CHUNK_DATA, // Reading the data of a chunk
+    PNG_CHUNK_CRC,  // Reading the CRC of a chunk
+    PNG_COMPLETE,   // The CRC of IEND checked out
+    PNG_BROKEN      // A bad signature, chunk type, length or CRC was found
+};
+
+// State of the PNG structure walk, fed the carve a block at a time
+typedef struct png_check
+{
+    int phase;          // One of the PNG_* values
+    byte_t field[8];    // The signature, chunk head or CRC read so far
+    int field_len;      // Its bytes
+    uint32_t remaining; // The data bytes of the chunk not read yet
+    uint32_t crc;       // The running CRC of the chunk type and data
+    bool last;          // Whether the chunk is IEND
+    uint64_t chunks;    // The chunks whose CRC checked out
+    uint64_t seen;      // The bytes walked
+    uint64_t error;     // The offset of the chunk or field that broke the walk
+} png_check;
+
+// Validation state of a carve
+typedef struct validator
+{
+    int kind;      // The validator of the carve type, -1 for a type without one
+    png_check png; // State of the PNG walk
+} validator;
+
+// A whole carve checked on the validation workers
+typedef struct validation_job
+{
+    const byte_t *data;          // The carve
+    size_t length;               // Its size
+    int kind;                    // The validator of its type
+    int status;                  // The result, one of the STATUS_* values
+    int64_t error_offset;        // The offset of the first error, -1 when there is none
+    bool done;                   // Whether the result is in, guarded by the lock of the workers
+    struct validation_job *next; // The next job in the queue of the workers
+} validation_job;
+
+void validate_begin(validator *check, const char *type);
+void validate_update(validator *check, const byte_t *data, size_t length);
+bool validate_deferred(const validator *check);
+int validate_end(validator *check, int reason, int64_t *error_offset);
+void validate_submit(validation_job *job, const validator *check, const byte_t *data, size_t length);
+bool validate_ready(validation_job *job);
+void validate_wait(validation_job *job);
+void validate_pool_init(int threads);
+void validate_pool_shutdown();
+int jpeg_validate(const byte_t *data, size_t length, int64_t *error_offset);
+
+#endif //__VALIDATE_H__
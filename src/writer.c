@@ -0,0 +1,354 @@
+#define _GNU_SOURCE // fallocate
+#include "output.h"
+#include "log.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#define open _open
+#define write _write
+#define close _close
+#define lseek _lseeki64
+#define ftruncate(fd, size) _chsize_s(fd, size)
+#else
+#include <unistd.h>
+#define O_BINARY 0
+#endif
+
+// A piece of a carve handed to the writers. Every piece names its offset in the file, so
+// the pieces of one carve can be written by different writers in any order.
+typedef struct write_job
+{
+    char filename[FILENAME_MAX]; // The output file
+    uint64_t offset;             // Where `data` goes in the file
+    byte_t *data;                // The bytes, freed once written
+    size_t length;               // Their number
+    int64_t final_size;          // The size of the finished carve, the file is cut to it, -1 while the carve goes on
+    atomic_bool *failed;         // The flag of the scan that submitted it, set when it could not be written
+} write_job;
+
+// A slot of the queue, `sequence` tells whose turn it is as in the log ring (Vyukov's bounded queue):
+// it equals the position for the scan to fill it and the position + 1 for a writer to take it
+typedef struct write_slot
+{
+    atomic_size_t sequence; // The turn of the slot
+    write_job job;          // The piece
+} write_slot;
+
+static write_slot queue[WRITER_SLOTS];       // The pieces waiting for a writer
+static atomic_size_t head;                   // The next position the scan jobs fill
+static atomic_size_t tail;                   // The next position the writers take
+static atomic_size_t pending;                // The pieces submitted and not written yet
+static atomic_size_t pending_bytes;          // Their bytes, the scan waits while they are over WRITER_MAX_BYTES
+static atomic_int idle;                      // The writers asleep on `work`
+static atomic_int waiting;                   // The scan jobs asleep on `room`
+static atomic_bool running;                  // Whether the writers take pieces
+static pthread_t *writers = NULL;            // The writer threads
+static int writer_count = 0;                 // Their number, 0 when the scan writes itself
+static atomic_bool any_failed;               // Whether a piece of any scan could not be written
+static THREAD_LOCAL atomic_bool failed;      // Whether a piece of the scan of this thread could not be written
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // Only held to sleep, never around the queue
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;   // Signalled when a piece is queued
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;   // Signalled when a piece is written
+
+/**
+ * @brief Marks the scan of a piece, and the run, as having lost a carve
+ */
+static void write_failed(write_job *job)
+{
+    log_msg(LOG_ERROR, "Error writing to %s\n", job->filename);
+    atomic_store(job->failed, true);
+    atomic_store(&any_failed, true);
+}
+
+/**
+ * @brief Writes a piece to its file and frees its bytes, a failed open or write (e.g. a full disk) fails its scan
+ */
+static void write_piece(write_job *job)
+{
+    int fd = open(job->filename, O_WRONLY | O_CREAT | O_BINARY, 0644);
+    if (fd < 0)
+    {
+        write_failed(job);
+        free(job->data);
+        return;
+    }
+#ifdef __linux__
+    if (job->offset == 0 && job->final_size > 0 && job->length == (size_t)job->final_size)
+    {
+        // The whole carve at once, its size is known before the first byte is written and it gets one extent.
+        // Filesystems without fallocate refuse it and the carve is written as before.
+        fallocate(fd, 0, 0, job->final_size);
+    }
+#endif
+    bool ok = lseek(fd, (int64_t)job->offset, SEEK_SET) >= 0;
+    for (size_t done = 0; ok && done < job->length;)
+    {
+        long n = write(fd, job->data + done, job->length - done);
+        ok = n > 0;
+        done += ok ? (size_t)n : 0;
+    }
+    if (ok && job->final_size >= 0)
+    {
+        ok = ftruncate(fd, job->final_size) == 0; // A longer file left by an earlier run is cut to the carve
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok)
+    {
+        write_failed(job);
+    }
+    free(job->data);
+}
+
+/**
+ * @brief Takes the oldest piece off the queue
+ *
+ * @return false if the queue is empty
+ */
+static bool dequeue(write_job *job)
+{
+    size_t position = atomic_load_explicit(&tail, memory_order_relaxed);
+    for (;;)
+    {
+        write_slot *slot = &queue[position % WRITER_SLOTS];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == position + 1)
+        {
+            if (atomic_compare_exchange_weak_explicit(&tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                *job = slot->job;
+                atomic_store_explicit(&slot->sequence, position + WRITER_SLOTS, memory_order_release); // Free for the next lap
+                return true;
+            }
+        }
+        else if (sequence < position + 1)
+        {
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&tail, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Puts a piece on the queue
+ *
+ * @return false if the queue is full
+ */
+static bool enqueue(const write_job *job)
+{
+    size_t position = atomic_load_explicit(&head, memory_order_relaxed);
+    for (;;)
+    {
+        write_slot *slot = &queue[position % WRITER_SLOTS];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == position)
+        {
+            if (atomic_compare_exchange_weak_explicit(&head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                slot->job = *job;
+                atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (sequence < position)
+        {
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief Whether a piece is waiting in the queue
+ */
+static bool queued()
+{
+    size_t position = atomic_load_explicit(&tail, memory_order_relaxed);
+    return atomic_load_explicit(&queue[position % WRITER_SLOTS].sequence, memory_order_acquire) == position + 1;
+}
+
+/**
+ * @brief Sleeps on a condition for at most 10 ms, the timeout covers a signal sent just before the wait
+ */
+static void nap(pthread_cond_t *cond)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += 10 * 1000000L;
+    if (until.tv_nsec >= 1000000000L)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, &lock, &until);
+}
+
+/**
+ * @brief A writer thread, writes the queued pieces until the writers are shut down and the queue is empty
+ */
+static void *writer_thread(void *arg)
+{
+    (void)arg;
+    write_job job;
+    for (;;)
+    {
+        if (dequeue(&job))
+        {
+            size_t length = job.length;
+            write_piece(&job);
+            atomic_fetch_sub(&pending_bytes, length);
+            atomic_fetch_sub(&pending, 1);
+            if (atomic_load(&waiting))
+            {
+                pthread_mutex_lock(&lock);
+                pthread_cond_broadcast(&room);
+                pthread_mutex_unlock(&lock);
+            }
+            continue;
+        }
+        if (!atomic_load(&running))
+        {
+            return NULL;
+        }
+        pthread_mutex_lock(&lock);
+        atomic_fetch_add(&idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!queued() && atomic_load(&running))
+        {
+            nap(&work);
+        }
+        atomic_fetch_sub(&idle, 1);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/**
+ * @brief Starts the writer threads, shared by every scan job. With 0 threads the scan writes its carves itself.
+ *
+ * @param threads The number of writer threads
+ */
+void writer_init(int threads)
+{
+    for (size_t i = 0; i < WRITER_SLOTS; i++)
+    {
+        atomic_init(&queue[i].sequence, i);
+    }
+    atomic_store(&running, true);
+    atomic_store(&any_failed, false);
+    writers = calloc(threads > 0 ? threads : 1, sizeof(pthread_t));
+    CHECK_OR_EXIT(writers);
+    for (writer_count = 0; writer_count < threads; writer_count++)
+    {
+        if (pthread_create(&writers[writer_count], NULL, writer_thread, NULL) != 0)
+        {
+            break; // The ones started are enough, with none the scan writes itself
+        }
+    }
+}
+
+/**
+ * @brief Starts a scan on this thread, the pieces it submits from here on are the ones writer_drain answers for
+ */
+void writer_begin()
+{
+    atomic_store(&failed, false);
+}
+
+/**
+ * @brief Hands a piece of a carve to the writers, who free `data` once it is written. When the writers fall behind
+ *        by WRITER_SLOTS pieces or WRITER_MAX_BYTES, the scan waits here for them to catch up.
+ *
+ * @param filename The output file
+ * @param offset Where `data` goes in the file
+ * @param data The bytes, allocated with malloc, NULL for none
+ * @param length Their number
+ * @param final_size The size of the finished carve when this is its last piece, -1 otherwise
+ */
+void writer_submit(const char *filename, uint64_t offset, byte_t *data, size_t length, int64_t final_size)
+{
+    write_job job = {.offset = offset, .data = data, .length = length, .final_size = final_size, .failed = &failed};
+    strncpy(job.filename, filename, FILENAME_MAX - 1);
+    job.filename[FILENAME_MAX - 1] = '\0';
+    if (writer_count == 0)
+    {
+        write_piece(&job);
+        return;
+    }
+
+    atomic_fetch_add(&pending, 1);
+    for (;;)
+    {
+        // A single piece larger than the limit still goes through once the writers are idle
+        size_t in_flight = atomic_load(&pending_bytes);
+        if (in_flight == 0 || in_flight + length <= WRITER_MAX_BYTES)
+        {
+            atomic_fetch_add(&pending_bytes, length);
+            if (enqueue(&job))
+            {
+                break;
+            }
+            atomic_fetch_sub(&pending_bytes, length);
+        }
+        pthread_mutex_lock(&lock);
+        atomic_fetch_add(&waiting, 1);
+        nap(&room);
+        atomic_fetch_sub(&waiting, 1);
+        pthread_mutex_unlock(&lock);
+    }
+
+    atomic_thread_fence(memory_order_seq_cst); // Pairs with the writer checking the queue after going idle
+    if (atomic_load(&idle))
+    {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&work);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/**
+ * @brief Waits until every piece submitted so far is on disk, used before a checkpoint or removing a carve
+ *
+ * @return false if a piece of the scan of this thread could not be written since writer_begin
+ */
+bool writer_drain()
+{
+    while (atomic_load(&pending))
+    {
+        pthread_mutex_lock(&lock);
+        atomic_fetch_add(&waiting, 1);
+        nap(&room);
+        atomic_fetch_sub(&waiting, 1);
+        pthread_mutex_unlock(&lock);
+    }
+    return !atomic_load(&failed);
+}
+
+/**
+ * @brief Writes out the queue and stops the writer threads
+ *
+ * @return false if a piece of any scan could not be written
+ */
+bool writer_shutdown()
+{
+    writer_drain();
+    atomic_store(&running, false);
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < writer_count; i++)
+    {
+        pthread_join(writers[i], NULL);
+    }
+    free(writers);
+    writers = NULL;
+    writer_count = 0;
+    return !atomic_load(&any_failed);
+}